@@ -0,0 +1,67 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/endpoint_map.hpp>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+using endpoint = asio::ip::udp::endpoint;
+
+auto make_endpoints(std::size_t count) -> std::vector<endpoint> {
+    auto rng = std::mt19937{};
+    auto result = std::vector<endpoint>{};
+    result.reserve(count);
+
+    for (auto i = std::size_t(0); i < count; ++i) {
+        // Roughly what a server sees: many addresses, ephemeral ports.
+        result.emplace_back(asio::ip::address_v4(rng()), std::uint16_t(49152 + rng() % 16384));
+    }
+
+    return result;
+}
+
+template <typename Map>
+void run_lookup_benchmark(const char* name, std::size_t count) {
+    constexpr auto LOOKUPS = 4096;
+
+    auto endpoints = make_endpoints(count);
+
+    auto map = Map{};
+
+    for (auto& ep : endpoints) {
+        map.emplace(ep, std::make_shared<int>(0));
+    }
+
+    // Look up in a random order, like packets arriving from many clients.
+    auto order = endpoints;
+    std::shuffle(order.begin(), order.end(), std::mt19937{1});
+    order.resize(std::min<std::size_t>(order.size(), LOOKUPS));
+
+    BENCHMARK(name) {
+        auto found = std::size_t(0);
+        for (auto& ep : order) {
+            found += map.find(ep) != map.end();
+        }
+        return found;
+    };
+}
+
+} // namespace
+
+TEST_CASE("Endpoint lookup", "[endpoint_map]") {
+    using std_map = std::map<endpoint, std::shared_ptr<int>>;
+    using flat_map = trellis::_detail::endpoint_map<std::shared_ptr<int>>;
+
+    run_lookup_benchmark<std_map>("std::map, 1k connections", 1000);
+    run_lookup_benchmark<flat_map>("endpoint_map, 1k connections", 1000);
+    run_lookup_benchmark<std_map>("std::map, 10k connections", 10000);
+    run_lookup_benchmark<flat_map>("endpoint_map, 10k connections", 10000);
+    run_lookup_benchmark<std_map>("std::map, 100k connections", 100000);
+    run_lookup_benchmark<flat_map>("endpoint_map, 100k connections", 100000);
+}
@@ -0,0 +1,93 @@
+#include "catch.hpp"
+#include "context_handler.hpp"
+
+#include <asio.hpp>
+#include <trellis/trellis.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using channel_U = trellis::channel_type_unreliable_unordered<struct U>;
+
+/** A connected client and server, with the networking thread running in the background so sends get flushed. */
+class send_fixture {
+public:
+    using connection_ptr = trellis::client_context<channel_U>::connection_ptr;
+
+    send_fixture() :
+        io(),
+        work(asio::make_work_guard(io)),
+        server(io),
+        client(io),
+        conn() {
+        server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+        client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+        thread = std::thread([this]{ io.run(); });
+
+        auto client_handler = context_handler{
+            client,
+            [&](const auto& conn_ptr) { conn = conn_ptr; },
+            [&](const auto& conn, asio::error_code ec) {},
+            [&](channel_U, const auto& conn, std::istream& packet) {},
+        };
+
+        auto server_handler = context_handler{
+            server,
+            [&](const auto& conn_ptr) {},
+            [&](const auto& conn, asio::error_code ec) {},
+            [&](channel_U, const auto& conn, std::istream& packet) {},
+        };
+
+        while (!conn) {
+            client.wait_for_events(std::chrono::milliseconds{10});
+            client_handler.poll();
+            server_handler.poll();
+        }
+    }
+
+    ~send_fixture() {
+        conn.reset();
+        server.stop();
+        client.stop();
+        work.reset();
+        io.stop();
+        thread.join();
+    }
+
+    asio::io_context io;
+    asio::executor_work_guard<asio::io_context::executor_type> work;
+    trellis::server_context<channel_U> server;
+    trellis::client_context<channel_U> client;
+    connection_ptr conn;
+    std::thread thread;
+};
+
+void run_send_benchmarks(send_fixture& fixture, const char* stream_name, const char* span_name, std::size_t size) {
+    auto data = std::vector<std::byte>(size, std::byte{42});
+
+    BENCHMARK(stream_name) {
+        fixture.conn->send<channel_U>([&](std::ostream& ostream) {
+            ostream.write(reinterpret_cast<const char*>(data.data()), data.size());
+        });
+    };
+
+    BENCHMARK(span_name) {
+        fixture.conn->send<channel_U>(std::span<const std::byte>(data));
+    };
+}
+
+} // namespace
+
+TEST_CASE("Sending from a byte buffer", "[send]") {
+    auto fixture = send_fixture{};
+
+    run_send_benchmarks(fixture, "ostream, 16 B", "span, 16 B", 16);
+    run_send_benchmarks(fixture, "ostream, 1 KB", "span, 1 KB", 1024);
+    run_send_benchmarks(fixture, "ostream, 64 KB", "span, 64 KB", 64 * 1024);
+}
@@ -0,0 +1,107 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/send_window.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+using namespace std::chrono_literals;
+using trellis::_detail::send_window;
+using trellis::_detail::timer_wheel;
+
+struct fragment {
+    trellis::config::sequence_id_t sequence_id;
+    std::size_t fragment_id;
+};
+
+/** How acks used to be handled: a flat list of in-flight fragments, sorted and filtered on every cumulative ack. */
+class sorted_list {
+public:
+    void push(trellis::config::sequence_id_t sequence_id, std::size_t fragment_id) {
+        entries.push_back({sequence_id, fragment_id});
+    }
+
+    void remove_before(trellis::config::sequence_id_t sequence_id) {
+        std::sort(entries.begin(), entries.end(), [](const fragment& a, const fragment& b) {
+            return a.sequence_id < b.sequence_id;
+        });
+
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const fragment& e) {
+            return trellis::_detail::sequence_id_less(e.sequence_id, sequence_id);
+        }), entries.end());
+    }
+
+private:
+    std::vector<fragment> entries;
+};
+
+constexpr auto FRAGMENTS = std::size_t(4);
+
+/** Keeps count messages in flight, acking the oldest and sending a new one on each step. */
+void run_sliding_benchmark(const char* name, std::size_t count) {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto window = send_window<fragment>([](fragment&) {}, [](int) { return timer_wheel::duration(1h); }, wheel);
+    auto next = trellis::config::sequence_id_t(0);
+
+    auto send = [&] {
+        for (auto f = std::size_t(0); f < FRAGMENTS; ++f) {
+            window.push(next, trellis::config::fragment_id_t(f), FRAGMENTS, {next, f});
+        }
+
+        ++next;
+    };
+
+    for (auto i = std::size_t(0); i < count; ++i) {
+        send();
+    }
+
+    BENCHMARK(name) {
+        // Half the fragments are acked selectively before the cumulative ack catches up.
+        auto oldest = trellis::config::sequence_id_t(next - count);
+
+        for (auto f = std::size_t(0); f < FRAGMENTS / 2; ++f) {
+            window.remove(oldest, f, [](fragment&) {});
+        }
+
+        window.remove_before(oldest + 1);
+        send();
+
+        return window.size();
+    };
+}
+
+void run_sorted_list_benchmark(const char* name, std::size_t count) {
+    auto list = sorted_list{};
+    auto next = trellis::config::sequence_id_t(0);
+
+    auto send = [&] {
+        for (auto f = std::size_t(0); f < FRAGMENTS; ++f) {
+            list.push(next, f);
+        }
+
+        ++next;
+    };
+
+    for (auto i = std::size_t(0); i < count; ++i) {
+        send();
+    }
+
+    BENCHMARK(name) {
+        list.remove_before(next - count + 1);
+        send();
+    };
+}
+
+} // namespace
+
+TEST_CASE("Ack processing", "[send_window]") {
+    run_sorted_list_benchmark("sorted list, 1k messages in flight", 1000);
+    run_sliding_benchmark("send_window, 1k messages in flight", 1000);
+    run_sorted_list_benchmark("sorted list, 16k messages in flight", 16000);
+    run_sliding_benchmark("send_window, 16k messages in flight", 16000);
+}
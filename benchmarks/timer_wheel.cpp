@@ -0,0 +1,65 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/guarded_timer.hpp>
+#include <trellis/timer_wheel.hpp>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+using namespace std::chrono_literals;
+
+template <typename Timer, typename... Args>
+void run_rearm_benchmark(const char* name, asio::io_context& io, std::size_t count, Args&... args) {
+    auto guard = std::make_shared<int>(0);
+    auto timers = std::vector<std::unique_ptr<Timer>>{};
+    timers.reserve(count);
+
+    for (auto i = std::size_t(0); i < count; ++i) {
+        timers.push_back(std::make_unique<Timer>(args...));
+    }
+
+    // Every connection pushes its resend timer back, like when an ack arrives.
+    auto rng = std::mt19937{};
+    auto delays = std::vector<std::chrono::milliseconds>{};
+
+    for (auto i = std::size_t(0); i < count; ++i) {
+        delays.emplace_back(50 + rng() % 200);
+    }
+
+    BENCHMARK(name) {
+        for (auto i = std::size_t(0); i < count; ++i) {
+            timers[i]->expires_from_now(delays[i]);
+            timers[i]->async_wait(guard, [](asio::error_code) {});
+        }
+        // An asio timer still has to complete each wait it cancelled.
+        return io.poll();
+    };
+
+    for (auto& timer : timers) {
+        timer->cancel();
+    }
+
+    io.poll();
+}
+
+} // namespace
+
+TEST_CASE("Timer re-arm", "[timer_wheel]") {
+    using trellis::_detail::guarded_timer;
+    using trellis::_detail::timer_wheel;
+    using trellis::_detail::wheel_timer;
+
+    auto io = asio::io_context{};
+    auto executor = io.get_executor();
+    auto wheel = timer_wheel(executor);
+
+    run_rearm_benchmark<guarded_timer<int>>("steady_timer, 1k connections", io, 1000, executor);
+    run_rearm_benchmark<wheel_timer<int>>("timer_wheel, 1k connections", io, 1000, wheel);
+    run_rearm_benchmark<guarded_timer<int>>("steady_timer, 10k connections", io, 10000, executor);
+    run_rearm_benchmark<wheel_timer<int>>("timer_wheel, 10k connections", io, 10000, wheel);
+}
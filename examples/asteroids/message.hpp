@@ -124,3 +124,11 @@ void send_message(const message::any& msg, Conn& conn) {
         archive(msg);
     });
 }
+
+template <typename Channel, typename Context, typename Range>
+void broadcast_message(const message::any& msg, Context& context, const Range& conns) {
+    context.template broadcast<Channel>(conns, [&](auto& ostream) {
+        auto archive = cereal::BinaryOutputArchive(ostream);
+        archive(msg);
+    });
+}
@@ -14,6 +14,7 @@
 #include <cstddef>
 #include <chrono>
 #include <memory>
+#include <vector>
 
 class server_engine {
 public:
@@ -339,10 +340,12 @@ private:
         // Player update messages
         {
             auto msg = message::player_updates{};
+            auto conns = std::vector<connection_ptr>{};
 
             for (auto iter = players.begin(); iter != players.end();) {
                 auto& [endpoint, player] = *iter;
                 if (auto conn = player.conn.lock()) {
+                    conns.push_back(std::move(conn));
                     msg.players.push_back({
                         player.id,
                         player.body->pos,
@@ -363,11 +366,7 @@ private:
                 });
             }
 
-            for (auto& [endpoint, player] : players) {
-                if (auto conn = player.conn.lock()) {
-                    send_message<channel::state_updates>(msg, *conn);
-                }
-            }
+            broadcast_message<channel::state_updates>(msg, server, conns);
         }
 
         timer.expires_from_now(tick_rate);
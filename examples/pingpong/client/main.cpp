@@ -86,11 +86,8 @@ int main() {
 
     client.connect(client_endpoint, server_endpoint);
 
-    auto timer = asio::steady_timer(io);
-
     auto poll = [&](auto& poll) -> void {
-        timer.expires_from_now(std::chrono::milliseconds(10));
-        timer.async_wait([&](asio::error_code ec) {
+        client.async_wait_events([&](asio::error_code ec) {
             if (ec || !client.is_running()) return;
             client.poll_events(pingpong_client{});
             poll(poll);
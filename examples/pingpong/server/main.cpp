@@ -84,11 +84,8 @@ int main() {
     
     server.listen({server_context::protocol::v4(), 6969});
 
-    auto timer = asio::steady_timer(io);
-
     auto poll = [&](auto& poll) -> void {
-        timer.expires_from_now(std::chrono::milliseconds(10));
-        timer.async_wait([&](asio::error_code ec) {
+        server.async_wait_events([&](asio::error_code ec) {
             if (ec || !server.is_running()) return;
             server.poll_events(pingpong_server{});
             poll(poll);
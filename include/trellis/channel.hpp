@@ -28,19 +28,31 @@ public:
 template <typename Connection, typename Tag>
 class channel<Connection, channel_type_reliable_ordered<Tag>> : public channel_reliable_ordered {
 public:
-    using channel_reliable_ordered::channel_reliable_ordered;
+    channel(Connection& conn) :
+        channel_reliable_ordered(conn, index, conn.get_context().get_channel_window(index)) {}
+
+private:
+    static constexpr auto index = std::uint8_t(Connection::traits::template channel_index<channel_type_reliable_ordered<Tag>>);
 };
 
 template <typename Connection, typename Tag>
 class channel<Connection, channel_type_reliable_unordered<Tag>> : public channel_reliable_unordered {
 public:
-    using channel_reliable_unordered::channel_reliable_unordered;
+    channel(Connection& conn) :
+        channel_reliable_unordered(conn, index, conn.get_context().get_channel_window(index)) {}
+
+private:
+    static constexpr auto index = std::uint8_t(Connection::traits::template channel_index<channel_type_reliable_unordered<Tag>>);
 };
 
 template <typename Connection, typename Tag>
 class channel<Connection, channel_type_reliable_sequenced<Tag>> : public channel_reliable_sequenced {
 public:
-    using channel_reliable_sequenced::channel_reliable_sequenced;
+    channel(Connection& conn) :
+        channel_reliable_sequenced(conn, index, conn.get_context().get_channel_window(index)) {}
+
+private:
+    static constexpr auto index = std::uint8_t(Connection::traits::template channel_index<channel_type_reliable_sequenced<Tag>>);
 };
 
 } // namespace trellis::_detail
@@ -1,65 +1,159 @@
 #pragma once
 
+#include "channel_reliable_fwd.hpp"
 #include "config.hpp"
 #include "datagram.hpp"
 #include "fragment_assembler.hpp"
 #include "message_header.hpp"
 #include "logging.hpp"
-#include "retry_queue.hpp"
+#include "rtt_estimator.hpp"
+#include "send_window.hpp"
 #include "streams.hpp"
 #include "connection_stats.hpp"
+#include "utility.hpp"
 
-#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <optional>
+#include <vector>
 
 namespace trellis::_detail {
 
 /**
- * Channel implementing a reliable ordered protocol.
- * NOTE: Currently susceptible to unbounded memory usage.
+ * A slot in a reliable channel's send window, taken by channel_reliable::check_writable.
+ * The message sent with it uses the slot instead of taking another one. If no message does, the slot is given back when the reservation is destroyed.
  */
-class channel_reliable {
+class send_reservation {
 public:
-    using assembler_map = std::unordered_map<config::sequence_id_t, fragment_assembler>;
+    explicit send_reservation(channel_reliable& channel) : channel(&channel) {}
+
+    send_reservation(const send_reservation&) = delete;
+    send_reservation& operator=(const send_reservation&) = delete;
+
+    ~send_reservation();
+
+    /** Hands the slot to a message sent on the given channel. Returns false if the slot belongs to another channel or was already used. */
+    auto take(const channel_reliable& target) -> bool {
+        if (channel != &target) {
+            return false;
+        }
+
+        channel = nullptr;
+        return true;
+    }
+
+private:
+    channel_reliable* channel;
+};
 
-    channel_reliable(connection_base& conn) :
+/**
+ * Base for the reliable channels.
+ * Sent messages beyond the send window wait in the channel until the oldest unacked message is acked.
+ * Received fragments beyond the receive window are dropped without an ack, so the sender resends them later.
+ * Messages being received are reassembled in a ring of assemblers indexed by sequence ID, starting at incoming_sequence_id.
+ * The ring grows to cover the messages in flight, up to the receive window, and is reused from then on.
+ * A fragment is kept as a datagram and an optional body sent right after it. Broadcasts use the body to share one payload between many connections,
+ * so the datagram only holds this connection's header.
+ */
+class channel_reliable {
+public:
+    channel_reliable(connection_base& conn, std::uint8_t channel_id, const channel_window& window) :
         conn(&conn),
+        channel_id(channel_id),
         sequence_id(0),
         incoming_sequence_id(0),
-        last_expected_sequence_id(0),
         assemblers(),
-        outgoing_queue(conn.get_context().get_io(), conn.get_context().get_executor(), [this](const outgoing_entry& e){ send_outgoing(e); }) {}
+        num_assemblers(0),
+        resends(0),
+        fast_resends(0),
+        window(window),
+        blocked(),
+        num_blocked(0),
+        outstanding(0),
+        wants_writable(false),
+        held_fragments(0),
+        receive_bytes(0),
+        outgoing_queue(
+            [this](outgoing_entry& e){ send_outgoing(e); },
+            [&conn](int attempts){ return conn.rtt.get_timeout(attempts); },
+            conn.get_context().get_timer_wheel()) {}
 
     channel_reliable(const channel_reliable&) = delete;
     channel_reliable(channel_reliable&&) = delete;
 
-    auto next_sequence_id() -> config::sequence_id_t {
-        return sequence_id++;
+    /**
+     * Takes a slot in the send window for one message, to be passed to the message as a send_reservation. Safe to call from any thread.
+     * If the window is full, returns false and the application is notified once it has room.
+     */
+    auto check_writable() -> bool {
+        if (try_reserve()) {
+            return true;
+        }
+
+        wants_writable.store(true);
+
+        // The window may have moved before the flag was set, in which case nobody would notify us. At worst, this causes a spurious notification.
+        return try_reserve();
+    }
+
+    /** Gives back a slot taken by check_writable that no message has used. Safe to call from any thread. */
+    void release_reservation() {
+        conn->get_context().dispatch([this, conn_ptr = conn->shared_from_this()] {
+            finish_messages(1);
+        });
     }
 
-    void receive_ack(const headers::data_ack& header) {
+    /** Handles one channel's DATA_ACK block. */
+    void receive_ack(const headers::data_ack& header, const headers::data_ack_range* ranges) {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
-        TRELLIS_LOG_ACTION("channel", +header.channel_id, "Received DATA_ACK (sid:", header.sequence_id, ",fid:", +header.fragment_id, "eid:", header.expected_sequence_id, ").");
+        TRELLIS_LOG_ACTION("channel", +header.channel_id, "Received DATA_ACK (eid:", header.expected_sequence_id, ",ranges:", +header.range_count, ").");
 
-        [[maybe_unused]] auto success = false;
+        auto now = clock_type::now();
+        auto newest_sent = std::optional<clock_type::time_point>{};
+        auto span = outgoing_queue.span();
+        auto acked = outgoing_queue.remove_before(header.expected_sequence_id);
 
-        if (sequence_id_less(last_expected_sequence_id, header.expected_sequence_id)) {
-            success = outgoing_queue.remove_all_if([&](const outgoing_entry& e) {
-                return
-                    sequence_id_less(e.header.sequence_id, header.expected_sequence_id) ||
-                    (e.header.sequence_id == header.sequence_id && e.header.fragment_id == header.fragment_id);
-            }, conn->weak_from_this());
+        // Only packets acked by their own range give an RTT sample, and only if they were never resent.
+        // The newest one has spent the least time waiting for the ack to be flushed.
+        auto sample = [&](const outgoing_entry& e) {
+            if (!e.resent && (!newest_sent || *newest_sent < e.sent)) {
+                newest_sent = e.sent;
+            }
+        };
 
-            last_expected_sequence_id = header.expected_sequence_id;
-        } else {
-            success = outgoing_queue.remove_one_if([&](const outgoing_entry& e) {
-                return e.header.sequence_id == header.sequence_id && e.header.fragment_id == header.fragment_id;
-            }, conn->weak_from_this());
+        for (auto i = 0; i < header.range_count; ++i) {
+            auto& range = ranges[i];
+
+            for (auto bits = range.fragments; bits != 0; bits &= bits - 1) {
+                auto fragment_id = std::size_t(range.first_fragment) + count_trailing_zeros(bits);
+
+                acked += outgoing_queue.remove(range.sequence_id, fragment_id, sample);
+            }
         }
 
-        if (success) {
-            TRELLIS_LOG_ACTION("channel", +header.channel_id, "DATA_ACK corresponded to outgoing packet.");
+        auto rtt_sample = std::optional<clock_type::duration>{};
+
+        if (newest_sent) {
+            rtt_sample = now - *newest_sent;
+            conn->rtt.sample(*rtt_sample);
+        }
+
+        // Fragments that newer acked ones have overtaken are most likely lost, so don't wait for their timers.
+        if (auto resent = outgoing_queue.resend_lost(config::fast_retransmit_threshold); resent > 0) {
+            TRELLIS_LOG_ACTION("channel", +header.channel_id, "Fast resent ", resent, " outgoing packets.");
+            fast_resends.fetch_add(resent, std::memory_order_relaxed);
+        }
+
+        if (acked > 0) {
+            TRELLIS_LOG_ACTION("channel", +header.channel_id, "DATA_ACK corresponded to ", acked, " outgoing packets.");
+            held_fragments.fetch_sub(acked, std::memory_order_relaxed);
+            finish_messages(span - outgoing_queue.span());
+            release_blocked();
+            conn->on_reliable_acked(acked, rtt_sample);
         } else {
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "DATA_ACK did not correspond to any outgoing packet.");
         }
@@ -68,71 +162,231 @@ public:
     auto get_stats() const -> connection_stats {
         return {
             int(outgoing_queue.size()),
-            int(assemblers.size()),
+            int(num_assemblers.load(std::memory_order_relaxed)),
+            int(num_blocked.load(std::memory_order_relaxed)),
+            held_fragments.load(std::memory_order_relaxed) * conn->get_max_datagram_size(),
+            receive_bytes.load(std::memory_order_relaxed),
+            resends.load(std::memory_order_relaxed),
+            fast_resends.load(std::memory_order_relaxed),
+            {},
+            {},
+            {},
+            0,
+            0,
         };
     }
 
 protected:
+    using clock_type = rtt_estimator::clock_type;
+
     struct outgoing_entry {
         headers::data header;
         shared_datagram_buffer datagram;
         std::size_t size;
+        shared_datagram_buffer body;
+        std::size_t body_size;
+        clock_type::time_point sent;
+        bool resent;
+    };
+
+    struct blocked_fragment {
+        headers::data header;
+        shared_datagram_buffer datagram;
+        std::size_t size;
+        shared_datagram_buffer body;
+        std::size_t body_size;
     };
 
-    void send_packet_impl(const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size) {
-        conn->get_context().dispatch([this, header, datagram, size, conn_ptr = conn->shared_from_this()]{
-            conn->send_raw(datagram, size);
+    /**
+     * Sends the fragment datagrams in [b, e) as one message. Every fragment is size bytes long, except the last one, which is last_size bytes.
+     * If shared is set, the buffers are instead bodies holding only the payload, which may be shared with other connections,
+     * and the sizes are payload sizes. Each fragment then gets a datagram of its own for the header, sent in front of its body.
+     * The message counts against the send window right away, but it is only numbered and given its headers on the networking thread.
+     * That way messages enter the send window in sequence ID order, even when several threads send at once.
+     * on_numbered is called with the sequence ID before any fragment is queued.
+     * If reservation holds a slot taken from this channel by check_writable, the message uses it instead of taking another.
+     */
+    template <typename Iter, typename F>
+    void send_message_impl(Iter b, Iter e, std::size_t size, std::size_t last_size, bool shared, send_reservation* reservation, const F& on_numbered) {
+        assert(b != e);
+
+        if (!reservation || !reservation->take(*this)) {
+            outstanding.fetch_add(1);
+        }
+
+        conn->get_context().dispatch([this, first = *b, rest = std::vector<shared_datagram_buffer>(std::next(b), e), size, last_size, shared, on_numbered, conn_ptr = conn->shared_from_this()]() mutable {
+            auto type = headers::type::DATA;
+            auto header = headers::data{};
+            header.sequence_id = sequence_id++;
+            header.channel_id = channel_id;
+            header.fragment_count = config::fragment_id_t(rest.size() + 1);
+
+            TRELLIS_LOG_ACTION("channel", +channel_id, "Sending message (sid:", header.sequence_id, ",fragments:", +header.fragment_count, ").");
+
+            on_numbered(header.sequence_id);
+
+            for (auto i = std::size_t(0); i < header.fragment_count; ++i) {
+                auto& buffer = i == 0 ? first : rest[i - 1];
+                auto fragment_size = i + 1 == header.fragment_count ? last_size : size;
+
+                header.fragment_id = config::fragment_id_t(i);
+
+                if (shared) {
+                    auto datagram = conn->make_pending_buffer();
+
+                    std::memcpy(datagram.data(), &type, sizeof(type));
+                    std::memcpy(datagram.data() + sizeof(type), &header, sizeof(header));
+
+                    queue_fragment(header, datagram, headers::data_offset, buffer, fragment_size);
+                } else {
+                    std::memcpy(buffer.data(), &type, sizeof(type));
+                    std::memcpy(buffer.data() + sizeof(type), &header, sizeof(header));
+
+                    queue_fragment(header, buffer, fragment_size, {}, 0);
+                }
+            }
+        });
+    }
+
+    /** Sends a numbered fragment, or blocks it until the send window has room. */
+    void queue_fragment(const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size, const shared_datagram_buffer& body, std::size_t body_size) {
+        // should only be called from send_message_impl, so we should be in the networking thread
+        assert(conn->get_context().is_thread_current());
+
+        held_fragments.fetch_add(1, std::memory_order_relaxed);
+
+        // Later fragments of a message that is already in the window never wait behind it.
+        if (blocked.empty() && (outgoing_queue.is_open(header.sequence_id) || outgoing_queue.span() < window.send)) {
+            outgoing_queue.open(header.sequence_id);
+            conn->send_reliable(*this, header, datagram, size, body, body_size);
+        } else {
+            TRELLIS_LOG_ACTION("channel", +header.channel_id, "Send window full, blocking message ", header.sequence_id, ".");
+            blocked.push_back({header, datagram, size, body, body_size});
+            num_blocked.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /** Takes a slot in the send window if there is one. The check and the increment are one step, so concurrent callers can't overfill the window. */
+    auto try_reserve() -> bool {
+        auto count = outstanding.load();
+
+        while (count < window.send) {
+            if (outstanding.compare_exchange_weak(count, count + 1)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /** Records that messages have left the send window, and notifies the application if it was waiting for room. */
+    void finish_messages(std::size_t count) {
+        if (count == 0) return;
+
+        if (outstanding.fetch_sub(count) - count < window.send && wants_writable.exchange(false)) {
+            TRELLIS_LOG_ACTION("channel", +channel_id, "Send window has room again, notifying.");
+            conn->get_context().notify_writable(*conn, channel_id);
+        }
+    }
+
+    /** Sends blocked fragments while the send window has room for them. */
+    void release_blocked() {
+        while (!blocked.empty() && (outgoing_queue.is_open(blocked.front().header.sequence_id) || outgoing_queue.span() < window.send)) {
+            auto fragment = std::move(blocked.front());
+            blocked.pop_front();
+            num_blocked.fetch_sub(1, std::memory_order_relaxed);
+
+            outgoing_queue.open(fragment.header.sequence_id);
+            conn->send_reliable(*this, fragment.header, fragment.datagram, fragment.size, fragment.body, fragment.body_size);
+        }
+    }
+
+    /** Sends a fragment and starts waiting for its ack. Returns false if its message was already acked, so it isn't in flight. */
+    auto transmit(const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size, const shared_datagram_buffer& body, std::size_t body_size) -> bool {
+        // should only be called from the connection's send queue, so we should be in the networking thread
+        assert(conn->get_context().is_thread_current());
+
+        conn->send_raw(datagram, size, body, body_size);
 
-            outgoing_queue.push({
-                header,
-                datagram,
-                size,
-            }, conn_ptr);
+        auto pushed = outgoing_queue.push(header.sequence_id, header.fragment_id, header.fragment_count, {
+            header,
+            datagram,
+            size,
+            body,
+            body_size,
+            clock_type::now(),
+            false,
         });
+
+        if (!pushed) {
+            held_fragments.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        return pushed;
     }
 
-    void send_outgoing(const outgoing_entry& entry) {
-        // should only be called from the outgoing_queue's timer, so we should be in the networking thread
+    /** Stops waiting for acks of every message before the given sequence ID. */
+    void drop_before(config::sequence_id_t sid) {
+        auto span = outgoing_queue.span();
+        auto dropped = outgoing_queue.remove_before(sid);
+
+        held_fragments.fetch_sub(dropped, std::memory_order_relaxed);
+        finish_messages(span - outgoing_queue.span());
+        release_blocked();
+        conn->on_reliable_dropped(dropped);
+    }
+
+    void send_outgoing(outgoing_entry& entry) {
+        // should only be called from the outgoing_queue's timers, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
         TRELLIS_LOG_ACTION("channel", +entry.header.channel_id, "Resending outgoing packet (", entry.header.sequence_id, ").");
-        conn->send_raw(entry.datagram, entry.size);
+        conn->on_reliable_lost(entry.sent);
+        conn->resend_reliable(entry.datagram, entry.size, entry.body, entry.body_size);
+
+        entry.resent = true;
+        ++resends;
     }
 
-    auto receive_impl(const headers::data& header, const datagram_buffer& datagram, size_t count) -> std::optional<assembler_map::iterator> {
+    /** Receives a fragment. Returns the message's assembler if the fragment completed it, or nullptr. */
+    auto receive_impl(const headers::data& header, const shared_datagram_buffer& datagram, size_t count) -> fragment_assembler* {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
         assert(count >= headers::data_offset);
-        assert(count <= config::datagram_size);
+        assert(count <= config::max_datagram_size);
         assert(header.fragment_id < header.fragment_count);
 
         TRELLIS_LOG_ACTION("channel", +header.channel_id, "Processing message ", header.sequence_id, " as fragment piece ", +header.fragment_id, " / ", +header.fragment_count, ".");
 
         if (sequence_id_less(header.sequence_id, incoming_sequence_id)) {
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message ", header.sequence_id, ", fragment piece ", +header.fragment_id, " received duplicate. Expected: ", incoming_sequence_id, ".");
-            conn->send_ack(header.channel_id, header.sequence_id, incoming_sequence_id, header.fragment_id);
-            return std::nullopt;
+            conn->queue_ack(header.channel_id, header.sequence_id, incoming_sequence_id, header.fragment_id);
+            return nullptr;
         }
 
-        auto iter = assemblers.find(header.sequence_id);
+        if (config::sequence_id_t(header.sequence_id - incoming_sequence_id) >= window.receive) {
+            // Don't ack the fragment, the sender will retry once the window has moved.
+            TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message ", header.sequence_id, " is outside the receive window. Expected: ", incoming_sequence_id, ".");
+            return nullptr;
+        }
 
-        if (iter == assemblers.end()) {
-            auto [new_iter, success] = assemblers.emplace(
-                std::piecewise_construct,
-                std::forward_as_tuple(header.sequence_id),
-                std::forward_as_tuple(header.sequence_id, header.fragment_count));
+        auto& assembler = get_assembler(header.sequence_id);
 
-            assert(success);
+        if (!assembler.get_sequence_id()) {
+            if (!assembler.reset(conn->get_context().get_message_pool(), header.sequence_id, header.fragment_count, conn->get_max_datagram_size() - headers::data_offset)) {
+                // Don't ack the fragment, the sender will retry once memory has been freed.
+                TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message memory cap reached, dropping fragment ", +header.fragment_id, " of message ", header.sequence_id, ".");
+                return nullptr;
+            }
 
-            iter = new_iter;
+            receive_bytes.fetch_add(reserved_bytes(header.fragment_count), std::memory_order_relaxed);
+            num_assemblers.fetch_add(1, std::memory_order_relaxed);
         }
 
-        auto& assembler = iter->second;
-
         assert(assembler.get_sequence_id() == header.sequence_id);
 
-        auto result = std::optional<assembler_map::iterator>{};
+        auto result = (fragment_assembler*)nullptr;
 
         if (assembler.has_fragment(header.fragment_id)) {
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "Assembler for sequence_id ", header.sequence_id, " already has fragment ", +header.fragment_id, ". Ignoring.");
@@ -142,28 +396,181 @@ protected:
         } else {
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "Handing packet to assembler for sequence_id ", header.sequence_id, ".");
 
-            auto b = datagram.data.data() + headers::data_offset;
-            auto e = datagram.data.data() + count;
-            assembler.receive(header, b, e);
+            if (!assembler.receive(header, datagram, count)) {
+                // Don't ack the fragment, it doesn't fit the ones already received.
+                TRELLIS_LOG_ACTION("channel", +header.channel_id, "Fragment ", +header.fragment_id, " of message ", header.sequence_id, " doesn't fit the others. Dropping.");
+                return nullptr;
+            }
 
             if (assembler.is_complete()) {
                 TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message reassembly is complete, calling on_complete_func.");
 
-                result = iter;
+                result = &assembler;
             }
         }
 
-        conn->send_ack(header.channel_id, header.sequence_id, incoming_sequence_id, header.fragment_id);
+        conn->queue_ack(header.channel_id, header.sequence_id, incoming_sequence_id, header.fragment_id);
 
         return result;
     }
 
+    /** Hands a completed message over to the caller. */
+    auto take_message(fragment_assembler& assembler) -> raw_buffer {
+        receive_bytes.fetch_sub(reserved_bytes(assembler.get_fragment_count()), std::memory_order_relaxed);
+        return assembler.release();
+    }
+
+    /** Gets the assembler for the message, if it has one. The message must be within the receive window. */
+    auto find_assembler(config::sequence_id_t sid) -> fragment_assembler* {
+        if (assemblers.empty()) return nullptr;
+
+        auto& assembler = assemblers[sid & (assemblers.size() - 1)];
+
+        return assembler.get_sequence_id() == sid ? &assembler : nullptr;
+    }
+
+    /** Gets the ring slot for the message, growing the ring if it doesn't reach that far yet. */
+    auto get_assembler(config::sequence_id_t sid) -> fragment_assembler& {
+        auto needed = std::size_t(config::sequence_id_t(sid - incoming_sequence_id)) + 1;
+
+        if (needed > assemblers.size()) {
+            auto capacity = std::max<std::size_t>(assemblers.size(), 16);
+
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+
+            auto grown = std::vector<fragment_assembler>(capacity);
+
+            for (auto& assembler : assemblers) {
+                if (auto& id = assembler.get_sequence_id()) {
+                    grown[*id & (capacity - 1)] = std::move(assembler);
+                }
+            }
+
+            assemblers = std::move(grown);
+        }
+
+        auto& assembler = assemblers[sid & (assemblers.size() - 1)];
+
+        // Everything in the ring is within the receive window, so slots never collide.
+        assert(!assembler.get_sequence_id() || assembler.get_sequence_id() == sid);
+
+        return assembler;
+    }
+
+    /** Empties a message's slot, once it has been delivered or skipped. */
+    void erase_assembler(fragment_assembler& assembler) {
+        if (!assembler.is_cancelled()) {
+            receive_bytes.fetch_sub(reserved_bytes(assembler.get_fragment_count()), std::memory_order_relaxed);
+        }
+
+        assembler.clear();
+        num_assemblers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /** Gets the memory an assembler reserves for a message, which is sized for the largest fragments the peer may send. */
+    auto reserved_bytes(config::fragment_id_t fragment_count) const -> std::uint64_t {
+        return std::uint64_t(fragment_count) * (conn->get_max_datagram_size() - headers::data_offset);
+    }
+
     connection_base* conn;
+    std::uint8_t channel_id;
     std::atomic<config::sequence_id_t> sequence_id;
     config::sequence_id_t incoming_sequence_id;
-    config::sequence_id_t last_expected_sequence_id;
-    assembler_map assemblers;
-    retry_queue<outgoing_entry, connection_base, context_base::executor_type> outgoing_queue;
+    std::vector<fragment_assembler> assemblers;
+    std::atomic<std::size_t> num_assemblers;
+    std::atomic<std::uint64_t> resends;
+    std::atomic<std::uint64_t> fast_resends;
+    channel_window window;
+    std::deque<blocked_fragment> blocked;
+    std::atomic<std::size_t> num_blocked;
+    std::atomic<std::size_t> outstanding;
+    std::atomic<bool> wants_writable;
+    std::atomic<std::uint64_t> held_fragments;
+    std::atomic<std::uint64_t> receive_bytes;
+    send_window<outgoing_entry> outgoing_queue;
+
+    friend connection_base;
 };
 
+inline send_reservation::~send_reservation() {
+    if (channel) {
+        channel->release_reservation();
+    }
+}
+
 } // namespace trellis::_detail
+
+namespace trellis {
+
+inline void connection_base::send_reliable(_detail::channel_reliable& channel, const _detail::headers::data& header, const _detail::shared_datagram_buffer& datagram, std::size_t size, const _detail::shared_datagram_buffer& body, std::size_t body_size) {
+    // should only be called from a reliable channel's send, so we should be in the networking thread
+    assert(get_context().is_thread_current());
+
+    if (!congestion) {
+        if (channel.transmit(header, datagram, size, body, body_size)) {
+            in_flight.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        return;
+    }
+
+    send_queue.push_back({&channel, header, datagram, size, body, body_size});
+    send_queued();
+}
+
+inline void connection_base::send_queued() {
+    // should only be called from this connection, so we should be in the networking thread
+    assert(get_context().is_thread_current());
+    assert(congestion);
+
+    if (state == connection_state::DISCONNECTED) {
+        send_queue.clear();
+        resend_queue.clear();
+        pacing_timer.cancel();
+        return;
+    }
+
+    using clock_type = _detail::rtt_estimator::clock_type;
+
+    auto now = clock_type::now();
+    auto window = congestion->get_window();
+
+    // Without an RTT estimate there is nothing to pace against, so the interval is zero.
+    auto interval = std::chrono::duration_cast<clock_type::duration>(rtt.get_smoothed_rtt() / (double(std::max<std::size_t>(window, 1)) * config::pacing_gain));
+    auto burst = std::max<clock_type::duration>(interval * std::int64_t(config::pacing_burst), _detail::timer_wheel::tick());
+
+    while (!resend_queue.empty() || (!send_queue.empty() && in_flight.load(std::memory_order_relaxed) < window)) {
+        if (next_send_time > now) {
+            pacing_timer.expires_at(next_send_time);
+            pacing_timer.async_wait(weak_from_this(), [this](asio::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+
+                send_queued();
+            });
+            return;
+        }
+
+        if (!resend_queue.empty()) {
+            auto resend = std::move(resend_queue.front());
+            resend_queue.pop_front();
+
+            send_raw(resend.datagram, resend.size, resend.body, resend.body_size);
+        } else {
+            auto fragment = std::move(send_queue.front());
+            send_queue.pop_front();
+
+            if (fragment.channel->transmit(fragment.header, fragment.datagram, fragment.size, fragment.body, fragment.body_size)) {
+                in_flight.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // An idle connection may only bank a short burst.
+        next_send_time = std::max(next_send_time, now - burst) + interval;
+    }
+}
+
+} // namespace trellis
@@ -4,4 +4,6 @@ namespace trellis::_detail {
 
 class channel_reliable;
 
+class send_reservation;
+
 } // namespace trellis::_detail
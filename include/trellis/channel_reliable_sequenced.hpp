@@ -4,46 +4,35 @@
 
 namespace trellis::_detail {
 
-/**
- * Channel implementing a reliable sequenced protocol.
- * NOTE: Currently susceptible to unbounded memory usage.
- */
+/** Channel implementing a reliable sequenced protocol. */
 class channel_reliable_sequenced : public channel_reliable {
 public:
-    channel_reliable_sequenced(connection_base& conn) : channel_reliable(conn) {}
+    channel_reliable_sequenced(connection_base& conn, std::uint8_t channel_id, const channel_window& window) : channel_reliable(conn, channel_id, window) {}
 
-    void send_packet(const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size) {
-        conn->get_context().dispatch([this, header, datagram, size, conn_ptr = conn->shared_from_this()]{
+    /** See channel_reliable::send_message_impl. */
+    template <typename Iter>
+    void send_message(Iter b, Iter e, std::size_t size, std::size_t last_size, bool shared, send_reservation* reservation) {
+        send_message_impl(b, e, size, last_size, shared, reservation, [this](config::sequence_id_t sid) {
             // Forget all outgoing packets except for the latest in the sequence.
-            outgoing_queue.remove_all_if([&](const outgoing_entry& e) {
-                return sequence_id_less(e.header.sequence_id, header.sequence_id);
-            }, conn_ptr);
-
-            send_packet_impl(header, datagram, size);
+            drop_before(sid);
         });
     }
 
     template <typename F>
-    void receive(const headers::data& header, const datagram_buffer& datagram, size_t count, const F& on_receive_func) {
+    void receive(const headers::data& header, const shared_datagram_buffer& datagram, size_t count, const F& on_receive_func) {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
-        if (auto result = receive_impl(header, datagram, count)) {
-            auto iter = *result;
-
-            auto& assembler = iter->second;
-
-            assert(!assembler.is_cancelled());
+        if (auto assembler = receive_impl(header, datagram, count)) {
+            assert(!assembler->is_cancelled());
 
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "Calling on_receive_func for sequence_id ", incoming_sequence_id, ".");
 
-            on_receive_func(raw_buffer{assembler.release(), assembler.size()});
+            on_receive_func(take_message(*assembler));
 
             for (auto i = incoming_sequence_id; !sequence_id_less(header.sequence_id, i); ++i) {
-                auto iter = assemblers.find(i);
-
-                if (iter != assemblers.end()) {
-                    assemblers.erase(iter);
+                if (auto skipped = find_assembler(i)) {
+                    erase_assembler(*skipped);
                 }
             }
 
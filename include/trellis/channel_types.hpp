@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 namespace trellis {
 
 /** Describes a channel which is unreliable and unordered. */
@@ -32,4 +34,20 @@ struct channel_type_reliable_sequenced {
     using tag_t = T;
 };
 
+/** Determines whether a channel type guarantees delivery. */
+template <typename ChannelType>
+struct is_reliable_channel : std::false_type {};
+
+template <typename T>
+struct is_reliable_channel<channel_type_reliable_ordered<T>> : std::true_type {};
+
+template <typename T>
+struct is_reliable_channel<channel_type_reliable_unordered<T>> : std::true_type {};
+
+template <typename T>
+struct is_reliable_channel<channel_type_reliable_sequenced<T>> : std::true_type {};
+
+template <typename ChannelType>
+inline constexpr bool is_reliable_channel_v = is_reliable_channel<ChannelType>::value;
+
 } // namespace trellis
@@ -28,15 +28,15 @@ public:
         return sequence_id++;
     }
 
-    void send_packet([[maybe_unused]] const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size) {
-        conn->send_raw(datagram, size);
+    void send_packet([[maybe_unused]] const headers::data& header, const shared_datagram_buffer& datagram, std::size_t size, const shared_datagram_buffer& body = {}, std::size_t body_size = 0) {
+        conn->send_raw(datagram, size, body, body_size);
     }
 
-    void receive_ack(const headers::data_ack& header) {
+    void receive_ack(const headers::data_ack& header, [[maybe_unused]] const headers::data_ack_range* ranges) {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
-        TRELLIS_LOG_ACTION("channel", +header.channel_id, "Received unexpected DATA_ACK (sid:", header.sequence_id, ",fid:", header.fragment_id, "). Disconnecting.");
+        TRELLIS_LOG_ACTION("channel", +header.channel_id, "Received unexpected DATA_ACK (eid:", header.expected_sequence_id, "). Disconnecting.");
         conn->disconnect();
     }
 
@@ -44,15 +44,25 @@ public:
         return {
             0,
             int(assemblers.size()),
+            0,
+            0,
+            0,
+            0,
+            0,
+            {},
+            {},
+            {},
+            0,
+            0,
         };
     }
 
 protected:
-    auto receive_impl(const headers::data& header, const datagram_buffer& datagram, size_t count) -> std::optional<raw_buffer> {
+    auto receive_impl(const headers::data& header, const shared_datagram_buffer& datagram, size_t count) -> std::optional<raw_buffer> {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
-        assert(count <= config::datagram_size);
+        assert(count <= config::max_datagram_size);
         assert(count >= headers::data_offset);
 
         if (header.fragment_count == 1) {
@@ -62,16 +72,8 @@ protected:
 
             assert(header.fragment_id == 0);
 
-            auto b = datagram.data.data() + headers::data_offset;
-            auto e = datagram.data.data() + count;
-
-            assert(count <= config::datagram_size);
-
-            auto data = std::make_unique<char[]>(e - b);
-
-            std::copy(b, e, data.get());
-
-            return raw_buffer{std::move(data), static_cast<std::size_t>(e - b)};
+            // The message shares the received datagram, no copy needed.
+            return raw_buffer{datagram, headers::data_offset, count - headers::data_offset};
         } else {
             TRELLIS_LOG_ACTION("channel", +header.channel_id, "Processing message ", header.sequence_id, " as fragment piece ", +header.fragment_id, " / ", +header.fragment_count, ".");
 
@@ -87,21 +89,24 @@ protected:
             if (is_stale) {
                 TRELLIS_LOG_ACTION("channel", +header.channel_id, "Resetting assembler in slot ", slot, ".");
 
-                assembler.reset(header.sequence_id, header.fragment_count);
+                if (!assembler.reset(conn->get_context().get_message_pool(), header.sequence_id, header.fragment_count, conn->get_max_datagram_size() - headers::data_offset)) {
+                    TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message memory cap reached, dropping message ", header.sequence_id, ".");
+                    return std::nullopt;
+                }
             }
 
             if (assembler.get_sequence_id() == header.sequence_id) {
                 TRELLIS_LOG_ACTION("channel", +header.channel_id, "Handing packet to assembler in slot ", slot, ".");
 
-                auto b = datagram.data.data() + headers::data_offset;
-                auto e = datagram.data.data() + count;
-                assert(count <= config::datagram_size);
-                assembler.receive(header, b, e);
+                if (!assembler.receive(header, datagram, count)) {
+                    TRELLIS_LOG_ACTION("channel", +header.channel_id, "Fragment ", +header.fragment_id, " of message ", header.sequence_id, " doesn't fit the others. Dropping.");
+                    return std::nullopt;
+                }
 
                 if (assembler.is_complete()) {
                     TRELLIS_LOG_ACTION("channel", +header.channel_id, "Message reassembly is complete.");
 
-                    return raw_buffer{assembler.release(), assembler.size()};
+                    return assembler.release();
                 } else {
                     return std::nullopt;
                 }
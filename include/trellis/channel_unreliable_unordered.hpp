@@ -10,7 +10,7 @@ public:
     channel_unreliable_unordered(connection_base& conn) : channel_unreliable(conn) {}
 
     template <typename F>
-    void receive(const headers::data& header, const datagram_buffer& datagram, size_t count, const F& on_receive_func) {
+    void receive(const headers::data& header, const shared_datagram_buffer& datagram, size_t count, const F& on_receive_func) {
         // should only be called from the connections's receive handler, so we should be in the networking thread
         assert(conn->get_context().is_thread_current());
 
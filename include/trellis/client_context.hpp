@@ -35,6 +35,12 @@ public:
         base_type(io),
         conn(nullptr) {}
 
+    /** Constructs a context that calls the handler directly on the networking thread. See context_crtp for details. */
+    template <typename Handler>
+    client_context(asio::io_context& io, Handler& handler) :
+        base_type(io, handler),
+        conn(nullptr) {}
+
     /** Connects the client to a server. Both the client and server need to have the same channel list. */
     void connect(const typename protocol::endpoint& client_endpoint, const typename protocol::endpoint& server_endpoint) {
         // must be executed from user thread
@@ -89,7 +95,7 @@ private:
         }
     }
 
-    void receive(const _detail::datagram_buffer& buffer, const typename protocol::endpoint& sender_endpoint, std::size_t size) {
+    void receive(const _detail::shared_datagram_buffer& buffer, const typename protocol::endpoint& sender_endpoint, std::size_t size) {
         TRELLIS_BEGIN_SECTION("client");
 
         // should only be called from the base receive handler, so we should be in the networking thread
@@ -107,7 +113,7 @@ private:
 
         auto type = _detail::headers::type{};
 
-        std::memcpy(&type, buffer.data.data(), sizeof(_detail::headers::type));
+        std::memcpy(&type, buffer.data(), sizeof(_detail::headers::type));
 
         switch (type) {
             case _detail::headers::type::CONNECT: {
@@ -118,7 +124,11 @@ private:
             }
             case _detail::headers::type::CONNECT_OK: {
                 auto header = _detail::headers::connect_ok{};
-                std::memcpy(&header, buffer.data.data() + sizeof(type), sizeof(_detail::headers::connect_ok));
+
+                if (!this->read_header(buffer, size, header)) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "Truncated CONNECT_OK from server ", sender_endpoint, ". Ignoring.");
+                    break;
+                }
 
                 TRELLIS_LOG_ACTION("client", get_context_id(), "CONNECT_OK (scid:", header.connection_id, ") from server ", sender_endpoint, ".");
 
@@ -151,7 +161,7 @@ private:
                 }
 
                 auto header = _detail::headers::data{};
-                std::memcpy(&header, buffer.data.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data));
+                std::memcpy(&header, buffer.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data));
 
                 if (header.channel_id >= sizeof...(Channels)) {
                     TRELLIS_LOG_ACTION("client", get_context_id(), "DATA received with invalid channel_id. Disconnecting.");
@@ -160,7 +170,7 @@ private:
                     break;
                 }
 
-                conn->receive(header, buffer, size, [&](_detail::raw_buffer&& data) {
+                auto valid = conn->receive(header, buffer, size, [&](_detail::raw_buffer&& data) {
                     this->push_event(_detail::event_receive{conn, header.channel_id, std::move(data)});
                 }, [&] {
                     // This should be unreachable, since we check for ESTABLISHED above.
@@ -169,6 +179,12 @@ private:
                     assert(false);
                 });
 
+                if (!valid) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "DATA received with malformed acks. Disconnecting.");
+
+                    conn->disconnect();
+                }
+
                 break;
             }
             case _detail::headers::type::DATA_ACK: {
@@ -179,17 +195,55 @@ private:
                     break;
                 }
 
-                auto header = _detail::headers::data_ack{};
-                std::memcpy(&header, buffer.data.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data_ack));
-
-                if (header.channel_id >= sizeof...(Channels)) {
-                    TRELLIS_LOG_ACTION("client", get_context_id(), "DATA_ACK received with invalid channel_id. Disconnecting.");
+                if (!conn->receive_acks(buffer, size)) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "Malformed DATA_ACK received. Disconnecting.");
 
                     conn->disconnect();
                     break;
                 }
 
-                conn->receive_ack(header);
+                break;
+            }
+            case _detail::headers::type::PROBE: {
+                if (conn->get_state() != connection_state::ESTABLISHED) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "PROBE received from server ", sender_endpoint, " before being ESTABLISHED. Ignoring.");
+                    break;
+                }
+
+                auto header = _detail::headers::probe{};
+
+                if (!this->read_header(buffer, size, header)) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "Truncated PROBE from server ", sender_endpoint, ". Ignoring.");
+                    break;
+                }
+
+                conn->receive_probe(header, size);
+
+                break;
+            }
+            case _detail::headers::type::PROBE_ACK: {
+                auto header = _detail::headers::probe_ack{};
+
+                if (!this->read_header(buffer, size, header)) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "Truncated PROBE_ACK from server ", sender_endpoint, ". Ignoring.");
+                    break;
+                }
+
+                conn->receive_probe_ack(header);
+
+                break;
+            }
+            case _detail::headers::type::AGGREGATE: {
+                // Each packed datagram is received as if it had arrived on its own.
+                auto valid = this->receive_aggregate(buffer, size, [&](const _detail::shared_datagram_buffer& packed, std::size_t packed_size) {
+                    receive(packed, sender_endpoint, packed_size);
+                });
+
+                if (!valid) {
+                    TRELLIS_LOG_ACTION("client", get_context_id(), "Malformed AGGREGATE received. Disconnecting.");
+
+                    conn->disconnect();
+                }
 
                 break;
             }
@@ -1,13 +1,40 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <limits>
 
 namespace trellis::config {
 
 inline constexpr std::size_t datagram_size = 1200;
+#ifdef TRELLIS_MAX_DATAGRAM_SIZE
+inline constexpr std::size_t max_datagram_size = TRELLIS_MAX_DATAGRAM_SIZE;
+#else
+inline constexpr std::size_t max_datagram_size = 1472;
+#endif
 inline constexpr std::size_t max_fragments = 256;
+inline constexpr std::size_t datagram_magazine_size = 32;
+inline constexpr std::size_t datagram_slab_bytes = 2 * 1024 * 1024;
 inline constexpr std::size_t assembler_slots = 256;
+inline constexpr std::size_t receive_batch_size = 16;
+inline constexpr std::size_t receive_batches_per_wakeup = 4;
+inline constexpr std::size_t send_batch_size = 64;
+inline constexpr std::size_t event_queue_capacity = 1024;
+inline constexpr std::chrono::milliseconds timer_wheel_tick{1};
+inline constexpr std::chrono::milliseconds initial_rto{50};
+inline constexpr std::chrono::milliseconds min_rto{10};
+inline constexpr std::chrono::milliseconds max_rto{2000};
+inline constexpr std::size_t fast_retransmit_threshold = 3;
+inline constexpr std::chrono::milliseconds ack_delay{5};
+inline constexpr std::size_t initial_congestion_window = 10;
+inline constexpr std::size_t min_congestion_window = 2;
+inline constexpr double delay_control_alpha = 2;
+inline constexpr double delay_control_beta = 4;
+inline constexpr double pacing_gain = 1.25;
+inline constexpr std::size_t pacing_burst = 4;
+inline constexpr std::size_t reliable_send_window = 1024;
+inline constexpr std::size_t reliable_receive_window = 1024;
+inline constexpr int mtu_probe_attempts = 3;
 
 using sequence_id_t = std::uint32_t;
 using fragment_id_t = std::uint8_t;
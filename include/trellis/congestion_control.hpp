@@ -0,0 +1,115 @@
+#pragma once
+
+#include "config.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+
+namespace trellis {
+
+/**
+ * Decides how many reliable fragments a connection may have in flight at once.
+ * Each connection gets its own controller, which is only ever called from the context's networking thread.
+ * Fragments beyond the window wait in the connection's send queue, and are paced out over the round trip time.
+ */
+class congestion_controller {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+    using time_point = clock_type::time_point;
+
+    virtual ~congestion_controller() = default;
+
+    /** Called when fragments are acknowledged. rtt is the round trip time measured by this ack, if it gave one. */
+    virtual void on_ack(std::size_t fragments, std::optional<duration> rtt) = 0;
+
+    /** Called when a fragment first sent at the given time has to be resent because it wasn't acknowledged in time. */
+    virtual void on_loss(time_point sent, time_point now) = 0;
+
+    /** Gets the maximum number of fragments in flight. */
+    virtual auto get_window() const -> std::size_t = 0;
+};
+
+/** Makes a new controller for each connection. An empty factory disables congestion control. */
+using congestion_controller_factory = std::function<std::unique_ptr<congestion_controller>()>;
+
+/**
+ * Additive increase, multiplicative decrease, in the style of TCP NewReno.
+ * The window grows by one fragment per ack in slow start and by one fragment per round trip after that, and is halved on loss.
+ */
+class new_reno_controller : public congestion_controller {
+public:
+    new_reno_controller() :
+        window(config::initial_congestion_window),
+        slow_start_threshold(std::numeric_limits<double>::max()),
+        recovery_start() {}
+
+    void on_ack(std::size_t fragments, [[maybe_unused]] std::optional<duration> rtt) override {
+        if (window < slow_start_threshold) {
+            window += fragments;
+        } else {
+            window += fragments / window;
+        }
+    }
+
+    void on_loss(time_point sent, time_point now) override {
+        // Everything sent before the last reduction was sent into the old window, so it only counts once.
+        if (sent <= recovery_start) return;
+
+        recovery_start = now;
+        slow_start_threshold = std::max(window / 2, double(config::min_congestion_window));
+        window = slow_start_threshold;
+    }
+
+    auto get_window() const -> std::size_t override {
+        return std::size_t(window);
+    }
+
+protected:
+    double window;
+    double slow_start_threshold;
+    time_point recovery_start;
+};
+
+/**
+ * Delay-based control, in the style of TCP Vegas.
+ * Estimates how many fragments are sitting in queues from how far the round trip time has risen above the lowest one seen,
+ * and keeps that between config::delay_control_alpha and config::delay_control_beta. Loss still halves the window.
+ */
+class delay_controller : public new_reno_controller {
+public:
+    delay_controller() :
+        new_reno_controller(),
+        base_rtt(duration::max()) {}
+
+    void on_ack(std::size_t fragments, std::optional<duration> rtt) override {
+        if (!rtt || *rtt <= duration(0)) {
+            // Without a measurement, hold the window where it is.
+            return;
+        }
+
+        base_rtt = std::min(base_rtt, *rtt);
+
+        auto queued = window * (1.0 - double(base_rtt.count()) / double(rtt->count()));
+
+        if (window < slow_start_threshold && queued < config::delay_control_alpha) {
+            window += fragments;
+        } else if (queued < config::delay_control_alpha) {
+            window += fragments / window;
+        } else if (queued > config::delay_control_beta) {
+            // Leave slow start as soon as queues start to build.
+            slow_start_threshold = std::min(slow_start_threshold, window);
+            window = std::max(window - fragments / window, double(config::min_congestion_window));
+        }
+    }
+
+private:
+    duration base_rtt;
+};
+
+} // namespace trellis
@@ -6,14 +6,20 @@
 #include "context_traits.hpp"
 #include "logging.hpp"
 #include "message_header.hpp"
+#include "send_status.hpp"
 #include "utility.hpp"
 #include "streams.hpp"
 
 #include <asio.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
 #include <type_traits>
 #include <random>
 #include <optional>
+#include <span>
 
 namespace trellis {
 
@@ -40,16 +46,75 @@ public:
     connection& operator=(const connection&) = delete;
     connection& operator=(connection&&) = delete;
 
-    /** Get per-channel stats. Array order corresponds to context channel order. */
+    /** The most fragments a message sent from bytes may have. Limited by the fragment array and by the fragment count in the DATA header. */
+    static constexpr std::size_t max_message_fragments = std::min<std::size_t>(config::max_fragments, std::numeric_limits<config::fragment_id_t>::max());
+
+    /**
+     * Get per-channel stats. Array order corresponds to context channel order.
+     * The RTT and congestion fields belong to the whole connection, so every channel has the same values.
+     */
     auto get_stats() const -> std::array<connection_stats, traits::channel_count> {
-        return get_stats(std::make_index_sequence<traits::channel_count>{});
+        auto stats = get_stats(std::make_index_sequence<traits::channel_count>{});
+
+        for (auto& s : stats) {
+            s.smoothed_rtt = std::chrono::duration_cast<std::chrono::microseconds>(rtt.get_smoothed_rtt());
+            s.rtt_variance = std::chrono::duration_cast<std::chrono::microseconds>(rtt.get_rtt_variance());
+            s.retransmit_timeout = std::chrono::duration_cast<std::chrono::microseconds>(rtt.get_rto());
+            s.congestion_window = congestion_window.load(std::memory_order_relaxed);
+            s.packets_in_flight = in_flight.load(std::memory_order_relaxed);
+        }
+
+        return stats;
+    }
+
+    /** Gets the largest message that can currently be sent from bytes. It only grows, as path MTU probing raises the datagram size. */
+    auto get_max_message_size() const -> std::size_t {
+        return (get_datagram_size() - _detail::headers::data_offset) * max_message_fragments;
     }
 
-    /** Opens a packet buffer to send data. Synchronously calls func with a std::ostream representing the packet. */
+    /**
+     * Opens a packet buffer to send data. Synchronously calls func with a std::ostream representing the packet.
+     * Alternatively, func may be a std::span<const std::byte>, or an asio const buffer sequence such as asio::buffer(data, size)
+     * or an array of asio::const_buffers, whose bytes are sent as one message.
+     * They are copied straight into the fragment datagrams, without going through a stream.
+     * Returns false without sending anything if those bytes are empty or would need more than max_message_fragments fragments.
+     * Stream messages are always sent, writing past the limit fails the stream instead.
+     */
     template <typename Channel, typename F>
-    void send(F&& func) {
-        auto stream = _detail::opacketstream<Channel, connection>(*this);
-        std::forward<F>(func)(stream);
+    auto send(F&& func) -> bool {
+        if constexpr (is_bytes_v<F>) {
+            return send_message<Channel>(std::forward<F>(func), nullptr);
+        } else {
+            send_message<Channel>(std::forward<F>(func), nullptr);
+            return true;
+        }
+    }
+
+    /**
+     * Like send, but refuses the message instead of queueing it past a reliable channel's send window.
+     * func is only called if the message is accepted. After window_full, the handler's on_writable is called once the window has room.
+     * Unlike send, an empty stream gives invalid_size, since nothing was sent.
+     */
+    template <typename Channel, typename F>
+    auto try_send(F&& func) -> send_status {
+        if (get_state() == connection_state::DISCONNECTED) {
+            return send_status::connection_closed;
+        }
+
+        if constexpr (is_reliable_channel_v<Channel>) {
+            auto& channel = std::get<traits::template channel_index<Channel>>(channels);
+
+            if (!channel.check_writable()) {
+                return send_status::window_full;
+            }
+
+            // Gives the slot back unless the message takes it, even if func throws.
+            auto reservation = _detail::send_reservation(channel);
+
+            return send_message<Channel>(std::forward<F>(func), &reservation) ? send_status::queued : send_status::invalid_size;
+        } else {
+            return send_message<Channel>(std::forward<F>(func), nullptr) ? send_status::queued : send_status::invalid_size;
+        }
     }
 
 private:
@@ -57,46 +122,193 @@ private:
     using connection_base::send_raw;
     using connection_base::send_connect;
     using connection_base::receive_connect_ok;
+    using connection_base::receive_connect;
     using connection_base::send_connect_ok;
     using connection_base::receive_connect_ack;
     using connection_base::cancel_handshake;
     using connection_base::disconnect_without_send;
-    using connection_base::send_ack;
+    using connection_base::receive_probe;
+    using connection_base::receive_probe_ack;
+
+    /** Determines whether send takes F as the message's bytes rather than as a callback writing to a stream. */
+    template <typename F>
+    static constexpr auto is_bytes_v = asio::is_const_buffer_sequence<std::decay_t<F>>::value || std::is_convertible_v<F, std::span<const std::byte>>;
+
+    /**
+     * Sends a message like send does, but returns false for an empty stream too, since nothing was sent.
+     * reservation is passed on to reliable channels, see channel_reliable::send_message_impl.
+     */
+    template <typename Channel, typename F>
+    auto send_message(F&& func, _detail::send_reservation* reservation) -> bool {
+        if constexpr (asio::is_const_buffer_sequence<std::decay_t<F>>::value) {
+            return send_buffers<Channel>(func, reservation);
+        } else if constexpr (std::is_convertible_v<F, std::span<const std::byte>>) {
+            auto bytes = std::span<const std::byte>(func);
+            return send_buffers<Channel>(asio::buffer(bytes.data(), bytes.size()), reservation);
+        } else {
+            auto stream = _detail::opacketstream<Channel, connection>(*this, reservation);
+            std::forward<F>(func)(stream);
+            return !stream.empty();
+        }
+    }
 
-    /** Sends all data packets in the given iterator range. Generates data headers and writes them to the front of the buffers. */
+    /**
+     * Gathers the bytes of a buffer sequence into fragment datagrams and sends them as one message.
+     * Returns false if the message is empty or too large, in which case nothing is sent.
+     */
+    template <typename Channel, typename ConstBufferSequence>
+    auto send_buffers(const ConstBufferSequence& buffers, _detail::send_reservation* reservation) -> bool {
+        auto payload_size = get_datagram_size() - _detail::headers::data_offset;
+
+        auto total_size = asio::buffer_size(buffers);
+
+        // Receivers don't accept empty fragments, and the fragment array only has room for so many.
+        if (total_size == 0 || total_size > payload_size * max_message_fragments) {
+            TRELLIS_LOG_ACTION("conn", get_connection_id(), "Refusing to send a message of ", total_size, " bytes.");
+            return false;
+        }
+
+        auto num_fragments = (total_size + payload_size - 1) / payload_size;
+        auto last_payload_size = total_size - (num_fragments - 1) * payload_size;
+
+        assert(num_fragments <= max_message_fragments);
+
+        if (num_fragments == 1) {
+            // Most messages fit in one datagram, so skip the fragment array.
+            auto fragment = make_pending_buffer();
+
+            fill_fragments(buffers, &fragment, payload_size, _detail::headers::data_offset);
+            send_data<Channel>(&fragment, &fragment + 1, payload_size, last_payload_size, reservation);
+        } else {
+            _detail::packetbuf_base::fragment_array fragments;
+
+            for (auto i = std::size_t(0); i < num_fragments; ++i) {
+                fragments[i] = make_pending_buffer();
+            }
+
+            fill_fragments(buffers, fragments.data(), payload_size, _detail::headers::data_offset);
+            send_data<Channel>(fragments.begin(), fragments.begin() + num_fragments, payload_size, last_payload_size, reservation);
+        }
+
+        return true;
+    }
+
+    /** Copies the bytes of a buffer sequence into consecutive fragments, payload_size bytes each, starting offset bytes into every fragment. */
+    template <typename ConstBufferSequence>
+    static void fill_fragments(const ConstBufferSequence& buffers, _detail::shared_datagram_buffer* fragments, std::size_t payload_size, std::size_t offset) {
+        auto pos = std::size_t(0);
+
+        for (auto iter = asio::buffer_sequence_begin(buffers); iter != asio::buffer_sequence_end(buffers); ++iter) {
+            auto piece = asio::const_buffer(*iter);
+            auto data = static_cast<const char*>(piece.data());
+            auto remaining = piece.size();
+
+            while (remaining > 0) {
+                auto fragment_offset = pos % payload_size;
+                auto count = std::min(remaining, payload_size - fragment_offset);
+
+                std::memcpy(fragments[pos / payload_size].data() + offset + fragment_offset, data, count);
+
+                data += count;
+                remaining -= count;
+                pos += count;
+            }
+        }
+    }
+
+    /**
+     * Sends all data packets in the given iterator range. Generates data headers and writes them to the front of the buffers.
+     * Every fragment but the last carries payload_size bytes, which the receiver uses to place them.
+     * reservation is passed on to reliable channels, see channel_reliable::send_message_impl.
+     */
     template <typename Channel, typename Iter>
-    void send_data(Iter b, Iter e, std::size_t last_payload_size) {
+    void send_data(Iter b, Iter e, std::size_t payload_size, std::size_t last_payload_size, _detail::send_reservation* reservation) {
         constexpr auto channel_index = traits::template channel_index<Channel>;
 
         // last_payload_size is a calculated value, so double-check it here.
-        assert(last_payload_size <= config::datagram_size - _detail::headers::data_offset);
+        assert(payload_size <= get_max_datagram_size() - _detail::headers::data_offset);
+        assert(last_payload_size <= payload_size);
 
         auto& channel = std::get<channel_index>(channels);
-        auto type = _detail::headers::type::DATA;
         auto num_fragments = e - b;
-        auto sid = channel.next_sequence_id();
 
         // It's not our responsibility to ensure that the fragments are within the limit. The caller should check this.
         assert(num_fragments <= std::numeric_limits<config::fragment_id_t>::max());
 
-        TRELLIS_LOG_ACTION("conn", get_connection_id(), "Sending data (sid:", sid, ",fragments:", num_fragments, ",lps:", last_payload_size, ")");
+        // An empty stream has nothing to send, so it shouldn't use up a sequence ID either.
+        if (num_fragments == 0) return;
+
+        if constexpr (is_reliable_channel_v<Channel>) {
+            // Reliable channels number their messages on the networking thread, so they write the headers themselves.
+            channel.send_message(b, e, payload_size + _detail::headers::data_offset, last_payload_size + _detail::headers::data_offset, false, reservation);
+        } else {
+            auto type = _detail::headers::type::DATA;
+            auto sid = channel.next_sequence_id();
+
+            TRELLIS_LOG_ACTION("conn", get_connection_id(), "Sending data (sid:", sid, ",fragments:", num_fragments, ",lps:", last_payload_size, ")");
+
+            for (auto iter = b; iter != e; ++iter) {
+                auto& buffer = *iter;
+
+                auto header = _detail::headers::data{};
+                header.sequence_id = sid;
+                header.channel_id = channel_index;
+                header.fragment_count = num_fragments;
+                header.fragment_id = iter - b;
+
+                std::memcpy(buffer.data(), &type, sizeof(type));
+                std::memcpy(buffer.data() + sizeof(type), &header, sizeof(_detail::headers::data));
+
+                if (iter == e - 1) {
+                    channel.send_packet(header, buffer, last_payload_size + _detail::headers::data_offset);
+                } else {
+                    channel.send_packet(header, buffer, payload_size + _detail::headers::data_offset);
+                }
+            }
+        }
+    }
+
+    /**
+     * Sends a message whose fragment payloads are already in bodies, starting at offset zero.
+     * Only the headers are written for this connection, into small datagrams that go out in front of the bodies,
+     * so the same bodies can be sent to many connections. Every body but the last carries payload_size bytes.
+     * Reliable channels keep the bodies alongside the headers for resends.
+     */
+    template <typename Channel, typename Iter>
+    void send_shared(Iter b, Iter e, std::size_t payload_size, std::size_t last_payload_size) {
+        constexpr auto channel_index = traits::template channel_index<Channel>;
+
+        assert(payload_size <= get_datagram_size() - _detail::headers::data_offset);
+        assert(last_payload_size <= payload_size);
+
+        auto& channel = std::get<channel_index>(channels);
+        auto num_fragments = e - b;
+
+        assert(num_fragments <= std::numeric_limits<config::fragment_id_t>::max());
+
+        if (num_fragments == 0) return;
 
-        for (auto iter = b; iter != e; ++iter) {
-            auto& buffer = *iter;
+        if constexpr (is_reliable_channel_v<Channel>) {
+            channel.send_message(b, e, payload_size, last_payload_size, true, nullptr);
+        } else {
+            auto type = _detail::headers::type::DATA;
+            auto sid = channel.next_sequence_id();
 
-            auto header = _detail::headers::data{};
-            header.sequence_id = sid;
-            header.channel_id = channel_index;
-            header.fragment_count = num_fragments;
-            header.fragment_id = iter - b;
+            TRELLIS_LOG_ACTION("conn", get_connection_id(), "Sending shared data (sid:", sid, ",fragments:", num_fragments, ",lps:", last_payload_size, ")");
 
-            std::memcpy(buffer.data(), &type, sizeof(type));
-            std::memcpy(buffer.data() + sizeof(type), &header, sizeof(_detail::headers::data));
+            for (auto iter = b; iter != e; ++iter) {
+                auto buffer = make_pending_buffer();
 
-            if (iter == e - 1) {
-                channel.send_packet(header, buffer, last_payload_size + _detail::headers::data_offset);
-            } else {
-                channel.send_packet(header, buffer, config::datagram_size);
+                auto header = _detail::headers::data{};
+                header.sequence_id = sid;
+                header.channel_id = channel_index;
+                header.fragment_count = num_fragments;
+                header.fragment_id = iter - b;
+
+                std::memcpy(buffer.data(), &type, sizeof(type));
+                std::memcpy(buffer.data() + sizeof(type), &header, sizeof(_detail::headers::data));
+
+                channel.send_packet(header, buffer, _detail::headers::data_offset, *iter, iter == e - 1 ? last_payload_size : payload_size);
             }
         }
     }
@@ -105,15 +317,16 @@ private:
      * Receives a DATA datagram, and if it completes the message, calls data_handler with the results.
      * If the connection is still PENDING, becomes ESTABLISHED and calls on_establish.
      * Neither of the callbacks are stored, feel free to capture locals by reference.
+     * Returns false if the piggybacked acks are malformed.
      */
     template <typename F, typename G>
-    void receive(const _detail::headers::data& header, const _detail::datagram_buffer& datagram, std::size_t count, const F& data_handler, const G& on_establish) {
-        receive(header, datagram, count, data_handler, on_establish, std::make_index_sequence<std::tuple_size_v<channel_state_tuple>>{});
+    auto receive(const _detail::headers::data& header, const _detail::shared_datagram_buffer& datagram, std::size_t count, const F& data_handler, const G& on_establish) -> bool {
+        return receive(header, datagram, count, data_handler, on_establish, std::make_index_sequence<std::tuple_size_v<channel_state_tuple>>{});
     }
 
     /** Do not use. Call the other overload instead. */
     template <typename F, typename G, std::size_t... Is>
-    void receive(const _detail::headers::data& header, const _detail::datagram_buffer& datagram, std::size_t count, const F& data_handler, const G& on_establish, std::index_sequence<Is...>) {
+    auto receive(const _detail::headers::data& header, const _detail::shared_datagram_buffer& datagram, std::size_t count, const F& data_handler, const G& on_establish, std::index_sequence<Is...>) -> bool {
         // should only be called from the context's receive handler, so we should be in the networking thread
         assert(get_context().is_thread_current());
 
@@ -125,31 +338,97 @@ private:
 
             set_state(connection_state::ESTABLISHED);
             on_establish();
+            start_mtu_probe();
         }
 
         // Only ESTABLISHED connections should receive DATA messages.
         assert(get_state() == connection_state::ESTABLISHED);
 
+        if (header.flags & _detail::headers::data_flags::HAS_ACKS) {
+            auto footer = _detail::headers::data_ack_footer{};
+
+            if (count < _detail::headers::data_offset + sizeof(footer)) {
+                return false;
+            }
+
+            std::memcpy(&footer, datagram.data() + count - sizeof(footer), sizeof(footer));
+
+            if (count - _detail::headers::data_offset - sizeof(footer) < footer.size) {
+                return false;
+            }
+
+            // The channel only sees the payload.
+            count -= sizeof(footer) + footer.size;
+
+            if (!receive_ack_blocks(datagram, count, count + footer.size)) {
+                return false;
+            }
+
+            // The acks might have disconnected us.
+            if (get_state() != connection_state::ESTABLISHED) {
+                return true;
+            }
+        }
+
         ((Is == header.channel_id ? (std::get<Is>(channels).receive(header, datagram, count, data_handler), true) : false) || ...);
+
+        return true;
     }
 
     /**
-     * Receives a DATA_ACK datagram.
+     * Receives a DATA_ACK datagram, which holds one or more channel blocks.
+     * Returns false if the datagram is malformed or names an invalid channel.
      */
-    void receive_ack(const _detail::headers::data_ack& header) {
-        receive_ack(header, std::make_index_sequence<std::tuple_size_v<channel_state_tuple>>{});
-    }
-
-    /** Do not use. Call the other overload instead. */
-    template <std::size_t... Is>
-    void receive_ack(const _detail::headers::data_ack& header, std::index_sequence<Is...>) {
+    auto receive_acks(const _detail::shared_datagram_buffer& datagram, std::size_t count) -> bool {
         // should only be called from the context's receive handler, so we should be in the networking thread
         assert(get_context().is_thread_current());
 
         // Only ESTABLISHED connections should receive DATA_ACK messages.
         assert(get_state() == connection_state::ESTABLISHED);
 
-        ((Is == header.channel_id ? (std::get<Is>(channels).receive_ack(header), true) : false) || ...);
+        if (count <= sizeof(_detail::headers::type)) {
+            return false;
+        }
+
+        return receive_ack_blocks(datagram, sizeof(_detail::headers::type), count);
+    }
+
+    /** Receives the DATA_ACK blocks between offset and end, either from a DATA_ACK or piggybacked on DATA. Returns false if they are malformed. */
+    auto receive_ack_blocks(const _detail::shared_datagram_buffer& datagram, std::size_t offset, std::size_t end) -> bool {
+        constexpr auto max_ranges = config::max_datagram_size / sizeof(_detail::headers::data_ack_range);
+
+        // Copied out of the datagram so the ranges are properly aligned.
+        auto ranges = std::array<_detail::headers::data_ack_range, max_ranges>{};
+
+        while (offset < end) {
+            auto header = _detail::headers::data_ack{};
+
+            if (end - offset < sizeof(header)) {
+                return false;
+            }
+
+            std::memcpy(&header, datagram.data() + offset, sizeof(header));
+            offset += sizeof(header);
+
+            auto ranges_size = header.range_count * sizeof(_detail::headers::data_ack_range);
+
+            if (header.channel_id >= traits::channel_count || end - offset < ranges_size) {
+                return false;
+            }
+
+            std::memcpy(ranges.data(), datagram.data() + offset, ranges_size);
+            offset += ranges_size;
+
+            receive_ack(header, ranges.data(), std::make_index_sequence<std::tuple_size_v<channel_state_tuple>>{});
+        }
+
+        return true;
+    }
+
+    /** Do not use. Call receive_ack_blocks instead. */
+    template <std::size_t... Is>
+    void receive_ack(const _detail::headers::data_ack& header, const _detail::headers::data_ack_range* ranges, std::index_sequence<Is...>) {
+        ((Is == header.channel_id ? (std::get<Is>(channels).receive_ack(header, ranges), true) : false) || ...);
     }
 
     template <std::size_t... Is>
@@ -1,14 +1,21 @@
 #pragma once
 
 #include "context_base.hpp"
-#include "guarded_timer.hpp"
+#include "congestion_control.hpp"
+#include "timer_wheel.hpp"
 #include "logging.hpp"
 #include "message_header.hpp"
+#include "pending_acks.hpp"
+#include "rtt_estimator.hpp"
 #include "channel_unreliable_fwd.hpp"
 #include "channel_reliable_fwd.hpp"
 
 #include <asio.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <memory>
 #include <optional>
 #include <iostream>
@@ -34,11 +41,12 @@ enum class connection_state {
 /** Base connection. Provides basic observers and allows disconnect. */
 class connection_base : public std::enable_shared_from_this<connection_base> {
 public:
+    friend context_base;
     friend _detail::channel_unreliable;
     friend _detail::channel_reliable;
 
     using protocol = context_base::protocol;
-    using timer_type = _detail::guarded_timer<connection_base>;
+    using timer_type = _detail::wheel_timer<connection_base>;
 
     using std::enable_shared_from_this<connection_base>::shared_from_this;
     using std::enable_shared_from_this<connection_base>::weak_from_this;
@@ -49,7 +57,20 @@ public:
         remote_endpoint(remote_endpoint),
         state(connection_state::INACTIVE),
         connection_id(std::uniform_int_distribution<std::uint16_t>{}(context.get_rng())),
-        handshake(std::nullopt) {
+        handshake(std::nullopt),
+        acks(),
+        ack_timer(context.get_timer_wheel()),
+        max_datagram_size(config::datagram_size),
+        datagram_size(config::datagram_size),
+        probe(context.get_timer_wheel()),
+        send_queue(),
+        resend_queue(),
+        next_send_time(),
+        pacing_timer(context.get_timer_wheel()),
+        rtt(),
+        congestion(context.congestion_factory ? context.congestion_factory() : nullptr),
+        in_flight(0),
+        congestion_window(congestion ? congestion->get_window() : 0) {
             TRELLIS_LOG_ACTION("conn", connection_id, "Connection constructed.");
         }
 
@@ -78,6 +99,14 @@ public:
         return connection_id;
     }
 
+    /**
+     * Gets the size of the datagrams the connection currently sends.
+     * Starts at the size agreed on during the handshake, or at config::datagram_size while path MTU probing hasn't confirmed anything larger.
+     */
+    auto get_datagram_size() const -> std::size_t {
+        return datagram_size.load(std::memory_order_relaxed);
+    }
+
     /** Close the connection and send a disconnect message. */
     void disconnect() {
         disconnect([]{});
@@ -102,18 +131,18 @@ public:
 
             TRELLIS_LOG_DATAGRAM("d/cn", buffer, sizeof(type));
 
-            context->get_socket().async_send_to(
-                buffer.buffer(sizeof(type)),
-                remote_endpoint,
-                context->bind_executor([buffer, func, self = this->shared_from_this()]([[maybe_unused]] asio::error_code ec, [[maybe_unused]] std::size_t size) {
-                    if (!ec) {
-                        TRELLIS_LOG_ACTION("conn", self->connection_id, "Sent DISCONNECT successfully, killing connection.");
-                    } else {
-                        TRELLIS_LOG_ACTION("conn", self->connection_id, "Something went wrong when sending DISCONNECT: ", ec.category().name(), ": ", ec.message(), "Killing connection.");
-                    }
-                    self->context->kill(*self, {});
-                    func();
-                }));
+            // Queued like any other datagram, so it can't overtake the ones queued before it. The connection is only killed once it has been sent.
+            auto self = this->shared_from_this();
+
+            context->queue_datagram(self, remote_endpoint, buffer, sizeof(type), {}, 0, [func, self]([[maybe_unused]] asio::error_code ec) {
+                if (!ec) {
+                    TRELLIS_LOG_ACTION("conn", self->connection_id, "Sent DISCONNECT successfully, killing connection.");
+                } else {
+                    TRELLIS_LOG_ACTION("conn", self->connection_id, "Something went wrong when sending DISCONNECT: ", ec.category().name(), ": ", ec.message(), "Killing connection.");
+                }
+                self->context->kill(*self, {});
+                func();
+            });
         });
     }
 
@@ -125,9 +154,19 @@ protected:
         state = s;
     }
 
-    /** Sends a datagram. */
-    void send_raw(const _detail::shared_datagram_buffer& data, std::size_t count) {
-        get_context().dispatch([wptr = weak_from_this(), data, count]{
+    /** Gets the largest datagram size both peers agreed on during the handshake. Safe to call from any thread. */
+    auto get_max_datagram_size() const -> std::size_t {
+        return max_datagram_size.load(std::memory_order_relaxed);
+    }
+
+    /** Makes a datagram buffer from the context's cache. */
+    auto make_pending_buffer() -> _detail::shared_datagram_buffer {
+        return context->make_pending_buffer();
+    }
+
+    /** Sends a datagram, followed by the first body_size bytes of body if one is given. */
+    void send_raw(const _detail::shared_datagram_buffer& data, std::size_t count, const _detail::shared_datagram_buffer& body = {}, std::size_t body_size = 0) {
+        get_context().dispatch([wptr = weak_from_this(), data, count, body, body_size]{
             auto ptr = wptr.lock();
 
             if (!ptr) return;
@@ -136,15 +175,7 @@ protected:
 
             TRELLIS_LOG_DATAGRAM("send_raw", data, count);
 
-            ptr->context->get_socket().async_send_to(
-                data.buffer(count),
-                ptr->remote_endpoint,
-                ptr->context->bind_executor([data, ptr](asio::error_code ec, [[maybe_unused]] std::size_t size) {
-                    if (ec) {
-                        TRELLIS_LOG_ACTION("conn", ptr->connection_id, "ERROR send_raw: ", ec.category().name(), ": ", ec.message());
-                        ptr->context->connection_error(*ptr, ec);
-                    }
-                }));
+            ptr->context->queue_datagram(ptr, ptr->remote_endpoint, data, count, body, body_size);
         });
     }
 
@@ -165,16 +196,16 @@ protected:
 
             auto buffer = context->make_pending_buffer();
             auto type = _detail::headers::type::CONNECT;
+            auto header = _detail::headers::connect{std::uint16_t(context->get_datagram_size())};
+            constexpr auto size = sizeof(type) + sizeof(header);
 
             std::memcpy(buffer.data(), &type, sizeof(type));
+            std::memcpy(buffer.data() + sizeof(type), &header, sizeof(header));
 
             TRELLIS_LOG_ACTION("conn", connection_id, "Sending CONNECT.");
-            send_raw(buffer, sizeof(type));
+            send_raw(buffer, size);
 
-            handshake = handshake_state{
-                timer_type(context->get_executor()),
-                buffer,
-            };
+            handshake.emplace(context->get_timer_wheel(), buffer);
         }
 
         // Should always be in CONNECTING state because the handshake is cancelled when we receive CONNECT_OK.
@@ -194,8 +225,11 @@ protected:
             // If state is not CONNECTING, this was a spurious wakeup.
             if (state != connection_state::CONNECTING) return;
 
+            constexpr auto size = sizeof(_detail::headers::type) + sizeof(_detail::headers::connect);
+
             TRELLIS_LOG_ACTION("conn", connection_id, "Resending CONNECT due to timeout.");
-            send_raw(handshake->buffer, sizeof(_detail::headers::type));
+            send_raw(handshake->buffer, size);
+            handshake->resent = true;
 
             send_connect();
         });
@@ -204,7 +238,7 @@ protected:
     /**
      * Second phase of handshake, client side.
      * Changes state from CONNECTING to ESTABLISHED if necessary, cancels handshake, and sends a CONNECT_ACK.
-     * If becoming ESTABLISHED, calls on_establish. The callback is not stored, so feel free to capture locals by reference.
+     * If becoming ESTABLISHED, adopts the datagram size the server agreed on and calls on_establish. The callback is not stored, so feel free to capture locals by reference.
      * Only one CONNECT_ACK is sent, if it gets lost in transit, the server will keep sending us CONNECT_OK messages,
      * so we need to respond to each CONNECT_OK with a CONNECT_ACK.
      * The server will also stop sending CONNECT_OKs when we send our first DATA message.
@@ -220,10 +254,13 @@ protected:
         if (state == connection_state::CONNECTING) {
             TRELLIS_LOG_ACTION("conn", connection_id, "Established. Calling on_establish.");
 
+            sample_handshake_rtt();
             cancel_handshake();
+            negotiate_datagram_size(connect_ok.datagram_size);
 
             state = connection_state::ESTABLISHED;
             on_establish();
+            start_mtu_probe();
         }
 
         // Handshake should only ever exist during the CONNECTING state.
@@ -243,6 +280,20 @@ protected:
         send_raw(buffer, size);
     }
 
+    /**
+     * First phase of handshake, server side.
+     * Agrees on the smaller of the client's and our datagram size, then starts sending CONNECT_OK messages.
+     */
+    void receive_connect(const _detail::headers::connect& connect) {
+        // should only be called from parent context, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Received CONNECT (size:", connect.datagram_size, ").");
+
+        negotiate_datagram_size(connect.datagram_size);
+        send_connect_ok();
+    }
+
     /**
      * Second phase of handshake, server side.
      * Sends CONNECT_OK messages repeatedly until a CONNECT_ACK or DATA message is received.
@@ -261,7 +312,7 @@ protected:
 
             auto buffer = context->make_pending_buffer();
             auto type = _detail::headers::type::CONNECT_OK;
-            auto header = _detail::headers::connect_ok{connection_id};
+            auto header = _detail::headers::connect_ok{connection_id, std::uint16_t(get_max_datagram_size())};
             constexpr auto size = sizeof(type) + sizeof(header);
 
             std::memcpy(buffer.data(), &type, sizeof(type));
@@ -270,10 +321,7 @@ protected:
             TRELLIS_LOG_ACTION("conn", connection_id, "Sending CONNECT_OK.");
             send_raw(buffer, size);
 
-            handshake = handshake_state{
-                timer_type(context->get_executor()),
-                buffer,
-            };
+            handshake.emplace(context->get_timer_wheel(), buffer);
         }
 
         // Should always be in PENDING state because the handshake is cancelled when we receive CONNECT_OK.
@@ -303,6 +351,7 @@ protected:
             TRELLIS_LOG_ACTION("conn", connection_id, "Resending CONNECT_OK due to timeout.");
 
             send_raw(handshake->buffer, size);
+            handshake->resent = true;
 
             send_connect_ok();
         });
@@ -321,10 +370,12 @@ protected:
         if (state == connection_state::PENDING) {
             TRELLIS_LOG_ACTION("conn", connection_id, "Received CONNECT_ACK. Now ESTABLISHED.");
 
+            sample_handshake_rtt();
             cancel_handshake();
 
             state = connection_state::ESTABLISHED;
             on_establish();
+            start_mtu_probe();
         } else {
             TRELLIS_LOG_ACTION("conn", connection_id, "Received CONNECT_ACK on non-PENDING connection. Ignoring.");
         }
@@ -342,6 +393,163 @@ protected:
         handshake = std::nullopt;
     }
 
+    /** Seeds the RTT estimate from the handshake, unless the handshake message had to be resent. */
+    void sample_handshake_rtt() {
+        assert(handshake);
+
+        if (!handshake->resent) {
+            rtt.sample(_detail::rtt_estimator::clock_type::now() - handshake->sent);
+        }
+    }
+
+    /**
+     * Settles on the smaller of our and the peer's largest datagram, but never less than config::datagram_size.
+     * Without path MTU probing, the connection starts sending datagrams of that size right away.
+     */
+    void negotiate_datagram_size(std::size_t peer_datagram_size) {
+        auto size = std::clamp(peer_datagram_size, config::datagram_size, context->get_datagram_size());
+
+        max_datagram_size.store(size, std::memory_order_relaxed);
+
+        if (!context->get_mtu_probing()) {
+            datagram_size.store(size, std::memory_order_relaxed);
+        }
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Agreed on datagram size ", size, ".");
+    }
+
+    /**
+     * Starts searching for the largest datagram that gets through to the peer, if path MTU probing is enabled.
+     * Tries the agreed size first, then binary searches down towards the current size.
+     */
+    void start_mtu_probe() {
+        // should only be called when becoming ESTABLISHED, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (!context->get_mtu_probing() || get_max_datagram_size() <= get_datagram_size()) return;
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Starting path MTU probing.");
+
+        probe.low = get_datagram_size();
+        probe.high = get_max_datagram_size();
+        probe.size = get_max_datagram_size();
+        probe.attempts = 0;
+
+        send_probe();
+    }
+
+    /**
+     * Sends a PROBE padded to the size being tried, and gives up on that size if it isn't acknowledged after config::mtu_probe_attempts tries.
+     * PROBEs are sent with the DF bit set, so a send failing with EMSGSIZE means the size is too large, not that the connection is broken.
+     */
+    void send_probe() {
+        assert(probe.size > sizeof(_detail::headers::type) + sizeof(_detail::headers::probe));
+        assert(probe.size <= get_max_datagram_size());
+
+        auto buffer = context->make_pending_buffer();
+        auto type = _detail::headers::type::PROBE;
+        auto header = _detail::headers::probe{std::uint16_t(probe.size)};
+        constexpr auto header_size = sizeof(type) + sizeof(header);
+
+        std::memcpy(buffer.data(), &type, sizeof(type));
+        std::memcpy(buffer.data() + sizeof(type), &header, sizeof(header));
+        std::memset(buffer.data() + header_size, 0, probe.size - header_size);
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Sending PROBE (size:", probe.size, ",attempt:", probe.attempts, ").");
+        context->queue_datagram(shared_from_this(), remote_endpoint, buffer, probe.size, {}, 0, [self = shared_from_this(), size = probe.size](asio::error_code ec) {
+            if (!ec) return;
+
+            if (ec != asio::error::message_size) {
+                self->context->connection_error(*self, ec);
+                return;
+            }
+
+            if (self->state != connection_state::ESTABLISHED || self->probe.size != size) return;
+
+            TRELLIS_LOG_ACTION("conn", self->connection_id, "PROBE of size ", size, " is too large to send.");
+
+            self->probe.timer.cancel();
+            self->probe.high = size - 1;
+            self->next_probe();
+        });
+
+        probe.timer.expires_from_now(rtt.get_timeout(probe.attempts));
+
+        probe.timer.async_wait(weak_from_this(), [this](asio::error_code ec) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+
+            if (state != connection_state::ESTABLISHED) return;
+
+            if (++probe.attempts < config::mtu_probe_attempts) {
+                send_probe();
+                return;
+            }
+
+            TRELLIS_LOG_ACTION("conn", connection_id, "PROBE of size ", probe.size, " was never acknowledged.");
+
+            probe.high = probe.size - 1;
+            next_probe();
+        });
+    }
+
+    /** Probes halfway between the largest size known to get through and the smallest one that didn't, or stops once they meet. */
+    void next_probe() {
+        if (probe.high <= probe.low) {
+            TRELLIS_LOG_ACTION("conn", connection_id, "Path MTU probing done. Datagram size is ", get_datagram_size(), ".");
+
+            probe.size = 0;
+            return;
+        }
+
+        probe.size = (probe.low + probe.high + 1) / 2;
+        probe.attempts = 0;
+
+        send_probe();
+    }
+
+    /** Answers a PROBE, as long as it really was padded to the size it claims. */
+    void receive_probe(const _detail::headers::probe& header, std::size_t count) {
+        // should only be called from parent context, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (header.size != count) {
+            TRELLIS_LOG_ACTION("conn", connection_id, "Received PROBE claiming ", header.size, " bytes, but ", count, " arrived. Ignoring.");
+            return;
+        }
+
+        auto buffer = context->make_pending_buffer();
+        auto type = _detail::headers::type::PROBE_ACK;
+        auto ack = _detail::headers::probe_ack{header.size};
+        constexpr auto size = sizeof(type) + sizeof(ack);
+
+        std::memcpy(buffer.data(), &type, sizeof(type));
+        std::memcpy(buffer.data() + sizeof(type), &ack, sizeof(ack));
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Sending PROBE_ACK (size:", header.size, ").");
+        context->queue_datagram(shared_from_this(), remote_endpoint, buffer, size);
+    }
+
+    /** Switches to the acknowledged size and carries on probing. Acks for sizes we already gave up on are ignored. */
+    void receive_probe_ack(const _detail::headers::probe_ack& ack) {
+        // should only be called from parent context, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (state != connection_state::ESTABLISHED || probe.size == 0 || ack.size != probe.size) {
+            TRELLIS_LOG_ACTION("conn", connection_id, "Received stale PROBE_ACK (size:", ack.size, "). Ignoring.");
+            return;
+        }
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Received PROBE_ACK. Datagram size is now ", ack.size, ".");
+
+        probe.timer.cancel();
+        datagram_size.store(ack.size, std::memory_order_relaxed);
+
+        probe.low = ack.size;
+        next_probe();
+    }
+
     /** Disconnects without sending DISCONNECT to the peer. Peer will be forced to timeout. */
     void disconnect_without_send(asio::error_code ec) {
         // should only be called from parent context, so we should be in the networking thread
@@ -363,31 +571,214 @@ protected:
         context->kill(*this, ec);
     }
 
-    /** Sends a DATA_ACK. */
-    void send_ack(std::uint8_t cid, config::sequence_id_t sid, config::sequence_id_t eid, config::fragment_id_t fid) {
+    /**
+     * Records a fragment to acknowledge. Acks ride along with the next DATA datagram sent to the peer,
+     * or go out as a standalone DATA_ACK after config::ack_delay if there isn't one.
+     */
+    void queue_ack(std::uint8_t cid, config::sequence_id_t sid, config::sequence_id_t eid, config::fragment_id_t fid) {
         // should only be called from a channel's receive handler, so we should be in the networking thread
         assert(get_context().is_thread_current());
 
         if (state == connection_state::DISCONNECTED) return;
 
-        TRELLIS_LOG_ACTION("conn", connection_id, "Sending DATA_ACK (cid:", cid, ",sid:", sid, ",fid:", fid, ").");
+        TRELLIS_LOG_ACTION("conn", connection_id, "Queueing DATA_ACK (cid:", +cid, ",sid:", sid, ",fid:", +fid, ").");
 
-        auto buffer = context->make_pending_buffer();
-        auto type = _detail::headers::type::DATA_ACK;
-        auto header = _detail::headers::data_ack{sid, eid, cid, fid};
-        constexpr auto size = sizeof(type) + sizeof(header);
+        if (acks.empty()) {
+            ack_timer.expires_from_now(config::ack_delay);
+            ack_timer.async_wait(weak_from_this(), [this](asio::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
 
-        std::memcpy(buffer.data(), &type, sizeof(type));
-        std::memcpy(buffer.data() + sizeof(type), &header, sizeof(header));
+                TRELLIS_LOG_ACTION("conn", connection_id, "Delayed ack timer expired.");
+                flush_acks();
+            });
+        }
 
-        send_raw(buffer, size);
+        acks.add(cid, eid, sid, fid);
+
+        // Acks that could never fit next to a payload shouldn't wait for one.
+        if (acks.encoded_size() > max_piggybacked_acks) {
+            flush_acks();
+        }
+    }
+
+    /** Sends every queued ack as standalone DATA_ACKs. */
+    void flush_acks() {
+        // should only be called from the ack timer or queue_ack(), so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        ack_timer.cancel();
+
+        if (state == connection_state::DISCONNECTED) {
+            acks.clear();
+            return;
+        }
+
+        auto self = shared_from_this();
+
+        acks.flush([&] {
+            return context->make_pending_buffer();
+        }, [&](const _detail::shared_datagram_buffer& buffer, std::size_t size) {
+            TRELLIS_LOG_DATAGRAM("ack", buffer, size);
+            context->queue_datagram(self, remote_endpoint, buffer, size);
+        });
+    }
+
+    /**
+     * Appends the queued acks to an outgoing datagram if it is DATA and has room for all of them.
+     * The datagram is copied first if anything else refers to it, such as a reliable channel's retry queue.
+     * A body sent after the datagram is copied into it as well, since it may be shared with other connections.
+     */
+    void piggyback_acks(_detail::shared_datagram_buffer& datagram, std::size_t& size, _detail::shared_datagram_buffer& body, std::size_t& body_size) {
+        // should only be called from the context's flush, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (acks.empty()) return;
+
+        if (state == connection_state::DISCONNECTED) {
+            ack_timer.cancel();
+            acks.clear();
+            return;
+        }
+
+        auto type = _detail::headers::type{};
+        std::memcpy(&type, datagram.data(), sizeof(type));
+
+        if (type != _detail::headers::type::DATA) return;
+
+        auto header = _detail::headers::data{};
+        std::memcpy(&header, datagram.data() + sizeof(type), sizeof(header));
+
+        auto footer = _detail::headers::data_ack_footer{};
+        auto acks_size = acks.encoded_size();
+
+        if ((header.flags & _detail::headers::data_flags::HAS_ACKS) || size + body_size + acks_size + sizeof(footer) > get_datagram_size()) return;
+
+        TRELLIS_LOG_ACTION("conn", connection_id, "Piggybacking DATA_ACK on DATA (sid:", header.sequence_id, ",fid:", +header.fragment_id, ").");
+
+        if (datagram.use_count() > 1) {
+            auto copy = context->make_pending_buffer();
+            std::memcpy(copy.data(), datagram.data(), size);
+            datagram = std::move(copy);
+        }
+
+        if (body_size > 0) {
+            std::memcpy(datagram.data() + size, body.data(), body_size);
+            size += body_size;
+        }
+
+        body = {};
+        body_size = 0;
+
+        header.flags |= _detail::headers::data_flags::HAS_ACKS;
+        std::memcpy(datagram.data() + sizeof(type), &header, sizeof(header));
+
+        acks.write(datagram.data() + size);
+        size += acks_size;
+
+        footer.size = std::uint16_t(acks_size);
+        std::memcpy(datagram.data() + size, &footer, sizeof(footer));
+        size += sizeof(footer);
+
+        ack_timer.cancel();
+    }
+
+    /**
+     * Sends a reliable fragment, followed by its body if it has one, or queues it until the congestion window has room for it.
+     * Defined in channel_reliable.hpp.
+     */
+    void send_reliable(_detail::channel_reliable& channel, const _detail::headers::data& header, const _detail::shared_datagram_buffer& datagram, std::size_t size, const _detail::shared_datagram_buffer& body, std::size_t body_size);
+
+    /** Resends a reliable fragment that wasn't acked in time. Resends skip the congestion window, but are still paced. */
+    void resend_reliable(const _detail::shared_datagram_buffer& datagram, std::size_t size, const _detail::shared_datagram_buffer& body, std::size_t body_size) {
+        // should only be called from a reliable channel's retry timer, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (!congestion) {
+            send_raw(datagram, size, body, body_size);
+            return;
+        }
+
+        resend_queue.push_back({datagram, size, body, body_size});
+        send_queued();
+    }
+
+    /** Called when reliable fragments are acked. rtt is the round trip time measured by the ack, if it gave one. */
+    void on_reliable_acked(std::size_t fragments, std::optional<_detail::rtt_estimator::duration> rtt_sample) {
+        // should only be called from a reliable channel's ack handler, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        in_flight.fetch_sub(fragments, std::memory_order_relaxed);
+
+        if (!congestion) return;
+
+        congestion->on_ack(fragments, rtt_sample);
+        congestion_window.store(congestion->get_window(), std::memory_order_relaxed);
+
+        send_queued();
+    }
+
+    /** Called when a reliable channel stops waiting for fragments without them being acked. */
+    void on_reliable_dropped(std::size_t fragments) {
+        // should only be called from a reliable channel, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        in_flight.fetch_sub(fragments, std::memory_order_relaxed);
+
+        if (congestion && fragments > 0) {
+            send_queued();
+        }
+    }
+
+    /** Called when a reliable fragment first sent at the given time has to be resent. */
+    void on_reliable_lost(_detail::rtt_estimator::clock_type::time_point sent) {
+        // should only be called from a reliable channel's retry timer, so we should be in the networking thread
+        assert(get_context().is_thread_current());
+
+        if (!congestion) return;
+
+        congestion->on_loss(sent, _detail::rtt_estimator::clock_type::now());
+        congestion_window.store(congestion->get_window(), std::memory_order_relaxed);
     }
 
+    /**
+     * Sends queued resends, then queued fragments while the congestion window has room.
+     * Sends are spaced by smoothed_rtt / (window * config::pacing_gain), with bursts of up to config::pacing_burst fragments after an idle period.
+     * Defined in channel_reliable.hpp.
+     */
+    void send_queued();
 
 private:
+    static constexpr auto max_piggybacked_acks = config::datagram_size - _detail::headers::data_offset - sizeof(_detail::headers::data_ack_footer);
+
     struct handshake_state {
+        handshake_state(_detail::timer_wheel& wheel, const _detail::shared_datagram_buffer& buffer) :
+            timer(wheel),
+            buffer(buffer),
+            sent(_detail::rtt_estimator::clock_type::now()),
+            resent(false) {}
+
         timer_type timer;
         _detail::shared_datagram_buffer buffer;
+        _detail::rtt_estimator::clock_type::time_point sent;
+        bool resent;
+    };
+
+    /** Path MTU search. Sizes up to low are known to get through, sizes above high are known not to. A size of 0 means no probe is outstanding. */
+    struct probe_state {
+        explicit probe_state(_detail::timer_wheel& wheel) :
+            timer(wheel),
+            low(0),
+            high(0),
+            size(0),
+            attempts(0) {}
+
+        timer_type timer;
+        std::size_t low;
+        std::size_t high;
+        std::size_t size;
+        int attempts;
     };
 
     context_base* context;
@@ -395,6 +786,51 @@ private:
     std::atomic<connection_state> state;
     std::uint16_t connection_id;
     std::optional<handshake_state> handshake;
+    _detail::pending_acks acks;
+    timer_type ack_timer;
+    std::atomic<std::size_t> max_datagram_size;
+    std::atomic<std::size_t> datagram_size;
+    probe_state probe;
+
+    struct queued_fragment {
+        _detail::channel_reliable* channel;
+        _detail::headers::data header;
+        _detail::shared_datagram_buffer datagram;
+        std::size_t size;
+        _detail::shared_datagram_buffer body;
+        std::size_t body_size;
+    };
+
+    struct queued_resend {
+        _detail::shared_datagram_buffer datagram;
+        std::size_t size;
+        _detail::shared_datagram_buffer body;
+        std::size_t body_size;
+    };
+
+    std::deque<queued_fragment> send_queue;
+    std::deque<queued_resend> resend_queue;
+    _detail::rtt_estimator::clock_type::time_point next_send_time;
+    timer_type pacing_timer;
+
+protected:
+    _detail::rtt_estimator rtt;
+    std::unique_ptr<congestion_controller> congestion;
+    std::atomic<std::size_t> in_flight;
+    std::atomic<std::size_t> congestion_window;
 };
 
+inline auto context_base::aggregate_size_limit(const outgoing_datagram& entry) -> std::size_t {
+    return entry.conn->get_datagram_size();
+}
+
+inline void context_base::piggyback_acks() {
+    // must be executed from networking thread
+    assert(is_thread_current());
+
+    for (auto& entry : outgoing) {
+        entry.conn->piggyback_acks(entry.data, entry.size, entry.body, entry.body_size);
+    }
+}
+
 } // namespace trellis
@@ -1,11 +1,24 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+
 namespace trellis {
 
 /** Simple stats about a connection. */
 struct connection_stats {
     int outgoing_queue_size; /** How many packets are waiting in the outgoing queue. */
     int num_awaiting; /** How many packets are currently expected to be received. */
+    int num_blocked; /** How many packets are waiting for room in the send window. */
+    std::uint64_t send_buffer_bytes; /** Bytes held by packets that are blocked or awaiting acks. */
+    std::uint64_t receive_buffer_bytes; /** Bytes held by messages being reassembled. */
+    std::uint64_t resends; /** How many packets have been resent because they weren't acked in time, including fast resends. */
+    std::uint64_t fast_resends; /** How many packets have been resent early because newer packets were acked first. */
+    std::chrono::microseconds smoothed_rtt; /** The connection's smoothed round trip time. Zero until the first measurement. */
+    std::chrono::microseconds rtt_variance; /** The mean deviation of the round trip time. */
+    std::chrono::microseconds retransmit_timeout; /** How long an unacked packet waits before its first resend. */
+    std::uint64_t congestion_window; /** How many reliable packets the connection may have in flight. Zero without congestion control. */
+    std::uint64_t packets_in_flight; /** How many reliable packets have been sent but not acked yet. */
 };
 
 } // namespace trellis
@@ -1,24 +1,54 @@
 #pragma once
 
+#include "channel_reliable_fwd.hpp"
+#include "channel_unreliable_fwd.hpp"
 #include "config.hpp"
+#include "congestion_control.hpp"
+#include "context_stats.hpp"
 #include "datagram.hpp"
+#include "datagram_batch.hpp"
+#include "logging.hpp"
+#include "message_header.hpp"
+#include "message_pool.hpp"
 #include "streams_fwd.hpp"
+#include "timer_wheel.hpp"
 
 #include <asio.hpp>
 
+#include <array>
+#include <atomic>
+#include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <random>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace trellis {
 
 class connection_base;
 
+namespace _detail {
+
+/** How many messages a reliable channel may have outstanding, counted from the oldest one not yet acked or delivered. */
+struct channel_window {
+    std::size_t send;
+    std::size_t receive;
+};
+
+} // namespace _detail
+
 /** Base context class. Holds data relevant to all contexts. */
 class context_base {
 public:
     friend connection_base;
     friend _detail::packetbuf_base;
+    friend _detail::channel_reliable;
+    friend _detail::channel_unreliable;
 
     using protocol = asio::ip::udp;
 
@@ -28,10 +58,29 @@ public:
     context_base(asio::io_context& io) :
         io(&io),
         strand(asio::make_strand(io)),
+        wheel(strand),
         socket(io),
         cache(),
+        message_pool(),
         rng(std::random_device{}()),
-        context_id(std::uniform_int_distribution<std::uint16_t>{}(rng)) {}
+        context_id(std::uniform_int_distribution<std::uint16_t>{}(rng)),
+        outgoing(),
+        flush_pending(false),
+        aggregation(false),
+        open_aggregates(),
+        datagram_size_limit(config::datagram_size),
+        mtu_probing(false),
+        congestion_factory(),
+        channel_windows(),
+#ifdef TRELLIS_HAS_MMSG
+        sender(),
+#endif
+        receive_wakeups(0),
+        datagrams_received(0),
+        max_datagrams_per_wakeup(0),
+        send_calls(0),
+        datagrams_sent(0),
+        datagrams_aggregated(0) {}
 
     virtual ~context_base() = 0;
 
@@ -72,12 +121,154 @@ public:
         return strand.running_in_this_thread();
     }
 
+    /**
+     * Sets the maximum number of bytes that can be held by messages being reassembled or waiting to be polled.
+     * Fragments that would exceed the cap are dropped. Reliable fragments are not acknowledged, so they will be resent later.
+     * Safe to call from any thread.
+     */
+    void set_message_memory_cap(std::size_t bytes) {
+        message_pool.set_memory_cap(bytes);
+    }
+
+    /** Gets the message memory cap. Unlimited by default. */
+    auto get_message_memory_cap() const -> std::size_t {
+        return message_pool.get_memory_cap();
+    }
+
+    /**
+     * Sets how each new connection limits its reliable fragments in flight, e.g. with new_reno_controller or delay_controller.
+     * By default there is no congestion control, and fragments are sent as soon as they are queued.
+     * Must be called before the context is started.
+     */
+    void set_congestion_control(congestion_controller_factory factory) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+
+        congestion_factory = std::move(factory);
+    }
+
+    /**
+     * Enables packing the small DATA and DATA_ACK datagrams queued for the same peer during one flush into a single AGGREGATE datagram.
+     * Each datagram packed this way saves a send call and a UDP/IP header, at the cost of a copy on both ends.
+     * Receivers always unpack aggregates, so only the sending side needs to enable it. Disabled by default.
+     * Must be called before the context is started.
+     */
+    void set_message_aggregation(bool enabled) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+
+        aggregation = enabled;
+    }
+
+    /** Determines whether message aggregation is enabled. */
+    auto get_message_aggregation() const -> bool {
+        return aggregation;
+    }
+
+    /**
+     * Sets the largest datagram this context will send or accept, between config::datagram_size and config::max_datagram_size.
+     * Each connection uses the smaller of both peers' sizes, agreed on during the handshake.
+     * Only raise it when the path to every peer is known to carry datagrams that big, or enable path MTU probing.
+     * Defaults to config::datagram_size. Must be called before the context is started.
+     */
+    void set_datagram_size(std::size_t size) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+
+        assert(size >= config::datagram_size);
+        assert(size <= config::max_datagram_size);
+
+        datagram_size_limit = size;
+    }
+
+    /** Gets the largest datagram this context will send or accept. */
+    auto get_datagram_size() const -> std::size_t {
+        return datagram_size_limit;
+    }
+
+    /**
+     * Enables path MTU probing. Connections then start at config::datagram_size even if a larger size was agreed on,
+     * and only switch to a larger size once a PROBE datagram padded to that size has been acknowledged by the peer.
+     * The socket then sets the DF bit, so PROBEs too large for the path are dropped rather than fragmented.
+     * Disabled by default. Must be called before the context is started.
+     */
+    void set_mtu_probing(bool enabled) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+
+        mtu_probing = enabled;
+    }
+
+    /** Determines whether path MTU probing is enabled. */
+    auto get_mtu_probing() const -> bool {
+        return mtu_probing;
+    }
+
+    /**
+     * Allocates enough slabs for at least count datagram buffers right away, so the first burst of traffic doesn't have to.
+     * By default nothing is allocated until the context sends or receives. Must be called before the context is started.
+     */
+    void reserve_datagram_buffers(std::size_t count) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+
+        cache.reserve(count);
+    }
+
+    /** Gets the windows of the reliable channel at the given index. Defaults to config::reliable_send_window and config::reliable_receive_window. */
+    auto get_channel_window(std::size_t channel_index) const -> _detail::channel_window {
+        if (channel_index < channel_windows.size()) {
+            return channel_windows[channel_index];
+        }
+
+        return {config::reliable_send_window, config::reliable_receive_window};
+    }
+
+    /** Gets a snapshot of the context's stats. Safe to call from any thread. */
+    auto get_stats() const -> context_stats {
+        auto pool_stats = message_pool.get_stats();
+        auto cache_stats = cache.get_stats();
+
+        return {
+            receive_wakeups.load(std::memory_order_relaxed),
+            datagrams_received.load(std::memory_order_relaxed),
+            max_datagrams_per_wakeup.load(std::memory_order_relaxed),
+            send_calls.load(std::memory_order_relaxed),
+            datagrams_sent.load(std::memory_order_relaxed),
+            datagrams_aggregated.load(std::memory_order_relaxed),
+            pool_stats.bytes_in_use,
+            pool_stats.bytes_high_water,
+            pool_stats.bytes_cached,
+            pool_stats.rejections,
+            // The event queue lives in context_crtp, which fills these in.
+            0,
+            0,
+            0,
+            cache_stats.allocated,
+            cache_stats.free,
+            cache_stats.in_flight,
+        };
+    }
+
 protected:
     /** Makes a packet buffer using the underlying cache. */
     auto make_pending_buffer() -> _detail::shared_datagram_buffer {
         return cache.make_pending_buffer();
     }
 
+    auto get_cache() -> _detail::datagram_buffer_cache& {
+        return cache;
+    }
+
+    /** Gets the timer wheel shared by all of the context's connections. */
+    auto get_timer_wheel() -> _detail::timer_wheel& {
+        return wheel;
+    }
+
+    auto get_message_pool() -> _detail::message_pool& {
+        return message_pool;
+    }
+
     auto get_socket() -> protocol::socket& {
         return socket;
     }
@@ -86,18 +277,355 @@ protected:
         return socket;
     }
 
+    /**
+     * Queues a datagram to be sent to the connection's peer.
+     * All datagrams queued during the current strand pass are flushed together afterwards.
+     * The buffer is kept alive until the datagram has been handed to the socket.
+     * If a body is given, its first body_size bytes are sent right after the data, so one body can be shared by datagrams to many peers.
+     * If on_sent is given, it is called with the result once the flush that sends the datagram is done, instead of reporting errors to the connection.
+     */
+    void queue_datagram(std::shared_ptr<connection_base> conn, const protocol::endpoint& endpoint, const _detail::shared_datagram_buffer& data, std::size_t size, const _detail::shared_datagram_buffer& body = {}, std::size_t body_size = 0, std::function<void(asio::error_code)> on_sent = {}) {
+        // must be executed from networking thread
+        assert(is_thread_current());
+        assert(size + body_size <= config::max_datagram_size);
+
+        outgoing.push_back({std::move(conn), endpoint, data, size, body, body ? body_size : 0, std::move(on_sent)});
+
+        if (!flush_pending) {
+            flush_pending = true;
+            asio::post(strand, [this]{ flush_outgoing(); });
+        }
+    }
+
+    /** Lets every connection with pending acks append them to a queued DATA datagram. Defined in connection_base.hpp. */
+    void piggyback_acks();
+
+    /** Sends all queued datagrams immediately. Datagrams which would block are left queued until the socket is writable. */
+    void flush_outgoing() {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        auto errors = std::vector<std::pair<std::shared_ptr<connection_base>, asio::error_code>>{};
+        auto completions = std::vector<std::pair<std::function<void(asio::error_code)>, asio::error_code>>{};
+
+        piggyback_acks();
+
+        if (aggregation) {
+            aggregate_outgoing();
+        }
+
+#ifdef TRELLIS_HAS_MMSG
+        auto sent = std::size_t(0);
+        auto blocked = false;
+
+        while (sent < outgoing.size()) {
+            auto ec = asio::error_code{};
+            auto count = sender.send(socket, outgoing.begin() + sent, outgoing.end(), ec);
+
+            send_calls.fetch_add(1, std::memory_order_relaxed);
+
+            if (!ec) {
+                datagrams_sent.fetch_add(count, std::memory_order_relaxed);
+
+                for (auto i = sent; i < sent + count; ++i) {
+                    if (outgoing[i].on_sent) {
+                        completions.emplace_back(std::move(outgoing[i].on_sent), asio::error_code{});
+                    }
+                }
+
+                sent += count;
+            } else if (ec == asio::error::would_block) {
+                blocked = true;
+                break;
+            } else {
+                // The first datagram in the batch failed, so drop it and report the error to its connection.
+                if (outgoing[sent].on_sent) {
+                    completions.emplace_back(std::move(outgoing[sent].on_sent), ec);
+                } else {
+                    errors.emplace_back(std::move(outgoing[sent].conn), ec);
+                }
+                ++sent;
+            }
+        }
+
+        outgoing.erase(outgoing.begin(), outgoing.begin() + sent);
+
+        if (blocked) {
+            socket.async_wait(protocol::socket::wait_write, asio::bind_executor(strand, [this](asio::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+
+                flush_outgoing();
+            }));
+        } else {
+            flush_pending = false;
+        }
+#else
+        for (auto& entry : outgoing) {
+            send_calls.fetch_add(1, std::memory_order_relaxed);
+
+            auto buffers = std::array<asio::const_buffer, 2>{
+                std::as_const(entry.data).buffer(entry.size),
+                entry.body ? std::as_const(entry.body).buffer(entry.body_size) : asio::const_buffer{},
+            };
+
+            socket.async_send_to(
+                buffers,
+                entry.endpoint,
+                asio::bind_executor(strand, [this, data = std::move(entry.data), body = std::move(entry.body), conn = std::move(entry.conn), on_sent = std::move(entry.on_sent)](asio::error_code ec, [[maybe_unused]] std::size_t size) {
+                    if (on_sent) {
+                        if (!ec) {
+                            datagrams_sent.fetch_add(1, std::memory_order_relaxed);
+                        }
+                        on_sent(ec);
+                    } else if (ec) {
+                        connection_error(*conn, ec);
+                    } else {
+                        datagrams_sent.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }));
+        }
+
+        outgoing.clear();
+        flush_pending = false;
+#endif
+
+        for (auto& [conn, ec] : errors) {
+            TRELLIS_LOG_ACTION("context", context_id, "ERROR flush_outgoing: ", ec.category().name(), ": ", ec.message());
+            connection_error(*conn, ec);
+        }
+
+        // These may kill connections or close the socket, so they only run once the queue is no longer being walked.
+        for (auto& [on_sent, ec] : completions) {
+            on_sent(ec);
+        }
+    }
+
+    /**
+     * Packs the queued DATA and DATA_ACK datagrams of each connection into AGGREGATE datagrams, keeping the order they were queued in.
+     * An aggregate takes the place of the first datagram packed into it, and a new one is started whenever the next datagram doesn't fit,
+     * or when one that can't be aggregated was queued in between.
+     */
+    void aggregate_outgoing() {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        open_aggregates.clear();
+
+        auto kept = std::size_t(0);
+
+        for (auto i = std::size_t(0); i < outgoing.size(); ++i) {
+            auto& entry = outgoing[i];
+
+            if (can_aggregate(entry)) {
+                auto [iter, inserted] = open_aggregates.try_emplace(entry.conn.get(), kept);
+
+                if (!inserted && append_aggregate(outgoing[iter->second], entry)) {
+                    datagrams_aggregated.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                iter->second = kept;
+            } else {
+                // Anything packed into an earlier aggregate would overtake this datagram, so the next one has to start a new aggregate.
+                open_aggregates.erase(entry.conn.get());
+            }
+
+            if (kept != i) {
+                outgoing[kept] = std::move(entry);
+            }
+
+            ++kept;
+        }
+
+        outgoing.erase(outgoing.begin() + kept, outgoing.end());
+    }
+
+    /** Copies the header that follows the type out of a received datagram. Returns false if the datagram is too short to hold it. */
+    template <typename Header>
+    static auto read_header(const _detail::shared_datagram_buffer& datagram, std::size_t count, Header& header) -> bool {
+        if (count < sizeof(_detail::headers::type) + sizeof(Header)) {
+            return false;
+        }
+
+        std::memcpy(&header, datagram.data() + sizeof(_detail::headers::type), sizeof(Header));
+
+        return true;
+    }
+
+    /**
+     * Unpacks an AGGREGATE datagram, calling receive(buffer, size) with a copy of each datagram packed into it.
+     * Returns false if it is malformed, in which case the datagrams before the malformed one have already been received.
+     */
+    template <typename F>
+    auto receive_aggregate(const _detail::shared_datagram_buffer& datagram, std::size_t count, const F& receive) -> bool {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        auto offset = sizeof(_detail::headers::type);
+
+        while (offset < count) {
+            auto entry = _detail::headers::aggregate_entry{};
+
+            if (count - offset < sizeof(entry)) {
+                return false;
+            }
+
+            std::memcpy(&entry, datagram.data() + offset, sizeof(entry));
+            offset += sizeof(entry);
+
+            if (entry.size < sizeof(_detail::headers::type) || count - offset < entry.size) {
+                return false;
+            }
+
+            auto type = _detail::headers::type{};
+            std::memcpy(&type, datagram.data() + offset, sizeof(type));
+
+            if (type != _detail::headers::type::DATA && type != _detail::headers::type::DATA_ACK) {
+                return false;
+            }
+
+            // Each packed datagram gets a buffer of its own, since channels may hold on to it.
+            auto buffer = make_pending_buffer();
+            std::memcpy(buffer.data(), datagram.data() + offset, entry.size);
+            offset += entry.size;
+
+            receive(buffer, std::size_t(entry.size));
+        }
+
+        return true;
+    }
+
     /** Kills and removes the given connection without sending a DISCONNECT. */
     virtual void kill(const connection_base& conn, const asio::error_code& ec) = 0;
 
     virtual void connection_error(const connection_base& conn, asio::error_code ec) = 0;
 
+    /** Tells the application that a channel which refused a try_send has room in its send window again. */
+    virtual void notify_writable(connection_base& conn, std::uint8_t channel_id) = 0;
+
+    /** Records that a single receive wakeup handled count datagrams. */
+    void count_received(std::size_t count) {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        receive_wakeups.fetch_add(1, std::memory_order_relaxed);
+        datagrams_received.fetch_add(count, std::memory_order_relaxed);
+
+        if (count > max_datagrams_per_wakeup.load(std::memory_order_relaxed)) {
+            max_datagrams_per_wakeup.store(count, std::memory_order_relaxed);
+        }
+    }
+
+protected:
+    void set_channel_window(std::size_t channel_index, const _detail::channel_window& window) {
+        if (channel_windows.size() <= channel_index) {
+            channel_windows.resize(channel_index + 1, {config::reliable_send_window, config::reliable_receive_window});
+        }
+
+        channel_windows[channel_index] = window;
+    }
+
 private:
+    struct outgoing_datagram {
+        std::shared_ptr<connection_base> conn;
+        protocol::endpoint endpoint;
+        _detail::shared_datagram_buffer data;
+        std::size_t size;
+        _detail::shared_datagram_buffer body;
+        std::size_t body_size;
+        std::function<void(asio::error_code)> on_sent;
+    };
+
+    static constexpr auto aggregate_entry_size = sizeof(_detail::headers::aggregate_entry);
+
+    /** Gets the size a queued datagram's aggregate may grow to, which is the datagram size its connection agreed on. Defined in connection_base.hpp. */
+    static auto aggregate_size_limit(const outgoing_datagram& entry) -> std::size_t;
+
+    /** Determines whether a queued datagram could share an AGGREGATE with another. */
+    static auto can_aggregate(const outgoing_datagram& entry) -> bool {
+        auto type = _detail::headers::type{};
+        std::memcpy(&type, entry.data.data(), sizeof(type));
+
+        return (type == _detail::headers::type::DATA || type == _detail::headers::type::DATA_ACK)
+            && !entry.on_sent
+            && sizeof(type) + 2 * aggregate_entry_size + entry.size + entry.body_size < aggregate_size_limit(entry);
+    }
+
+    /** Appends a datagram to an aggregate, first turning target into one if it isn't already. Returns false if it doesn't fit. */
+    auto append_aggregate(outgoing_datagram& target, const outgoing_datagram& entry) -> bool {
+        auto type = _detail::headers::type{};
+        std::memcpy(&type, target.data.data(), sizeof(type));
+
+        // Both datagrams go to the same connection.
+        auto limit = aggregate_size_limit(target);
+
+        if (type != _detail::headers::type::AGGREGATE) {
+            if (sizeof(type) + 2 * aggregate_entry_size + target.size + target.body_size + entry.size + entry.body_size > limit) {
+                return false;
+            }
+
+            // Only start an aggregate once there is a second datagram to put in it. The original may still be in a retry queue, so copy it.
+            auto buffer = make_pending_buffer();
+            auto size = sizeof(type);
+
+            type = _detail::headers::type::AGGREGATE;
+            std::memcpy(buffer.data(), &type, sizeof(type));
+
+            write_aggregate_entry(buffer, size, target);
+
+            target.data = std::move(buffer);
+            target.size = size;
+            target.body = {};
+            target.body_size = 0;
+        } else if (target.size + aggregate_entry_size + entry.size + entry.body_size > limit) {
+            return false;
+        }
+
+        write_aggregate_entry(target.data, target.size, entry);
+
+        return true;
+    }
+
+    static void write_aggregate_entry(_detail::shared_datagram_buffer& buffer, std::size_t& size, const outgoing_datagram& entry) {
+        auto header = _detail::headers::aggregate_entry{std::uint16_t(entry.size + entry.body_size)};
+
+        std::memcpy(buffer.data() + size, &header, sizeof(header));
+        std::memcpy(buffer.data() + size + sizeof(header), entry.data.data(), entry.size);
+
+        if (entry.body_size > 0) {
+            std::memcpy(buffer.data() + size + sizeof(header) + entry.size, entry.body.data(), entry.body_size);
+        }
+
+        size += sizeof(header) + entry.size + entry.body_size;
+    }
+
     asio::io_context* io;
     executor_type strand;
+    _detail::timer_wheel wheel;
     protocol::socket socket;
     _detail::datagram_buffer_cache cache;
+    _detail::message_pool message_pool;
     std::mt19937 rng;
     std::uint16_t context_id;
+    std::vector<outgoing_datagram> outgoing;
+    bool flush_pending;
+    bool aggregation;
+    std::unordered_map<const connection_base*, std::size_t> open_aggregates;
+    std::size_t datagram_size_limit;
+    bool mtu_probing;
+    congestion_controller_factory congestion_factory;
+    std::vector<_detail::channel_window> channel_windows;
+#ifdef TRELLIS_HAS_MMSG
+    _detail::send_batch sender;
+#endif
+    std::atomic<std::uint64_t> receive_wakeups;
+    std::atomic<std::uint64_t> datagrams_received;
+    std::atomic<std::uint64_t> max_datagrams_per_wakeup;
+    std::atomic<std::uint64_t> send_calls;
+    std::atomic<std::uint64_t> datagrams_sent;
+    std::atomic<std::uint64_t> datagrams_aggregated;
 };
 
 inline context_base::~context_base() = default;
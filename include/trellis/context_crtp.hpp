@@ -4,10 +4,12 @@
 #include "config.hpp"
 #include "connection.hpp"
 #include "datagram.hpp"
+#include "datagram_batch.hpp"
 #include "logging.hpp"
 #include "message_header.hpp"
-#include "lock_free_queue.hpp"
 #include "event.hpp"
+#include "event_queue.hpp"
+#include "socket_option.hpp"
 #include "utility.hpp"
 #include "streams_fwd.hpp"
 
@@ -16,9 +18,15 @@
 #include <cstring>
 #include <cassert>
 #include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <tuple>
+#include <utility>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 namespace trellis {
 
@@ -39,8 +47,35 @@ public:
         context_base(io),
         sender_endpoint(),
         buffer(),
+        receive_batch_size(config::receive_batch_size),
+        reuse_port(false),
+#ifdef TRELLIS_HAS_MMSG
+        batch(),
+#endif
         running(false),
-        events() {}
+        receive_paused(false),
+        events(config::event_queue_capacity),
+        direct_handler(),
+        direct_events(),
+        direct_pending(false),
+        event_signal(this->get_executor(), asio::steady_timer::time_point::max()),
+        async_waiters(0),
+        wait_mutex(),
+        wait_cv(),
+        sync_waiters(0) {}
+
+    /**
+     * Constructs a context that calls the handler directly on the networking thread instead of queueing events for poll_events.
+     * Events are delivered in a batch at the end of the strand pass that produced them, so the handler can safely send and disconnect.
+     * The handler must outlive the context and should not block. See poll_events for the Handler concept.
+     */
+    template <typename Handler>
+    context_crtp(asio::io_context& io, Handler& handler) :
+        context_crtp(io) {
+            direct_handler = [this, &handler](_detail::event& e) {
+                dispatch_event(handler, e);
+            };
+        }
 
     /** Closes all connections and stops the context. */
     void stop() {
@@ -56,8 +91,102 @@ public:
         return running;
     }
 
+    /**
+     * Sets the maximum number of datagrams drained from the socket per wakeup. Must be called before the socket is opened.
+     * A size of 1 receives one datagram at a time. Larger sizes are only supported on platforms with recvmmsg.
+     */
+    void set_receive_batch_size(std::size_t size) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!running);
+        assert(size > 0);
+
+        receive_batch_size = size;
+    }
+
+    /** Gets the maximum number of datagrams drained from the socket per wakeup. */
+    auto get_receive_batch_size() const -> std::size_t {
+        return receive_batch_size;
+    }
+
+    /**
+     * Allows several sockets to bind the same endpoint with SO_REUSEPORT, letting the kernel spread peers across them.
+     * Must be called before the socket is opened. Ignored on platforms without SO_REUSEPORT.
+     */
+    void set_reuse_port(bool enable) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!running);
+
+        reuse_port = enable;
+    }
+
+    /**
+     * Sets what happens when events arrive faster than they are polled. Must be called before the socket is opened.
+     * The default is event_queue_policy::grow.
+     */
+    void set_event_queue_policy(event_queue_policy policy) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!running);
+
+        events.set_policy(policy);
+    }
+
+    /** Gets what happens when events arrive faster than they are polled. */
+    auto get_event_queue_policy() const -> event_queue_policy {
+        return events.get_policy();
+    }
+
+    /** Sets the number of events that can be queued before the policy kicks in. Must be called before the socket is opened. */
+    void set_event_queue_capacity(std::size_t capacity) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!running);
+        assert(capacity > 0);
+
+        events.set_capacity(capacity);
+    }
+
+    /** Gets the number of events that can be queued before the policy kicks in, rounded up to a power of two. */
+    auto get_event_queue_capacity() const -> std::size_t {
+        return events.capacity();
+    }
+
+    /**
+     * Limits how many messages a reliable channel may have outstanding. Must be called before the socket is opened.
+     * Messages past the send window wait on the sender until the oldest ones are acked.
+     * Fragments past the receive window are dropped unacked, so the peer will resend them once the window has moved.
+     */
+    template <typename Channel>
+    void set_channel_window(std::size_t send, std::size_t receive) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!running);
+        assert(send > 0 && receive > 0);
+
+        static_assert(is_reliable_channel_v<Channel>, "Only reliable channels have windows.");
+
+        context_base::set_channel_window(traits::template channel_index<Channel>, {send, receive});
+    }
+
+    /** Gets a snapshot of the context's stats, including the event queue. Safe to call from any thread. */
+    auto get_stats() const -> context_stats {
+        auto stats = context_base::get_stats();
+        stats.event_queue_depth = events.size();
+        stats.event_queue_high_water = events.high_water();
+        stats.events_dropped = events.dropped();
+        return stats;
+    }
+
+    /** Determines whether the context calls a handler directly instead of queueing events. */
+    bool is_direct() const {
+        return bool(direct_handler);
+    }
+
     /**
      * Processes queued events and submits them to the given Handler.
+     * Contexts constructed with a handler never queue events, so there is nothing to poll.
      * 
      * Data messages are automatically routed to the overload matching the channel's tagged type.
      * 
@@ -70,32 +199,92 @@ public:
      *     a.on_receive(Channels{}, connection_ptr{}, std::decltype<std::istream&>())...;
      * };
      * ```
+     *
+     * Handlers may also have on_writable(Channel{}, connection_ptr{}) overloads, which are called once a reliable channel
+     * that refused a connection::try_send has room in its send window again. Handlers without them never see those events.
      */
     template <typename Handler>
     void poll_events(Handler&& handler) {
         // must be executed from user thread
         assert(!is_thread_current());
 
-        while (auto e = events.pop()) {
-            TRELLIS_LOG_ACTION("context_crtp", this->get_context_id(), "Dispatching event (type:", e->index(), ")");
+        events.pop_batch([&](_detail::event& e) {
+            dispatch_event(handler, e);
+        });
 
-            std::visit(_detail::overload {
-                [&](const _detail::event_connect& e) {
-                    handler.on_connect(std::static_pointer_cast<connection_type>(e.conn));
-                },
-                [&](const _detail::event_disconnect& e) {
-                    handler.on_disconnect(std::static_pointer_cast<connection_type>(e.conn), e.ec);
-                },
-                [&](const _detail::event_receive& e) {
-                    auto istream = _detail::ibytestream(e.data.data.get(), e.data.data_len);
-                    traits::with_channel_type(e.channel_id, [&](auto channel_type) {
-                        handler.on_receive(channel_type, std::static_pointer_cast<connection_type>(e.conn), istream);
-                    });
-                },
-            }, *e);
+        // Pairs with the fence in pause_receive, so either we see the flag or the networking thread sees the room we just made.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (receive_paused.load(std::memory_order_relaxed) && receive_paused.exchange(false)) {
+            TRELLIS_LOG_ACTION("context_crtp", this->get_context_id(), "Event queue has room again, resuming receive.");
+
+            asio::post(this->get_executor(), [this]{
+                if (running) {
+                    start_receive();
+                }
+            });
         }
     }
 
+    /**
+     * Blocks the calling thread until there are events to poll, the context stops, or the timeout expires.
+     * Returns true if there are events to poll.
+     */
+    template <typename Rep, typename Period>
+    bool wait_for_events(const std::chrono::duration<Rep, Period>& timeout) {
+        // must be executed from user thread
+        assert(!is_thread_current());
+        assert(!is_direct());
+
+        auto lock = std::unique_lock(wait_mutex);
+
+        sync_waiters.fetch_add(1, std::memory_order_relaxed);
+
+        // Pairs with the fence in notify_waiters, so either we see the new event or the producer sees us waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        wait_cv.wait_for(lock, timeout, [&]{ return !events.empty() || !running; });
+
+        sync_waiters.fetch_sub(1, std::memory_order_relaxed);
+
+        return !events.empty();
+    }
+
+    /**
+     * Asynchronously waits until there are events to poll.
+     * Completes with no error once events are available, or with asio::error::operation_aborted if the context stops.
+     * May also complete early if cancel_wait_events is called, so the handler should tolerate finding no events.
+     * The completion handler is invoked through its associated executor, which defaults to the io_context.
+     *
+     * Completion signature: void(asio::error_code)
+     */
+    template <typename CompletionToken>
+    auto async_wait_events(CompletionToken&& token) {
+        assert(!is_direct());
+
+        return asio::async_initiate<CompletionToken, void(asio::error_code)>([this](auto handler) {
+            asio::dispatch(this->get_executor(), [this, handler = std::move(handler)]() mutable {
+                if (!running || events.size() > 0) {
+                    complete_wait(std::move(handler));
+                    return;
+                }
+
+                ++async_waiters;
+
+                event_signal.async_wait([this, handler = std::move(handler)]([[maybe_unused]] asio::error_code ec) mutable {
+                    complete_wait(std::move(handler));
+                });
+            });
+        }, token);
+    }
+
+    /** Completes all pending async_wait_events operations right away. */
+    void cancel_wait_events() {
+        this->dispatch([this]{
+            wake_async_waiters();
+        });
+    }
+
 protected:
     using context_base::make_pending_buffer;
 
@@ -105,31 +294,235 @@ protected:
 
         get_socket().open(endpoint.protocol());
         get_socket().set_option(asio::ip::v6_only{false});
+#ifdef SO_REUSEPORT
+        if (reuse_port) {
+            get_socket().set_option(_detail::int_socket_option<SOL_SOCKET, SO_REUSEPORT>{1});
+        }
+#endif
+        if (this->get_mtu_probing()) {
+            set_dont_fragment(endpoint.protocol());
+        }
         get_socket().bind(endpoint);
         running = true;
-        receive();
+
+#ifdef TRELLIS_HAS_MMSG
+        if (receive_batch_size > 1) {
+            batch.resize(receive_batch_size);
+        }
+#endif
+
+        start_receive();
     }
 
     void close() {
         running = false;
         get_socket().shutdown(asio::socket_base::shutdown_both);
         get_socket().close();
+
+        // Wake up anyone waiting for events, since there won't be any more.
+        {
+            auto lock = std::lock_guard(wait_mutex);
+        }
+        wait_cv.notify_all();
+
+        cancel_wait_events();
     }
 
     void push_event(_detail::event&& e) {
         // must be executed from networking thread
         assert(is_thread_current());
 
-        events.push(std::move(e));
+        if (direct_handler) {
+            direct_events.push_back(std::move(e));
+
+            if (!direct_pending) {
+                direct_pending = true;
+                asio::post(this->get_executor(), [this]{ dispatch_direct(); });
+            }
+
+            return;
+        }
+
+        auto droppable = std::holds_alternative<_detail::event_receive>(e) && !traits::is_channel_reliable(std::get<_detail::event_receive>(e).channel_id);
+
+        if (!events.push(std::move(e), droppable)) {
+            TRELLIS_LOG_ACTION("context_crtp", this->get_context_id(), "Event queue full, dropped unreliable message.");
+            return;
+        }
+
+        notify_waiters();
+    }
+
+    virtual void notify_writable(connection_base& conn, std::uint8_t channel_id) override {
+        // should only be called from a reliable channel's ack handler, so we should be in the networking thread
+        assert(this->is_thread_current());
+
+        push_event(_detail::event_writable{std::static_pointer_cast<connection_type>(conn.shared_from_this()), channel_id});
     }
 
 private:
+    /**
+     * Sets the DF bit on outgoing datagrams, so a PROBE larger than the path is dropped instead of fragmented, and doesn't get acknowledged.
+     * Sends larger than the interface allows fail with EMSGSIZE instead. A dual-stack socket needs the IPv4 option as well as the IPv6 ones,
+     * and not every platform accepts every level, so errors are ignored.
+     */
+    void set_dont_fragment(const protocol& proto) {
+        [[maybe_unused]] auto ec = asio::error_code{};
+
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+        get_socket().set_option(_detail::int_socket_option<IPPROTO_IP, IP_MTU_DISCOVER>{IP_PMTUDISC_PROBE}, ec);
+#elif defined(IP_DONTFRAG)
+        get_socket().set_option(_detail::int_socket_option<IPPROTO_IP, IP_DONTFRAG>{1}, ec);
+#endif
+
+        if (proto == protocol::v6()) {
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+            get_socket().set_option(_detail::int_socket_option<IPPROTO_IPV6, IPV6_MTU_DISCOVER>{IPV6_PMTUDISC_PROBE}, ec);
+#endif
+#ifdef IPV6_DONTFRAG
+            get_socket().set_option(_detail::int_socket_option<IPPROTO_IPV6, IPV6_DONTFRAG>{1}, ec);
+#endif
+        }
+    }
+
+    /** Submits a single event to the handler, routing data messages to the overload for their channel. */
+    template <typename Handler>
+    void dispatch_event(Handler& handler, _detail::event& e) {
+        TRELLIS_LOG_ACTION("context_crtp", this->get_context_id(), "Dispatching event (type:", e.index(), ")");
+
+        std::visit(_detail::overload {
+            [&](const _detail::event_connect& e) {
+                handler.on_connect(std::static_pointer_cast<connection_type>(e.conn));
+            },
+            [&](const _detail::event_disconnect& e) {
+                handler.on_disconnect(std::static_pointer_cast<connection_type>(e.conn), e.ec);
+            },
+            [&](const _detail::event_receive& e) {
+                auto istream = _detail::ibytestream(e.data.data(), e.data.size());
+                traits::with_channel_type(e.channel_id, [&](auto channel_type) {
+                    handler.on_receive(channel_type, std::static_pointer_cast<connection_type>(e.conn), istream);
+                });
+            },
+            [&](const _detail::event_writable& e) {
+                traits::with_channel_type(e.channel_id, [&](auto channel_type) {
+                    if constexpr (_detail::has_on_writable_v<std::decay_t<Handler>, decltype(channel_type), connection_ptr>) {
+                        handler.on_writable(channel_type, std::static_pointer_cast<connection_type>(e.conn));
+                    }
+                });
+            },
+        }, e);
+    }
+
+    /** Wakes up threads blocked in wait_for_events and completes pending async_wait_events operations. */
+    void notify_waiters() {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        // Pairs with the fence in wait_for_events.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (sync_waiters.load(std::memory_order_relaxed) > 0) {
+            // Taking the lock ensures the waiter is either still checking its predicate or already asleep.
+            {
+                auto lock = std::lock_guard(wait_mutex);
+            }
+            wait_cv.notify_all();
+        }
+
+        wake_async_waiters();
+    }
+
+    void wake_async_waiters() {
+        // must be executed from networking thread
+        assert(is_thread_current());
+
+        if (async_waiters > 0) {
+            async_waiters = 0;
+            event_signal.cancel();
+        }
+    }
+
+    /** Invokes a wait_events handler through its associated executor. */
+    template <typename Handler>
+    void complete_wait(Handler&& handler) {
+        auto ec = running ? asio::error_code{} : asio::error_code{asio::error::operation_aborted};
+        auto executor = asio::get_associated_executor(handler, this->get_io().get_executor());
+
+        asio::post(executor, [handler = std::forward<Handler>(handler), ec]() mutable {
+            handler(ec);
+        });
+    }
+
+    /** Calls the direct handler with every event pushed during the previous strand pass. */
+    void dispatch_direct() {
+        // should only be posted by push_event, so we should be in the networking thread
+        assert(is_thread_current());
+
+        direct_pending = false;
+
+        // The handler may push more events, which will be dispatched in the next pass.
+        auto pending = std::exchange(direct_events, {});
+
+        for (auto& e : pending) {
+            direct_handler(e);
+        }
+
+        if (direct_events.empty()) {
+            pending.clear();
+            direct_events.swap(pending);
+        }
+    }
+
+    /** Starts receiving datagrams, in batches if the platform and the batch size allow it. */
+    void start_receive() {
+#ifdef TRELLIS_HAS_MMSG
+        if (receive_batch_size > 1) {
+            receive_many();
+            return;
+        }
+#endif
+
+        receive();
+    }
+
+    /**
+     * Under event_queue_policy::block, stops receiving while the event queue is full. poll_events starts receiving again once it has made room.
+     * Returns true if receiving is paused, in which case the caller must not wait for the socket.
+     */
+    auto pause_receive() -> bool {
+        if (events.get_policy() != event_queue_policy::block || !events.full()) {
+            return false;
+        }
+
+        receive_paused.store(true, std::memory_order_relaxed);
+
+        // Pairs with the fence in poll_events.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // If poll_events made room before it could see the flag, take it back and carry on.
+        if (!events.full() && receive_paused.exchange(false)) {
+            return false;
+        }
+
+        TRELLIS_LOG_ACTION("context_crtp", this->get_context_id(), "Event queue full, pausing receive.");
+
+        return true;
+    }
+
     void receive() {
+        if (pause_receive()) return;
+
+        // A message may still be referencing the previous buffer, so only reuse it if we're the sole owner.
+        if (!buffer || buffer.use_count() > 1) {
+            buffer = make_pending_buffer();
+        }
+
         sender_endpoint = {};
-        get_socket().async_receive_from(asio::buffer(buffer.data), sender_endpoint, this->bind_executor([this](asio::error_code ec, std::size_t size) {
+        get_socket().async_receive_from(buffer.buffer(), sender_endpoint, this->bind_executor([this](asio::error_code ec, std::size_t size) {
             if (!ec) {
                 if (running) {
-                    TRELLIS_LOG_DATAGRAM("recv", buffer.data, size);
+                    TRELLIS_LOG_DATAGRAM("recv", buffer, size);
+                    this->count_received(1);
                     auto derived = static_cast<derived_type*>(this);
                     derived->receive(buffer, sender_endpoint, size);
                     if (running) {
@@ -156,10 +549,88 @@ private:
         }));
     }
 
+#ifdef TRELLIS_HAS_MMSG
+    /**
+     * Waits for the socket to become readable, then drains it in batches and feeds every datagram to the derived context.
+     * At most config::receive_batches_per_wakeup batches are handled per wakeup, so a flood of datagrams can't starve timers and sends.
+     */
+    void receive_many() {
+        if (pause_receive()) return;
+
+        get_socket().async_wait(protocol::socket::wait_read, this->bind_executor([this](asio::error_code ec) {
+            if (ec) {
+                if (ec != asio::error::operation_aborted) {
+                    TRELLIS_LOG_ACTION("receive", -1, ec.category().name(), "(", ec.value(), "): ", ec.message());
+                    if (running) {
+                        receive_many();
+                    }
+                }
+                return;
+            }
+
+            if (!running) return;
+
+            auto derived = static_cast<derived_type*>(this);
+            auto total = std::size_t(0);
+
+            // Keep draining until a batch comes back short, which means the socket is empty, this wakeup has had its share, or a blocking event queue is full.
+            for (auto batches = std::size_t(0); running && batches < config::receive_batches_per_wakeup; ++batches) {
+                if (batches > 0 && events.get_policy() == event_queue_policy::block && events.full()) {
+                    break;
+                }
+
+                auto count = batch.receive(get_socket(), this->get_cache(), ec);
+
+                if (ec) {
+                    if (ec != asio::error::would_block) {
+                        // Errors from recvmmsg don't carry a sender, so they can't be attributed to a connection.
+                        TRELLIS_LOG_ACTION("receive", -1, ec.category().name(), "(", ec.value(), "): ", ec.message());
+                    }
+                    break;
+                }
+
+                for (auto i = std::size_t(0); i < count && running; ++i) {
+                    TRELLIS_LOG_DATAGRAM("recv", batch.buffer(i), batch.size(i));
+                    derived->receive(batch.buffer(i), batch.endpoint(i), batch.size(i));
+                }
+
+                total += count;
+
+                if (count < batch.capacity()) {
+                    break;
+                }
+            }
+
+            if (total > 0) {
+                this->count_received(total);
+            }
+
+            // If datagrams are still waiting, the socket is still readable, so this wakes up again after whatever else is queued.
+            if (running) {
+                receive_many();
+            }
+        }));
+    }
+#endif
+
     protocol::endpoint sender_endpoint;
-    _detail::datagram_buffer buffer;
+    _detail::shared_datagram_buffer buffer;
+    std::size_t receive_batch_size;
+    bool reuse_port;
+#ifdef TRELLIS_HAS_MMSG
+    _detail::receive_batch batch;
+#endif
     std::atomic<bool> running;
-    _detail::lock_free_queue<_detail::event> events;
+    std::atomic<bool> receive_paused;
+    _detail::event_queue<_detail::event> events;
+    std::function<void(_detail::event&)> direct_handler;
+    std::vector<_detail::event> direct_events;
+    bool direct_pending;
+    asio::steady_timer event_signal;
+    std::size_t async_waiters;
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+    std::atomic<std::size_t> sync_waiters;
 };
 
 } // namespace trellis
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+namespace trellis {
+
+/** Simple stats about a context. */
+struct context_stats {
+    std::uint64_t receive_wakeups; /** How many times the receive handler has woken up with at least one datagram. */
+    std::uint64_t datagrams_received; /** How many datagrams have been received in total. */
+    std::uint64_t max_datagrams_per_wakeup; /** The largest number of datagrams handled in a single wakeup. */
+    std::uint64_t send_calls; /** How many send syscalls have been made while flushing outgoing datagrams. */
+    std::uint64_t datagrams_sent; /** How many datagrams have been sent in total. */
+    std::uint64_t datagrams_aggregated; /** How many outgoing datagrams were packed into an AGGREGATE instead of being sent on their own. */
+    std::uint64_t message_bytes_in_use; /** Bytes held by messages being reassembled or waiting to be polled. */
+    std::uint64_t message_bytes_high_water; /** The largest message_bytes_in_use has ever been. */
+    std::uint64_t message_bytes_cached; /** Bytes kept in the message pool for reuse. */
+    std::uint64_t message_allocations_rejected; /** How many message buffers were refused because of the memory cap. */
+    std::uint64_t event_queue_depth; /** How many events are waiting to be polled. */
+    std::uint64_t event_queue_high_water; /** The largest event_queue_depth has ever been. */
+    std::uint64_t events_dropped; /** How many unreliable messages were dropped because the event queue was full. */
+    std::uint64_t datagram_buffers_allocated; /** How many datagram buffers have been created. */
+    std::uint64_t datagram_buffers_free; /** How many datagram buffers are cached for reuse. */
+    std::uint64_t datagram_buffers_in_flight; /** How many datagram buffers are held by queued, unacked or undelivered datagrams. */
+};
+
+} // namespace trellis
@@ -1,9 +1,11 @@
 #pragma once
 
+#include "channel_types.hpp"
 #include "utility.hpp"
 
 #include <asio.hpp>
 
+#include <array>
 #include <tuple>
 #include <type_traits>
 
@@ -29,6 +31,12 @@ struct context_traits<Context<Channels...>> {
     /** Gets the total number of channels. */
     static constexpr auto channel_count = sizeof...(Channels);
 
+    /** Determines whether the channel in the index i is reliable. */
+    static constexpr auto is_channel_reliable(int i) -> bool {
+        constexpr auto reliable = std::array<bool, sizeof...(Channels)>{is_reliable_channel_v<Channels>...};
+        return reliable[i];
+    }
+
     /** Calls func with the channel type in the index i. */
     template <int N, typename F>
     static constexpr void with_channel_type(int i, F&& func) {
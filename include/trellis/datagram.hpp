@@ -4,30 +4,46 @@
 
 #include <asio.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <utility>
+#include <vector>
+
+#if defined(__linux__) && !defined(TRELLIS_DISABLE_MMAP)
+#define TRELLIS_HAS_MMAP 1
+#include <sys/mman.h>
+#endif
 
 namespace trellis::_detail {
 
-using datagram_storage = std::array<char, config::datagram_size>;
+static_assert(config::max_datagram_size >= config::datagram_size, "Connections must be able to use at least the default datagram size.");
+static_assert(config::max_datagram_size <= 65507, "Datagrams must fit in a UDP payload.");
+
+using datagram_storage = std::array<char, config::max_datagram_size>;
 
-class datagram_buffer_cache;
+class datagram_buffer_depot;
 
-/** Acts as a datagram_storage with a shared_ptr control block. */
-struct datagram_buffer {
+/** Acts as a datagram_storage with a shared_ptr control block. Aligned to a cache line so neighbors in a slab never share one. */
+struct alignas(64) datagram_buffer {
     datagram_storage data;
     std::atomic<int> refcount = 0;
-    datagram_buffer* next = nullptr;
-    datagram_buffer_cache* cache = nullptr;
+    datagram_buffer* next = nullptr; /** The next buffer in a magazine or chain. */
+    std::atomic<datagram_buffer*> next_chain = nullptr; /** The next chain in the depot. Only meaningful for the first buffer of a chain. */
+    std::size_t chain_size = 0; /** The length of the chain. Only meaningful for the first buffer of a chain. */
+    datagram_buffer_depot* depot = nullptr;
 };
 
 /** Similar to a shared_ptr<datagram_storage>, but also provides direct access to the underlying storage. */
 class shared_datagram_buffer {
 public:
-    friend class datagram_buffer_cache;
+    friend class datagram_buffer_depot;
 
     shared_datagram_buffer();
 
@@ -43,9 +59,12 @@ public:
 
     explicit operator bool() const;
 
-    auto buffer(std::size_t size = config::datagram_size) -> asio::mutable_buffer;
+    /** Gets the number of shared_datagram_buffers referring to the same storage. */
+    auto use_count() const -> int;
+
+    auto buffer(std::size_t size = config::max_datagram_size) -> asio::mutable_buffer;
 
-    auto buffer(std::size_t size = config::datagram_size) const -> asio::const_buffer;
+    auto buffer(std::size_t size = config::max_datagram_size) const -> asio::const_buffer;
 
     auto operator[](std::size_t i) -> char&;
 
@@ -66,54 +85,434 @@ private:
     datagram_buffer* iter;
 };
 
-/** A simple allocator for datagram_buffers that maintains a free list. */
-class datagram_buffer_cache {
+/** Simple stats about a datagram_buffer_cache. Safe to read from any thread, but only a snapshot. */
+struct datagram_buffer_cache_stats {
+    std::uint64_t allocated; /** Buffers that have been created so far. Buffers are never given back to the global allocator. */
+    std::uint64_t free; /** Buffers waiting in a thread's magazine or in the depot. */
+    std::uint64_t in_flight; /** Buffers referred to by at least one shared_datagram_buffer. */
+};
+
+/**
+ * A thread's private stack of free buffers for one depot. Only the owning thread touches the stack.
+ * count is atomic so that the depot can read it for stats without locking.
+ */
+struct datagram_magazine {
+    std::shared_ptr<datagram_buffer_depot> depot;
+    datagram_buffer* head = nullptr;
+    std::atomic<std::size_t> count = 0;
+};
+
+/** All of one thread's magazines, one per depot it has used. Gives their buffers back to the depots when the thread exits. */
+class datagram_magazine_list {
 public:
-    friend class shared_datagram_buffer;
+    datagram_magazine_list() = default;
+    datagram_magazine_list(const datagram_magazine_list&) = delete;
+    datagram_magazine_list& operator=(const datagram_magazine_list&) = delete;
 
-    datagram_buffer_cache() :
-        free_buffers(nullptr) {}
+    ~datagram_magazine_list();
 
-    ~datagram_buffer_cache() {
-        auto buf = free_buffers.load();
-        while (buf) {
-            auto next = buf->next;
-            delete buf;
-            buf = next;
+    /** Finds or creates this thread's magazine for the depot. */
+    auto get(datagram_buffer_depot& depot) -> datagram_magazine&;
+
+private:
+    std::vector<std::unique_ptr<datagram_magazine>> magazines;
+    datagram_magazine* last = nullptr;
+};
+
+/** Set once the calling thread's datagram_magazine_list has been destroyed, so late frees don't touch it. */
+inline thread_local bool datagram_magazines_destroyed = false;
+
+/** Gets the calling thread's magazines, or nullptr if the thread is already tearing down its thread-locals. */
+inline auto local_datagram_magazines() -> datagram_magazine_list* {
+    if (datagram_magazines_destroyed) {
+        return nullptr;
+    }
+
+    thread_local auto list = datagram_magazine_list{};
+
+    return &list;
+}
+
+/**
+ * The central store of a datagram_buffer_cache.
+ * Threads take and free buffers through their own magazines, and only come to the depot to trade a whole chain of
+ * config::datagram_magazine_size buffers at a time. Chains are kept on a lock-free stack whose head is tagged
+ * with a counter, so a pop can't succeed against a chain that was popped and pushed back in the meantime.
+ * Owned through a shared_ptr by the cache and by every magazine, so it outlives whichever lets go last.
+ */
+class datagram_buffer_depot : public std::enable_shared_from_this<datagram_buffer_depot> {
+public:
+    friend class shared_datagram_buffer;
+    friend class datagram_magazine_list;
+
+    datagram_buffer_depot() :
+        top(0),
+        depot_free(0),
+        allocated(0),
+        closed(false),
+        registry_mutex(),
+        registry(),
+        slab_mutex(),
+        slabs() {}
+
+    datagram_buffer_depot(const datagram_buffer_depot&) = delete;
+    datagram_buffer_depot& operator=(const datagram_buffer_depot&) = delete;
+
+    /** How many buffers fit in one slab. */
+    static constexpr std::size_t buffers_per_slab = config::datagram_slab_bytes / sizeof(datagram_buffer);
+
+    static_assert(buffers_per_slab >= config::datagram_magazine_size, "A slab must hold at least one magazine.");
+
+    ~datagram_buffer_depot() {
+        // Every magazine has given its buffers back by now, since each of them holds a reference to the depot.
+        // The buffers are trivially destructible, so the slabs can be released as they are.
+        for (auto slab : slabs) {
+            free_slab(slab);
+        }
+    }
+
+    /** Allocates slabs until at least count buffers exist. */
+    void reserve(std::size_t count) {
+        while (allocated.load(std::memory_order_relaxed) < count) {
+            grow();
         }
     }
 
     auto make_pending_buffer() -> shared_datagram_buffer {
-        auto iter = free_buffers.load();
-        if (iter) {
-            while (!free_buffers.compare_exchange_strong(iter, iter->next));
-            iter->next = nullptr;
+        auto iter = static_cast<datagram_buffer*>(nullptr);
+
+        if (auto list = local_datagram_magazines()) {
+            auto& magazine = list->get(*this);
+            auto count = magazine.count.load(std::memory_order_relaxed);
+
+            if (count == 0) {
+                magazine.head = refill(count);
+            }
+
+            iter = magazine.head;
+            magazine.head = iter->next;
+            magazine.count.store(count - 1, std::memory_order_relaxed);
         } else {
-            iter = new datagram_buffer{};
-            iter->cache = this;
+            // The thread is exiting, so take a buffer straight from the depot.
+            auto count = std::size_t(0);
+
+            iter = refill(count);
+
+            if (count > 1) {
+                push_chain(iter->next, count - 1);
+            }
         }
 
         assert(iter);
-        assert(iter->cache == this);
+        assert(iter->depot == this);
+
+        iter->next = nullptr;
 
         return shared_datagram_buffer{iter};
     }
 
+    /** Marks the depot as abandoned by its cache. Magazines for it are dropped the next time their thread looks for a new one. */
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    auto is_closed() const -> bool {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    auto get_stats() const -> datagram_buffer_cache_stats {
+        auto free = depot_free.load(std::memory_order_relaxed);
+
+        {
+            auto lock = std::lock_guard(registry_mutex);
+
+            for (auto magazine : registry) {
+                free += magazine->count.load(std::memory_order_relaxed);
+            }
+        }
+
+        auto total = allocated.load(std::memory_order_relaxed);
+
+        // The counters are read at slightly different times, so don't let a buffer in transit go negative.
+        free = std::min(free, total);
+
+        return {total, free, total - free};
+    }
+
 private:
+    static constexpr int pointer_bits = sizeof(void*) == 8 ? 48 : 32;
+    static constexpr std::uint64_t pointer_mask = (std::uint64_t(1) << pointer_bits) - 1;
+
+    static auto pack(datagram_buffer* ptr, std::uint64_t tag) -> std::uint64_t {
+        auto bits = std::uint64_t(reinterpret_cast<std::uintptr_t>(ptr));
+        assert((bits & ~pointer_mask) == 0);
+        return bits | (tag << pointer_bits);
+    }
+
+    static auto unpack_pointer(std::uint64_t packed) -> datagram_buffer* {
+        return reinterpret_cast<datagram_buffer*>(std::uintptr_t(packed & pointer_mask));
+    }
+
+    static auto unpack_tag(std::uint64_t packed) -> std::uint64_t {
+        return packed >> pointer_bits;
+    }
+
     void free_pending_buffer(datagram_buffer* iter) {
         assert(iter);
         assert(iter->refcount == 0);
-        assert(iter->cache == this);
+        assert(iter->depot == this);
+
+        auto list = local_datagram_magazines();
+
+        if (!list) {
+            push_chain(iter, 1);
+            return;
+        }
+
+        auto& magazine = list->get(*this);
+        auto count = magazine.count.load(std::memory_order_relaxed);
+
+        iter->next = magazine.head;
+        magazine.head = iter;
+        ++count;
+
+        // Keep one magazine's worth around, so a thread alternating between taking and freeing doesn't bounce chains.
+        if (count >= 2 * config::datagram_magazine_size) {
+            auto last = magazine.head;
+
+            for (auto i = std::size_t(1); i < config::datagram_magazine_size; ++i) {
+                last = last->next;
+            }
+
+            auto chain = magazine.head;
+            magazine.head = last->next;
+            last->next = nullptr;
+            count -= config::datagram_magazine_size;
+
+            push_chain(chain, config::datagram_magazine_size);
+        }
+
+        magazine.count.store(count, std::memory_order_relaxed);
+    }
+
+    /** Gets a chain of free buffers from the depot, allocating a new slab if it's empty. count is set to the chain's length. */
+    auto refill(std::size_t& count) -> datagram_buffer* {
+        while (true) {
+            if (auto chain = pop_chain(count)) {
+                return chain;
+            }
+
+            // Another thread may take the new chains first, in which case this just tries again.
+            grow();
+        }
+    }
+
+    /** Allocates a slab and pushes its buffers to the depot in chains of config::datagram_magazine_size. */
+    void grow() {
+        auto slab = allocate_slab();
+        auto buffers = static_cast<datagram_buffer*>(slab);
+
+        {
+            auto lock = std::lock_guard(slab_mutex);
+            slabs.push_back(slab);
+        }
 
-        auto first = free_buffers.load();
-        iter->next = first;
+        for (auto i = std::size_t(0); i < buffers_per_slab; ++i) {
+            auto iter = new (buffers + i) datagram_buffer{};
+            iter->depot = this;
+        }
+
+        allocated.fetch_add(buffers_per_slab, std::memory_order_relaxed);
+
+        for (auto b = std::size_t(0); b < buffers_per_slab; b += config::datagram_magazine_size) {
+            auto e = std::min(b + config::datagram_magazine_size, buffers_per_slab);
+
+            for (auto i = b; i + 1 < e; ++i) {
+                buffers[i].next = &buffers[i + 1];
+            }
+
+            push_chain(&buffers[b], e - b);
+        }
+    }
+
+    /**
+     * Gets memory for a slab. Where mmap is available, slabs are mapped directly and marked for transparent huge pages.
+     * Defining TRELLIS_ENABLE_HUGETLB tries explicit huge pages first, which only works if the system has some reserved.
+     */
+    static auto allocate_slab() -> void* {
+#ifdef TRELLIS_HAS_MMAP
+#if defined(TRELLIS_ENABLE_HUGETLB) && defined(MAP_HUGETLB)
+        if (auto ptr = ::mmap(nullptr, config::datagram_slab_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0); ptr != MAP_FAILED) {
+            return ptr;
+        }
+#endif
+        auto ptr = ::mmap(nullptr, config::datagram_slab_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (ptr == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+
+#ifdef MADV_HUGEPAGE
+        ::madvise(ptr, config::datagram_slab_bytes, MADV_HUGEPAGE);
+#endif
+
+        return ptr;
+#else
+        return ::operator new(config::datagram_slab_bytes, std::align_val_t(alignof(datagram_buffer)));
+#endif
+    }
+
+    static void free_slab(void* slab) {
+#ifdef TRELLIS_HAS_MMAP
+        ::munmap(slab, config::datagram_slab_bytes);
+#else
+        ::operator delete(slab, std::align_val_t(alignof(datagram_buffer)));
+#endif
+    }
+
+    void push_chain(datagram_buffer* chain, std::size_t count) {
+        assert(chain);
+        assert(count > 0);
+
+        chain->chain_size = count;
+        depot_free.fetch_add(count, std::memory_order_relaxed);
+
+        auto head = top.load(std::memory_order_relaxed);
+
+        do {
+            chain->next_chain.store(unpack_pointer(head), std::memory_order_relaxed);
+        } while (!top.compare_exchange_weak(head, pack(chain, unpack_tag(head) + 1), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    auto pop_chain(std::size_t& count) -> datagram_buffer* {
+        auto head = top.load(std::memory_order_acquire);
+
+        while (true) {
+            auto chain = unpack_pointer(head);
+
+            if (!chain) {
+                return nullptr;
+            }
+
+            // The chain may be popped by another thread before the exchange, but its memory stays valid, and the tag makes the exchange fail.
+            auto next = chain->next_chain.load(std::memory_order_relaxed);
+
+            if (top.compare_exchange_weak(head, pack(next, unpack_tag(head) + 1), std::memory_order_acquire, std::memory_order_acquire)) {
+                count = chain->chain_size;
+                depot_free.fetch_sub(count, std::memory_order_relaxed);
+                return chain;
+            }
+        }
+    }
+
+    void register_magazine(datagram_magazine* magazine) {
+        auto lock = std::lock_guard(registry_mutex);
+        registry.push_back(magazine);
+    }
+
+    /** Takes back a magazine's buffers and forgets it. */
+    void release_magazine(datagram_magazine* magazine) {
+        {
+            auto lock = std::lock_guard(registry_mutex);
+            registry.erase(std::find(registry.begin(), registry.end(), magazine));
+        }
+
+        auto count = magazine->count.load(std::memory_order_relaxed);
+
+        if (count > 0) {
+            push_chain(magazine->head, count);
+        }
 
-        while (!free_buffers.compare_exchange_strong(first, iter)) {
-            iter->next = first;
+        magazine->head = nullptr;
+        magazine->count.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint64_t> top;
+    std::atomic<std::size_t> depot_free;
+    std::atomic<std::uint64_t> allocated;
+    std::atomic<bool> closed;
+    mutable std::mutex registry_mutex;
+    std::vector<datagram_magazine*> registry;
+    std::mutex slab_mutex;
+    std::vector<void*> slabs;
+};
+
+inline datagram_magazine_list::~datagram_magazine_list() {
+    for (auto& magazine : magazines) {
+        magazine->depot->release_magazine(magazine.get());
+    }
+
+    datagram_magazines_destroyed = true;
+}
+
+inline auto datagram_magazine_list::get(datagram_buffer_depot& depot) -> datagram_magazine& {
+    if (last && last->depot.get() == &depot) {
+        return *last;
+    }
+
+    for (auto& magazine : magazines) {
+        if (magazine->depot.get() == &depot) {
+            last = magazine.get();
+            return *last;
         }
     }
 
-    std::atomic<datagram_buffer*> free_buffers;
+    // Drop the magazines of caches that have been destroyed before adding a new one, so the list doesn't grow without bound.
+    magazines.erase(std::remove_if(magazines.begin(), magazines.end(), [](const std::unique_ptr<datagram_magazine>& magazine) {
+        if (magazine->depot->is_closed()) {
+            magazine->depot->release_magazine(magazine.get());
+            return true;
+        }
+
+        return false;
+    }), magazines.end());
+
+    auto magazine = std::make_unique<datagram_magazine>();
+    magazine->depot = depot.shared_from_this();
+    depot.register_magazine(magazine.get());
+
+    last = magazine.get();
+    magazines.push_back(std::move(magazine));
+
+    return *last;
+}
+
+/**
+ * An allocator for datagram_buffers, shared by every thread that sends or receives through a context.
+ * Buffers are carved out of large slabs, which are kept until the cache and every thread's magazine for it are gone.
+ * Each thread keeps a magazine of free buffers, and trades whole chains of them with a central depot,
+ * so taking and freeing a buffer is usually just a few pointer moves with no atomics.
+ */
+class datagram_buffer_cache {
+public:
+    /** Constructs a cache, allocating enough slabs up front for at least prewarm buffers. */
+    explicit datagram_buffer_cache(std::size_t prewarm = 0) :
+        depot(std::make_shared<datagram_buffer_depot>()) {
+            depot->reserve(prewarm);
+        }
+
+    datagram_buffer_cache(const datagram_buffer_cache&) = delete;
+    datagram_buffer_cache& operator=(const datagram_buffer_cache&) = delete;
+
+    ~datagram_buffer_cache() {
+        depot->close();
+    }
+
+    auto make_pending_buffer() -> shared_datagram_buffer {
+        return depot->make_pending_buffer();
+    }
+
+    /** Allocates slabs until at least count buffers exist. */
+    void reserve(std::size_t count) {
+        depot->reserve(count);
+    }
+
+    auto get_stats() const -> datagram_buffer_cache_stats {
+        return depot->get_stats();
+    }
+
+private:
+    std::shared_ptr<datagram_buffer_depot> depot;
 };
 
 inline shared_datagram_buffer::shared_datagram_buffer() : iter(nullptr) {}
@@ -155,7 +554,7 @@ inline shared_datagram_buffer& shared_datagram_buffer::operator=(const shared_da
 
     // decrement refcount and maybe free the current iter
     if (iter && --iter->refcount == 0) {
-        iter->cache->free_pending_buffer(iter);
+        iter->depot->free_pending_buffer(iter);
     }
 
     // copy
@@ -178,7 +577,7 @@ inline shared_datagram_buffer::~shared_datagram_buffer() {
 
     // decrement refcount and maybe free iter
     if (iter && --iter->refcount == 0) {
-        iter->cache->free_pending_buffer(iter);
+        iter->depot->free_pending_buffer(iter);
     }
 }
 
@@ -186,6 +585,10 @@ inline shared_datagram_buffer::operator bool() const {
     return bool(iter);
 }
 
+inline auto shared_datagram_buffer::use_count() const -> int {
+    return iter ? iter->refcount.load() : 0;
+}
+
 inline auto shared_datagram_buffer::buffer(std::size_t size) -> asio::mutable_buffer {
     assert(iter && iter->refcount > 0);
     return asio::buffer(iter->data, size);
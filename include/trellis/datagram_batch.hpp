@@ -0,0 +1,206 @@
+#pragma once
+
+#include "config.hpp"
+#include "datagram.hpp"
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#if defined(__linux__) && !defined(TRELLIS_DISABLE_MMSG)
+#define TRELLIS_HAS_MMSG 1
+#include <sys/socket.h>
+#include <cerrno>
+#endif
+
+namespace trellis::_detail {
+
+#ifdef TRELLIS_HAS_MMSG
+
+/**
+ * A ring of datagram buffers which is filled from a socket with a single recvmmsg call.
+ * Buffers come from a datagram_buffer_cache. A buffer that is still referenced elsewhere after being handled,
+ * for example by a received message, is replaced with a fresh one from the cache before the next receive.
+ */
+class receive_batch {
+public:
+    using protocol = asio::ip::udp;
+
+    receive_batch() :
+        count(0),
+        buffers(),
+        endpoints(),
+        iovecs(),
+        headers() {}
+
+    receive_batch(const receive_batch&) = delete;
+    receive_batch& operator=(const receive_batch&) = delete;
+
+    /** Reallocates the ring to hold n datagrams. */
+    void resize(std::size_t n) {
+        assert(n > 0);
+
+        count = n;
+        buffers.assign(n, shared_datagram_buffer{});
+        endpoints.assign(n, protocol::endpoint{});
+        iovecs.assign(n, ::iovec{});
+        headers.assign(n, ::mmsghdr{});
+    }
+
+    auto capacity() const -> std::size_t {
+        return count;
+    }
+
+    /**
+     * Receives as many datagrams as are immediately available, up to capacity().
+     * Never blocks. Returns zero with ec set to would_block if the socket has nothing to read.
+     */
+    auto receive(protocol::socket& socket, datagram_buffer_cache& cache, asio::error_code& ec) -> std::size_t {
+        assert(count > 0);
+
+        for (auto i = std::size_t(0); i < count; ++i) {
+            if (!buffers[i] || buffers[i].use_count() > 1) {
+                buffers[i] = cache.make_pending_buffer();
+            }
+
+            iovecs[i].iov_base = buffers[i].data();
+            iovecs[i].iov_len = buffers[i].size();
+
+            headers[i] = {};
+            headers[i].msg_hdr.msg_name = endpoints[i].data();
+            headers[i].msg_hdr.msg_namelen = endpoints[i].capacity();
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while (true) {
+            auto result = ::recvmmsg(socket.native_handle(), headers.data(), count, MSG_DONTWAIT, nullptr);
+
+            if (result >= 0) {
+                ec = {};
+
+                for (auto i = 0; i < result; ++i) {
+                    endpoints[i].resize(headers[i].msg_hdr.msg_namelen);
+                }
+
+                return std::size_t(result);
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ec = asio::error::would_block;
+            } else {
+                ec = asio::error_code(errno, asio::error::get_system_category());
+            }
+
+            return 0;
+        }
+    }
+
+    auto buffer(std::size_t i) const -> const shared_datagram_buffer& {
+        assert(i < count);
+        return buffers[i];
+    }
+
+    auto endpoint(std::size_t i) const -> const protocol::endpoint& {
+        assert(i < count);
+        return endpoints[i];
+    }
+
+    auto size(std::size_t i) const -> std::size_t {
+        assert(i < count);
+        return headers[i].msg_len;
+    }
+
+private:
+    std::size_t count;
+    std::vector<shared_datagram_buffer> buffers;
+    std::vector<protocol::endpoint> endpoints;
+    std::vector<::iovec> iovecs;
+    std::vector<::mmsghdr> headers;
+};
+
+/**
+ * Scratch space for sending many datagrams with a single sendmmsg call.
+ * Entries must have `endpoint`, `data` (a shared_datagram_buffer), and `size` members,
+ * plus a `body` buffer and `body_size` which, if the body is set, are sent right after the data.
+ */
+class send_batch {
+public:
+    using protocol = asio::ip::udp;
+
+    send_batch() :
+        iovecs(),
+        headers() {}
+
+    send_batch(const send_batch&) = delete;
+    send_batch& operator=(const send_batch&) = delete;
+
+    /**
+     * Sends datagrams from the range [b, e), up to config::send_batch_size at a time. Never blocks.
+     * Returns how many datagrams were sent. If the first datagram could not be sent, returns zero and sets ec.
+     */
+    template <typename Iter>
+    auto send(protocol::socket& socket, Iter b, Iter e, asio::error_code& ec) -> std::size_t {
+        auto count = std::min(std::size_t(e - b), config::send_batch_size);
+
+        assert(count > 0);
+
+        iovecs.resize(2 * count);
+        headers.resize(count);
+
+        for (auto i = std::size_t(0); i < count; ++i) {
+            auto& entry = b[i];
+            auto iov = &iovecs[2 * i];
+
+            iov[0].iov_base = entry.data.data();
+            iov[0].iov_len = entry.size;
+
+            if (entry.body) {
+                iov[1].iov_base = entry.body.data();
+                iov[1].iov_len = entry.body_size;
+            }
+
+            headers[i] = {};
+            headers[i].msg_hdr.msg_name = entry.endpoint.data();
+            headers[i].msg_hdr.msg_namelen = entry.endpoint.size();
+            headers[i].msg_hdr.msg_iov = iov;
+            headers[i].msg_hdr.msg_iovlen = entry.body ? 2 : 1;
+        }
+
+        while (true) {
+            auto result = ::sendmmsg(socket.native_handle(), headers.data(), count, MSG_DONTWAIT);
+
+            if (result >= 0) {
+                ec = {};
+                return std::size_t(result);
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ec = asio::error::would_block;
+            } else {
+                ec = asio::error_code(errno, asio::error::get_system_category());
+            }
+
+            return 0;
+        }
+    }
+
+private:
+    std::vector<::iovec> iovecs;
+    std::vector<::mmsghdr> headers;
+};
+
+#endif
+
+} // namespace trellis::_detail
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace trellis::_detail {
+
+/**
+ * A compact representation of a UDP endpoint. IPv4 addresses are stored as IPv4-mapped IPv6 addresses,
+ * but like asio endpoints they still compare unequal to the IPv6 endpoint they map to.
+ */
+struct endpoint_key {
+    std::array<std::uint8_t, 16> address;
+    std::uint32_t scope_id;
+    std::uint16_t port;
+    bool v4;
+
+    explicit endpoint_key(const asio::ip::udp::endpoint& endpoint) :
+        address(),
+        scope_id(0),
+        port(endpoint.port()),
+        v4(endpoint.address().is_v4()) {
+            auto addr = endpoint.address();
+
+            if (v4) {
+                auto bytes = addr.to_v4().to_bytes();
+                address[10] = 0xff;
+                address[11] = 0xff;
+                std::memcpy(address.data() + 12, bytes.data(), bytes.size());
+            } else {
+                auto v6 = addr.to_v6();
+                auto bytes = v6.to_bytes();
+                std::memcpy(address.data(), bytes.data(), bytes.size());
+                scope_id = v6.scope_id();
+            }
+        }
+
+    auto hash() const -> std::uint64_t {
+        auto a = std::uint64_t{};
+        auto b = std::uint64_t{};
+
+        std::memcpy(&a, address.data(), sizeof(a));
+        std::memcpy(&b, address.data() + sizeof(a), sizeof(b));
+
+        auto h = a ^ (b * 0x9e3779b97f4a7c15ull) ^ ((std::uint64_t(v4) << 48) | (std::uint64_t(port) << 32) | scope_id);
+
+        // splitmix64 finalizer
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        h ^= h >> 31;
+
+        // Zero marks an empty slot.
+        return h | 1;
+    }
+
+    friend bool operator==(const endpoint_key& a, const endpoint_key& b) {
+        return a.port == b.port && a.scope_id == b.scope_id && a.v4 == b.v4 && a.address == b.address;
+    }
+};
+
+/**
+ * An open-addressing hash table keyed by UDP endpoint.
+ * Uses linear probing with backward-shift deletion, so there are no tombstones.
+ * Probing only touches a dense array of hashes and keys, the values live in a parallel array.
+ * Inserting and erasing invalidate all iterators.
+ */
+template <typename T>
+class endpoint_map {
+public:
+    using key_type = asio::ip::udp::endpoint;
+    using mapped_type = T;
+    using value_type = std::pair<key_type, mapped_type>;
+
+    template <typename Map, typename Value>
+    class basic_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::remove_const_t<Value>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value*;
+        using reference = Value&;
+
+        basic_iterator() : map(nullptr), index(0) {}
+
+        basic_iterator(Map* map, std::size_t index) : map(map), index(index) {
+            skip_empty();
+        }
+
+        template <typename M, typename V>
+        basic_iterator(const basic_iterator<M, V>& other) : map(other.map), index(other.index) {}
+
+        auto operator*() const -> reference {
+            return *map->values[index];
+        }
+
+        auto operator->() const -> pointer {
+            return &*map->values[index];
+        }
+
+        auto operator++() -> basic_iterator& {
+            ++index;
+            skip_empty();
+            return *this;
+        }
+
+        auto operator++(int) -> basic_iterator {
+            auto tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        friend bool operator==(const basic_iterator& a, const basic_iterator& b) {
+            return a.map == b.map && a.index == b.index;
+        }
+
+        friend bool operator!=(const basic_iterator& a, const basic_iterator& b) {
+            return !(a == b);
+        }
+
+    private:
+        template <typename M, typename V>
+        friend class basic_iterator;
+
+        friend endpoint_map;
+
+        void skip_empty() {
+            while (index < map->slots.size() && map->slots[index].hash == 0) {
+                ++index;
+            }
+        }
+
+        Map* map;
+        std::size_t index;
+    };
+
+    using iterator = basic_iterator<endpoint_map, value_type>;
+    using const_iterator = basic_iterator<const endpoint_map, const value_type>;
+
+    endpoint_map() :
+        slots(),
+        values(),
+        count(0) {}
+
+    auto begin() -> iterator {
+        return {this, 0};
+    }
+
+    auto end() -> iterator {
+        return {this, slots.size()};
+    }
+
+    auto begin() const -> const_iterator {
+        return {this, 0};
+    }
+
+    auto end() const -> const_iterator {
+        return {this, slots.size()};
+    }
+
+    auto size() const -> std::size_t {
+        return count;
+    }
+
+    auto empty() const -> bool {
+        return count == 0;
+    }
+
+    void clear() {
+        slots.clear();
+        values.clear();
+        count = 0;
+    }
+
+    /** Makes room for n elements without rehashing. */
+    void reserve(std::size_t n) {
+        auto capacity = min_capacity;
+
+        while (capacity * max_load_numerator < n * max_load_denominator) {
+            capacity *= 2;
+        }
+
+        if (capacity > slots.size()) {
+            rehash(capacity);
+        }
+    }
+
+    auto find(const key_type& endpoint) -> iterator {
+        return {this, find_index(endpoint_key(endpoint))};
+    }
+
+    auto find(const key_type& endpoint) const -> const_iterator {
+        return {this, find_index(endpoint_key(endpoint))};
+    }
+
+    /** Inserts a new element constructed from args if the endpoint is not already present. */
+    template <typename... Args>
+    auto emplace(const key_type& endpoint, Args&&... args) -> std::pair<iterator, bool> {
+        auto key = endpoint_key(endpoint);
+
+        auto existing = find_index(key);
+
+        if (existing != slots.size()) {
+            return {iterator(this, existing), false};
+        }
+
+        reserve(count + 1);
+
+        auto hash = key.hash();
+        auto mask = slots.size() - 1;
+        auto i = std::size_t(hash) & mask;
+
+        while (slots[i].hash != 0) {
+            i = (i + 1) & mask;
+        }
+
+        slots[i] = {hash, key};
+        values[i].emplace(std::piecewise_construct, std::forward_as_tuple(endpoint), std::forward_as_tuple(std::forward<Args>(args)...));
+        ++count;
+
+        return {iterator(this, i), true};
+    }
+
+    /** Removes the element at iter. Invalidates all iterators. */
+    void erase(const_iterator iter) {
+        assert(iter.map == this);
+        assert(iter.index < slots.size());
+        assert(slots[iter.index].hash != 0);
+
+        auto mask = slots.size() - 1;
+        auto hole = iter.index;
+
+        slots[hole].hash = 0;
+        values[hole].reset();
+        --count;
+
+        // Shift back any following elements that would no longer be reachable from their home slot.
+        for (auto i = (hole + 1) & mask; slots[i].hash != 0; i = (i + 1) & mask) {
+            auto home = std::size_t(slots[i].hash) & mask;
+
+            // If the element's home is cyclically in (hole, i], it can stay where it is.
+            auto stays = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+
+            if (!stays) {
+                slots[hole] = slots[i];
+                values[hole] = std::move(values[i]);
+                slots[i].hash = 0;
+                values[i].reset();
+                hole = i;
+            }
+        }
+    }
+
+    /** Removes the element with the given endpoint, if any. Returns the number of elements removed. */
+    auto erase(const key_type& endpoint) -> std::size_t {
+        auto iter = find(endpoint);
+
+        if (iter == end()) {
+            return 0;
+        }
+
+        erase(iter);
+
+        return 1;
+    }
+
+private:
+    static constexpr std::size_t min_capacity = 16;
+    static constexpr std::size_t max_load_numerator = 1;
+    static constexpr std::size_t max_load_denominator = 2;
+
+    struct slot {
+        std::uint64_t hash;
+        endpoint_key key;
+    };
+
+    auto find_index(const endpoint_key& key) const -> std::size_t {
+        if (count == 0) {
+            return slots.size();
+        }
+
+        auto hash = key.hash();
+        auto mask = slots.size() - 1;
+
+        for (auto i = std::size_t(hash) & mask; slots[i].hash != 0; i = (i + 1) & mask) {
+            if (slots[i].hash == hash && slots[i].key == key) {
+                return i;
+            }
+        }
+
+        return slots.size();
+    }
+
+    void rehash(std::size_t capacity) {
+        assert((capacity & (capacity - 1)) == 0);
+        assert(capacity * max_load_numerator >= count * max_load_denominator);
+
+        auto old_slots = std::exchange(slots, std::vector<slot>(capacity, slot{0, endpoint_key(key_type{})}));
+        auto old_values = std::exchange(values, std::vector<std::optional<value_type>>(capacity));
+
+        auto mask = capacity - 1;
+
+        for (auto j = std::size_t(0); j < old_slots.size(); ++j) {
+            if (old_slots[j].hash == 0) continue;
+
+            auto i = std::size_t(old_slots[j].hash) & mask;
+
+            while (slots[i].hash != 0) {
+                i = (i + 1) & mask;
+            }
+
+            slots[i] = old_slots[j];
+            values[i] = std::move(old_values[j]);
+        }
+    }
+
+    std::vector<slot> slots;
+    std::vector<std::optional<value_type>> values;
+    std::size_t count;
+};
+
+} // namespace trellis::_detail
@@ -29,6 +29,13 @@ public:
     raw_buffer data;
 };
 
-using event = std::variant<event_connect, event_disconnect, event_receive>;
+struct event_writable {
+    using connection_ptr = std::shared_ptr<void>;
+
+    connection_ptr conn;
+    std::uint8_t channel_id;
+};
+
+using event = std::variant<event_connect, event_disconnect, event_receive, event_writable>;
 
 } // namespace trellis::_detail
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace trellis {
+
+/** What a context does when its event queue is full. */
+enum class event_queue_policy {
+    /**
+     * The context stops reading from its socket until poll_events makes room, so peers are slowed down by the socket's buffer filling up.
+     * Events that don't come from received datagrams, such as timeouts, are still queued.
+     */
+    block,
+    /** Messages from unreliable channels are dropped. Connects, disconnects, and reliable messages grow the queue instead. */
+    drop_unreliable,
+    /** The queue grows to hold every event. */
+    grow,
+};
+
+namespace _detail {
+
+inline constexpr std::size_t cache_line_size = 64;
+
+/**
+ * A bounded single-producer single-consumer ring buffer.
+ * The networking thread pushes and the user thread drains. Head and tail live on separate cache lines, and each side caches the other's index so it only touches the shared line when it appears to be full or empty.
+ * Growing links a new ring twice the size. The consumer frees the old ring once it has drained it.
+ * Under event_queue_policy::block the queue grows as well, and it is up to the producer to check full() and stop producing.
+ */
+template <typename T>
+class event_queue {
+public:
+    using value_type = T;
+    using storage_type = std::aligned_storage_t<sizeof(value_type), alignof(value_type)>;
+
+    explicit event_queue(std::size_t capacity) :
+        producer{},
+        consumer{},
+        counters{} {
+            auto ring = new segment(round_up(capacity));
+            producer.ring = ring;
+            producer.limit = ring->mask + 1;
+            consumer.ring = ring;
+        }
+
+    event_queue(const event_queue&) = delete;
+    event_queue& operator=(const event_queue&) = delete;
+
+    ~event_queue() {
+        for (auto ring = consumer.ring; ring;) {
+            auto next = ring->next.load(std::memory_order_acquire);
+            delete ring;
+            ring = next;
+        }
+    }
+
+    /** Sets the overflow policy. Should be set before any events are pushed. */
+    void set_policy(event_queue_policy p) {
+        producer.policy = p;
+    }
+
+    auto get_policy() const -> event_queue_policy {
+        return producer.policy;
+    }
+
+    /** Replaces the ring with one of the given capacity. The queue must be empty and idle. */
+    void set_capacity(std::size_t capacity) {
+        assert(consumer.ring == producer.ring);
+        assert(size() == 0);
+
+        delete consumer.ring;
+
+        auto ring = new segment(round_up(capacity));
+        producer.ring = ring;
+        producer.cached_head = 0;
+        producer.limit = ring->mask + 1;
+        consumer.ring = ring;
+    }
+
+    /** Gets the capacity the queue was given, rounded up to a power of two. The queue only grows past it under event_queue_policy::grow, or for values that can't be dropped. */
+    auto capacity() const -> std::size_t {
+        return producer.limit;
+    }
+
+    /** Gets the size of the ring currently being written, which is larger than capacity() once the queue has grown. */
+    auto ring_capacity() const -> std::size_t {
+        return producer.ring->mask + 1;
+    }
+
+    /**
+     * Pushes a value. Must only be called from the producer thread.
+     * Returns false if the value was dropped, which only happens to droppable values under event_queue_policy::drop_unreliable.
+     */
+    auto push(T&& value, bool droppable) -> bool {
+        // Drops are decided against the configured capacity, not the ring, so growing for one value that can't be dropped doesn't let droppable values past the bound.
+        if (droppable && producer.policy == event_queue_policy::drop_unreliable && full()) {
+            store_relaxed(counters.dropped, counters.dropped.load(std::memory_order_relaxed) + 1);
+            return false;
+        }
+
+        auto ring = producer.ring;
+        auto tail = ring->tail.load(std::memory_order_relaxed);
+
+        if (tail - producer.cached_head > ring->mask) {
+            producer.cached_head = ring->head.load(std::memory_order_acquire);
+
+            if (tail - producer.cached_head > ring->mask) {
+                auto next = new segment((ring->mask + 1) * 2);
+                ring->next.store(next, std::memory_order_release);
+                producer.ring = next;
+                producer.cached_head = 0;
+                ring = next;
+                tail = 0;
+            }
+        }
+
+        new (&ring->slots[tail & ring->mask]) T(std::move(value));
+        ring->tail.store(tail + 1, std::memory_order_release);
+
+        auto pushed = counters.pushed.load(std::memory_order_relaxed) + 1;
+        store_relaxed(counters.pushed, pushed);
+
+        auto depth = pushed - counters.popped.load(std::memory_order_relaxed);
+
+        if (depth > counters.high_water.load(std::memory_order_relaxed)) {
+            store_relaxed(counters.high_water, depth);
+        }
+
+        return true;
+    }
+
+    /**
+     * Calls func with every value that was in the queue when it was called, in order. Must only be called from the consumer thread.
+     * Each ring's tail is acquired once per call. Returns the number of values consumed.
+     */
+    template <typename F>
+    auto pop_batch(F&& func) -> std::size_t {
+        auto count = std::size_t(0);
+
+        while (true) {
+            auto ring = consumer.ring;
+            auto head = ring->head.load(std::memory_order_relaxed);
+            auto tail = ring->tail.load(std::memory_order_acquire);
+
+            for (; head != tail; ++head) {
+                auto& value = *std::launder(reinterpret_cast<value_type*>(&ring->slots[head & ring->mask]));
+
+                func(value);
+
+                value.~value_type();
+                ring->head.store(head + 1, std::memory_order_release);
+                store_relaxed(counters.popped, counters.popped.load(std::memory_order_relaxed) + 1);
+                ++count;
+            }
+
+            auto next = ring->next.load(std::memory_order_acquire);
+
+            if (!next) {
+                break;
+            }
+
+            // The producer may have filled this ring before moving on, so only free it once it has been drained.
+            if (ring->tail.load(std::memory_order_acquire) != head) {
+                continue;
+            }
+
+            consumer.ring = next;
+            delete ring;
+        }
+
+        return count;
+    }
+
+    /**
+     * Determines whether there is nothing to pop. Must only be called from the consumer thread.
+     * Rings the producer has moved past may already be drained before pop_batch frees them, so every linked ring is checked.
+     */
+    auto empty() const -> bool {
+        for (auto ring = consumer.ring; ring; ring = ring->next.load(std::memory_order_acquire)) {
+            if (ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /** Gets the number of queued values. Safe to call from any thread, but only approximate. */
+    auto size() const -> std::size_t {
+        auto popped = counters.popped.load(std::memory_order_relaxed);
+        auto pushed = counters.pushed.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+    /** Determines whether the queue holds at least as many values as the capacity it was given. Safe to call from any thread, but only approximate. */
+    auto full() const -> bool {
+        return size() >= producer.limit;
+    }
+
+    /** Gets the largest number of values that have been queued at once. */
+    auto high_water() const -> std::size_t {
+        return counters.high_water.load(std::memory_order_relaxed);
+    }
+
+    /** Gets the number of values dropped by event_queue_policy::drop_unreliable. */
+    auto dropped() const -> std::size_t {
+        return counters.dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct segment {
+        explicit segment(std::size_t capacity) :
+            mask(capacity - 1),
+            slots(new storage_type[capacity]),
+            head(0),
+            tail(0),
+            next(nullptr) {
+                assert((capacity & mask) == 0);
+            }
+
+        ~segment() {
+            auto h = head.load(std::memory_order_relaxed);
+            auto t = tail.load(std::memory_order_relaxed);
+
+            for (; h != t; ++h) {
+                std::launder(reinterpret_cast<value_type*>(&slots[h & mask]))->~value_type();
+            }
+        }
+
+        std::size_t mask;
+        std::unique_ptr<storage_type[]> slots;
+        alignas(cache_line_size) std::atomic<std::size_t> head;
+        alignas(cache_line_size) std::atomic<std::size_t> tail;
+        alignas(cache_line_size) std::atomic<segment*> next;
+    };
+
+    struct alignas(cache_line_size) producer_state {
+        segment* ring = nullptr;
+        std::size_t cached_head = 0;
+        std::size_t limit = 0;
+        event_queue_policy policy = event_queue_policy::grow;
+    };
+
+    struct alignas(cache_line_size) consumer_state {
+        segment* ring = nullptr;
+    };
+
+    /** Each counter has a single writer, so plain stores are enough. */
+    struct counter_state {
+        alignas(cache_line_size) std::atomic<std::size_t> pushed{0};
+        std::atomic<std::size_t> high_water{0};
+        std::atomic<std::size_t> dropped{0};
+        alignas(cache_line_size) std::atomic<std::size_t> popped{0};
+    };
+
+    static void store_relaxed(std::atomic<std::size_t>& a, std::size_t value) {
+        a.store(value, std::memory_order_relaxed);
+    }
+
+    static auto round_up(std::size_t capacity) -> std::size_t {
+        auto result = std::size_t(1);
+
+        while (result < capacity) {
+            result *= 2;
+        }
+
+        return result;
+    }
+
+    producer_state producer;
+    consumer_state consumer;
+    counter_state counters;
+};
+
+} // namespace _detail
+
+} // namespace trellis
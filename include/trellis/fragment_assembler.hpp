@@ -1,7 +1,10 @@
 #pragma once
 
 #include "config.hpp"
+#include "datagram.hpp"
 #include "message_header.hpp"
+#include "message_pool.hpp"
+#include "raw_buffer.hpp"
 
 #include <cassert>
 #include <cstdint>
@@ -12,76 +15,155 @@
 
 namespace trellis::_detail {
 
+/**
+ * Reassembles the fragments of a single message.
+ * Single-fragment messages are not copied, the assembler just keeps a reference to the received datagram.
+ * Multi-fragment messages are copied into a buffer from the context's message_pool.
+ * Every fragment but the last has the same size, which depends on the sender's datagram size, so it is learned from the first one to arrive.
+ * A last fragment arriving before any other is held on to until then.
+ */
 class fragment_assembler {
 public:
-    static constexpr std::size_t fragment_size = config::datagram_size - headers::data_offset;
-
     fragment_assembler() :
         sequence_id{std::nullopt},
         buffer{},
+        single{},
+        single_size{0},
+        fragment_size{0},
+        max_fragment_size{0},
         buffer_fragments{0},
-        buffer_capacity{0},
-        complete{} {}
-
-    fragment_assembler(config::sequence_id_t sid, config::fragment_id_t num_fragments) :
-        sequence_id(sid),
-        buffer(std::make_unique<char[]>(num_fragments * fragment_size)),
-        buffer_fragments(num_fragments),
-        buffer_capacity(num_fragments * fragment_size),
-        complete{} {
-            assert(sequence_id);
-            assert(buffer);
-            assert(complete.count() == 0);
-        }
+        complete{},
+        cancelled{false} {}
 
     auto get_sequence_id() const -> const std::optional<config::sequence_id_t>& {
         return sequence_id;
     }
 
-    void reset(config::sequence_id_t sid, config::fragment_id_t num_fragments) {
-        assert(num_fragments >= 2);
-
-        auto required_size = num_fragments * fragment_size;
-
-        if (required_size > buffer_capacity || buffer_capacity > required_size * 2) {
-            buffer = std::make_unique<char[]>(required_size);
-            buffer_capacity = required_size;
+    /**
+     * Prepares the assembler for a new message whose fragments carry at most max_fragment_size bytes each.
+     * Returns false if the pool's memory cap prevents allocating a buffer, in which case the assembler is left empty.
+     */
+    auto reset(message_pool& pool, config::sequence_id_t sid, config::fragment_id_t num_fragments, std::size_t max_fragment_size) -> bool {
+        assert(num_fragments >= 1);
+
+        auto required_size = num_fragments * max_fragment_size;
+
+        if (num_fragments > 1 && (required_size > buffer.capacity() || buffer.capacity() > required_size * 2)) {
+            // Return the old buffer first so it counts against the cap as little as possible.
+            buffer.reset();
+            buffer = pool.allocate(required_size);
+
+            if (!buffer) {
+                sequence_id = std::nullopt;
+                single = {};
+                buffer_fragments = 0;
+                complete = {};
+                cancelled = false;
+                return false;
+            }
         }
 
         sequence_id = sid;
+        single = {};
+        single_size = 0;
+        fragment_size = 0;
+        this->max_fragment_size = max_fragment_size;
         buffer_fragments = num_fragments;
         complete = {};
+        cancelled = false;
 
         assert(sequence_id);
-        assert(buffer);
-        assert(buffer_fragments * fragment_size == required_size);
-        assert(buffer_fragments * fragment_size <= buffer_capacity);
+        assert(num_fragments == 1 || buffer);
+        assert(num_fragments == 1 || buffer_fragments * max_fragment_size <= buffer.capacity());
         assert(complete.count() == 0);
+
+        return true;
     }
 
-    void receive(const headers::data& header, const char* b, const char* e) {
-        assert(b);
-        assert(e);
-        assert(b < e);
-        assert(std::size_t(e - b) <= fragment_size);
-        assert(buffer);
+    /** Empties the assembler and returns its buffer to the pool. */
+    void clear() {
+        sequence_id = std::nullopt;
+        buffer.reset();
+        single = {};
+        single_size = 0;
+        fragment_size = 0;
+        max_fragment_size = 0;
+        buffer_fragments = 0;
+        complete = {};
+        cancelled = false;
+    }
+
+    /**
+     * Receives a DATA datagram of count bytes. The payload begins at headers::data_offset.
+     * Returns false if the fragment doesn't fit the others, in which case it is dropped.
+     */
+    auto receive(const headers::data& header, const shared_datagram_buffer& datagram, std::size_t count) -> bool {
+        assert(count > headers::data_offset);
         assert(header.fragment_count == buffer_fragments);
         assert(header.fragment_id < buffer_fragments);
         assert(!complete.test(header.fragment_id));
-        assert(fragment_size * header.fragment_id + (e - b) < buffer_capacity);
+        assert(!cancelled);
+
+        auto payload_size = count - headers::data_offset;
+
+        if (payload_size > max_fragment_size) {
+            return false;
+        }
+
+        if (buffer_fragments == 1) {
+            single = datagram;
+            single_size = payload_size;
+            complete.set(header.fragment_id);
+            return true;
+        }
+
+        assert(buffer);
+
+        auto last_id = config::fragment_id_t(buffer_fragments - 1);
+
+        if (header.fragment_id == last_id) {
+            if (fragment_size == 0) {
+                single = datagram;
+                single_size = payload_size;
+            } else if (payload_size > fragment_size) {
+                return false;
+            } else {
+                copy_fragment(last_id, datagram, payload_size);
+                single_size = payload_size;
+            }
+        } else {
+            if (fragment_size == 0) {
+                fragment_size = payload_size;
+
+                // The held last fragment can be placed now that we know where it goes.
+                if (single) {
+                    if (single_size <= fragment_size) {
+                        copy_fragment(last_id, single, single_size);
+                    } else {
+                        complete.reset(last_id);
+                    }
+
+                    single = {};
+                }
+            } else if (payload_size != fragment_size) {
+                return false;
+            }
+
+            copy_fragment(header.fragment_id, datagram, payload_size);
+        }
 
-        std::copy(b, e, buffer.get() + fragment_size * header.fragment_id);
         complete.set(header.fragment_id);
-    }
 
-    char* data() {
-        assert(is_complete());
+        return true;
+    }
 
-        return buffer.get();
+    auto get_fragment_count() const -> config::fragment_id_t {
+        return buffer_fragments;
     }
 
+    /** Gets the size of the message. Only meaningful once it is complete, since the last fragment may be shorter than the others. */
     std::size_t size() const {
-        return buffer_fragments * fragment_size;
+        return buffer_fragments == 1 ? single_size : (buffer_fragments - 1) * fragment_size + single_size;
     }
 
     bool is_complete() const {
@@ -96,24 +178,49 @@ public:
 
     void cancel() {
         buffer.reset();
-        buffer_capacity = 0;
+        single = {};
+        cancelled = true;
     }
 
-    auto release() -> std::unique_ptr<char[]> {
-        buffer_capacity = 0;
-        return std::move(buffer);
+    /** Hands the completed message over to the caller. The assembler is left cancelled. */
+    auto release() -> raw_buffer {
+        assert(is_complete());
+        assert(!cancelled);
+
+        auto len = size();
+
+        cancelled = true;
+
+        if (buffer_fragments == 1) {
+            return raw_buffer{std::move(single), headers::data_offset, len};
+        } else {
+            return raw_buffer{std::move(buffer), len};
+        }
     }
 
     bool is_cancelled() const {
-        return sequence_id && !buffer;
+        return sequence_id && cancelled;
     }
 
 private:
+    void copy_fragment(config::fragment_id_t id, const shared_datagram_buffer& datagram, std::size_t payload_size) {
+        assert(fragment_size * id + payload_size <= buffer.capacity());
+
+        auto b = datagram.data() + headers::data_offset;
+        auto e = b + payload_size;
+
+        std::copy(b, e, buffer.get() + fragment_size * id);
+    }
+
     std::optional<config::sequence_id_t> sequence_id;
-    std::unique_ptr<char[]> buffer;
+    pooled_buffer buffer;
+    shared_datagram_buffer single;
+    std::size_t single_size;
+    std::size_t fragment_size;
+    std::size_t max_fragment_size;
     config::fragment_id_t buffer_fragments;
-    std::size_t buffer_capacity;
     std::bitset<config::max_fragments> complete;
+    bool cancelled;
 };
 
 } // namespace trellis::_detail
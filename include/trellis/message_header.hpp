@@ -14,13 +14,20 @@ enum type : std::uint8_t {
     DISCONNECT,
     DATA,
     DATA_ACK,
+    AGGREGATE,
+    PROBE,
+    PROBE_ACK,
 };
 
+/** datagram_size is the largest datagram the client is willing to send and receive. */
 struct connect {
+    std::uint16_t datagram_size;
 };
 
+/** datagram_size is the largest datagram both sides are willing to use, the smaller of the client's and the server's. */
 struct connect_ok {
     std::uint16_t connection_id;
+    std::uint16_t datagram_size;
 };
 
 struct connect_ack {
@@ -30,18 +37,52 @@ struct connect_ack {
 struct disconnect {
 };
 
+/** Bits for data::flags. */
+enum data_flags : std::uint8_t {
+    /** The payload is followed by DATA_ACK blocks and a data_ack_footer, which end the datagram. */
+    HAS_ACKS = 1 << 0,
+};
+
 struct data {
     config::sequence_id_t sequence_id;
     std::uint8_t channel_id;
     config::fragment_id_t fragment_count;
     config::fragment_id_t fragment_id;
+    std::uint8_t flags;
 };
 
+/** One channel's block in a DATA_ACK datagram. Followed by range_count data_ack_ranges. A datagram may hold several blocks. */
 struct data_ack {
-    config::sequence_id_t sequence_id;
     config::sequence_id_t expected_sequence_id;
     std::uint8_t channel_id;
-    config::fragment_id_t fragment_id;
+    std::uint8_t range_count;
+};
+
+/** Acknowledges the fragments of one message from first_fragment onwards. Bit i of fragments is fragment first_fragment + i. */
+struct data_ack_range {
+    std::uint64_t fragments;
+    config::sequence_id_t sequence_id;
+    config::fragment_id_t first_fragment;
+};
+
+/** Ends a DATA datagram with piggybacked acks. size is the number of bytes of DATA_ACK blocks before it. */
+struct data_ack_footer {
+    std::uint16_t size;
+};
+
+/** Precedes each datagram packed into an AGGREGATE datagram. The packed datagram starts with its own type, which must be DATA or DATA_ACK. */
+struct aggregate_entry {
+    std::uint16_t size;
+};
+
+/** Asks the peer whether a datagram of size bytes gets through. The datagram is padded with zeroes to that size. */
+struct probe {
+    std::uint16_t size;
+};
+
+/** Answers a PROBE of size bytes. */
+struct probe_ack {
+    std::uint16_t size;
 };
 
 constexpr std::size_t data_offset = sizeof(type) + sizeof(data);
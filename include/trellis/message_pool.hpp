@@ -0,0 +1,257 @@
+#pragma once
+
+#include "config.hpp"
+#include "message_header.hpp"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace trellis::_detail {
+
+class message_pool;
+
+/** Simple stats about a message_pool. */
+struct message_pool_stats {
+    std::size_t bytes_in_use; /** Bytes currently held by assemblers and undelivered messages. */
+    std::size_t bytes_high_water; /** The largest bytes_in_use has ever been. */
+    std::size_t bytes_cached; /** Bytes sitting in the pool's free lists. */
+    std::uint64_t allocations; /** Blocks that had to be taken from the global allocator. */
+    std::uint64_t reuses; /** Blocks that were served from the free lists. */
+    std::uint64_t rejections; /** Allocations refused because of the memory cap. */
+};
+
+/** A block of memory owned by a message_pool. Returns itself to the pool when destroyed. */
+class pooled_buffer {
+public:
+    pooled_buffer() :
+        pool(nullptr),
+        ptr(nullptr),
+        size_class(0) {}
+
+    pooled_buffer(pooled_buffer&& other) :
+        pool(std::exchange(other.pool, nullptr)),
+        ptr(std::exchange(other.ptr, nullptr)),
+        size_class(other.size_class) {}
+
+    pooled_buffer& operator=(pooled_buffer&& other) {
+        std::swap(pool, other.pool);
+        std::swap(ptr, other.ptr);
+        std::swap(size_class, other.size_class);
+        return *this;
+    }
+
+    pooled_buffer(const pooled_buffer&) = delete;
+    pooled_buffer& operator=(const pooled_buffer&) = delete;
+
+    ~pooled_buffer();
+
+    explicit operator bool() const {
+        return ptr != nullptr;
+    }
+
+    auto get() const -> char* {
+        return ptr;
+    }
+
+    auto capacity() const -> std::size_t;
+
+    /** Returns the block to the pool. */
+    void reset() {
+        pooled_buffer{}.swap(*this);
+    }
+
+    void swap(pooled_buffer& other) {
+        std::swap(pool, other.pool);
+        std::swap(ptr, other.ptr);
+        std::swap(size_class, other.size_class);
+    }
+
+private:
+    friend message_pool;
+
+    pooled_buffer(message_pool* pool, char* ptr, std::size_t size_class) :
+        pool(pool),
+        ptr(ptr),
+        size_class(size_class) {}
+
+    message_pool* pool;
+    char* ptr;
+    std::size_t size_class;
+};
+
+/**
+ * A size-class pool for message reassembly buffers.
+ * Blocks are allocated on the networking thread and usually freed on the user thread after poll_events, so the free lists are guarded by a mutex.
+ * The memory cap limits the bytes in use. Allocations that would exceed it fail, and the caller is expected to drop the data.
+ */
+class message_pool {
+public:
+    static constexpr std::size_t min_block_size = 2048;
+    static constexpr std::size_t max_message_size = config::max_fragments * (config::max_datagram_size - headers::data_offset);
+
+    static constexpr auto class_count = []{
+        auto count = std::size_t(1);
+        for (auto size = min_block_size; size < max_message_size; size *= 2) {
+            ++count;
+        }
+        return count;
+    }();
+
+    message_pool() :
+        mutex(),
+        free_lists(),
+        memory_cap(std::numeric_limits<std::size_t>::max()),
+        bytes_in_use(0),
+        bytes_high_water(0),
+        bytes_cached(0),
+        allocations(0),
+        reuses(0),
+        rejections(0) {}
+
+    message_pool(const message_pool&) = delete;
+    message_pool& operator=(const message_pool&) = delete;
+
+    /** Frees the cached blocks. Blocks still in use must not outlive the pool. */
+    ~message_pool() {
+        for (auto& list : free_lists) {
+            for (auto ptr : list) {
+                delete[] ptr;
+            }
+        }
+    }
+
+    static constexpr auto block_size(std::size_t size_class) -> std::size_t {
+        return min_block_size << size_class;
+    }
+
+    /** Gets a block of at least size bytes. Returns an empty buffer if the memory cap would be exceeded. */
+    auto allocate(std::size_t size) -> pooled_buffer {
+        assert(size <= block_size(class_count - 1));
+
+        auto size_class = std::size_t(0);
+
+        while (block_size(size_class) < size) {
+            ++size_class;
+        }
+
+        auto bytes = block_size(size_class);
+
+        auto lock = std::lock_guard(mutex);
+
+        if (bytes_in_use + bytes > memory_cap.load(std::memory_order_relaxed)) {
+            ++rejections;
+            return {};
+        }
+
+        auto& list = free_lists[size_class];
+        auto ptr = static_cast<char*>(nullptr);
+
+        if (!list.empty()) {
+            ptr = list.back();
+            list.pop_back();
+            bytes_cached -= bytes;
+            ++reuses;
+        } else {
+            ptr = new char[bytes];
+            ++allocations;
+        }
+
+        bytes_in_use += bytes;
+        bytes_high_water = std::max(bytes_high_water, bytes_in_use);
+
+        return {this, ptr, size_class};
+    }
+
+    /** Sets the maximum number of bytes that can be in use at once. Also trims cached blocks down to the cap. */
+    void set_memory_cap(std::size_t bytes) {
+        memory_cap.store(bytes, std::memory_order_relaxed);
+
+        auto lock = std::lock_guard(mutex);
+        trim();
+    }
+
+    auto get_memory_cap() const -> std::size_t {
+        return memory_cap.load(std::memory_order_relaxed);
+    }
+
+    auto get_stats() const -> message_pool_stats {
+        auto lock = std::lock_guard(mutex);
+
+        return {
+            bytes_in_use,
+            bytes_high_water,
+            bytes_cached,
+            allocations,
+            reuses,
+            rejections,
+        };
+    }
+
+private:
+    friend pooled_buffer;
+
+    void deallocate(char* ptr, std::size_t size_class) {
+        assert(ptr);
+        assert(size_class < class_count);
+
+        auto bytes = block_size(size_class);
+
+        auto lock = std::lock_guard(mutex);
+
+        assert(bytes_in_use >= bytes);
+
+        bytes_in_use -= bytes;
+
+        if (bytes_in_use + bytes_cached + bytes > memory_cap.load(std::memory_order_relaxed)) {
+            delete[] ptr;
+            return;
+        }
+
+        free_lists[size_class].push_back(ptr);
+        bytes_cached += bytes;
+    }
+
+    /** Frees cached blocks, largest first, until in-use plus cached bytes fit within the cap. Mutex must be held. */
+    void trim() {
+        auto cap = memory_cap.load(std::memory_order_relaxed);
+
+        for (auto size_class = class_count; size_class-- > 0 && bytes_in_use + bytes_cached > cap;) {
+            auto& list = free_lists[size_class];
+
+            while (!list.empty() && bytes_in_use + bytes_cached > cap) {
+                delete[] list.back();
+                list.pop_back();
+                bytes_cached -= block_size(size_class);
+            }
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::array<std::vector<char*>, class_count> free_lists;
+    std::atomic<std::size_t> memory_cap;
+    std::size_t bytes_in_use;
+    std::size_t bytes_high_water;
+    std::size_t bytes_cached;
+    std::uint64_t allocations;
+    std::uint64_t reuses;
+    std::uint64_t rejections;
+};
+
+inline pooled_buffer::~pooled_buffer() {
+    if (ptr) {
+        pool->deallocate(ptr, size_class);
+    }
+}
+
+inline auto pooled_buffer::capacity() const -> std::size_t {
+    return ptr ? message_pool::block_size(size_class) : 0;
+}
+
+} // namespace trellis::_detail
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "config.hpp"
+#include "datagram.hpp"
+#include "message_header.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace trellis::_detail {
+
+/**
+ * Collects the fragments a connection has received on its reliable channels, so they can be acknowledged together.
+ * Each channel gets a DATA_ACK block with its expected sequence ID, followed by ranges of fragment bits.
+ * A range covers 64 consecutive fragments of one message, so even a fully fragmented message only needs a few ranges.
+ */
+class pending_acks {
+public:
+    static constexpr std::size_t fragments_per_range = 64;
+
+    pending_acks() :
+        channels() {}
+
+    auto empty() const -> bool {
+        return std::none_of(channels.begin(), channels.end(), [](const channel_acks& c) { return c.active; });
+    }
+
+    /** Records a received fragment, along with the next sequence ID the channel expects. */
+    void add(std::uint8_t channel_id, config::sequence_id_t expected_sequence_id, config::sequence_id_t sequence_id, config::fragment_id_t fragment_id) {
+        auto& acks = get_channel(channel_id);
+
+        if (!acks.active || sequence_id_less(acks.expected_sequence_id, expected_sequence_id)) {
+            acks.expected_sequence_id = expected_sequence_id;
+        }
+
+        acks.active = true;
+
+        // Anything before the expected sequence ID is covered by the block header.
+        if (sequence_id_less(sequence_id, acks.expected_sequence_id)) {
+            return;
+        }
+
+        auto first_fragment = config::fragment_id_t(fragment_id - fragment_id % fragments_per_range);
+        auto bit = std::uint64_t(1) << (fragment_id - first_fragment);
+
+        // Fragments tend to arrive in order, so the matching range is usually the last one.
+        for (auto iter = acks.ranges.rbegin(); iter != acks.ranges.rend(); ++iter) {
+            if (iter->sequence_id == sequence_id && iter->first_fragment == first_fragment) {
+                iter->fragments |= bit;
+                return;
+            }
+        }
+
+        auto range = headers::data_ack_range{};
+        range.fragments = bit;
+        range.sequence_id = sequence_id;
+        range.first_fragment = first_fragment;
+
+        acks.ranges.push_back(range);
+    }
+
+    void clear() {
+        for (auto& acks : channels) {
+            acks.active = false;
+            acks.ranges.clear();
+        }
+    }
+
+    /** Gets the number of bytes write() needs for every pending ack. */
+    auto encoded_size() const -> std::size_t {
+        auto size = std::size_t(0);
+
+        for (auto& acks : channels) {
+            if (!acks.active) continue;
+
+            auto blocks = std::max<std::size_t>(1, (acks.ranges.size() + max_ranges_per_block - 1) / max_ranges_per_block);
+
+            size += blocks * block_size + acks.ranges.size() * range_size;
+        }
+
+        return size;
+    }
+
+    /** Writes every pending ack as DATA_ACK blocks, without the type byte, and clears them. out must have room for encoded_size() bytes. */
+    void write(char* out) {
+        for (auto& acks : channels) {
+            if (!acks.active) continue;
+
+            auto next = std::size_t(0);
+
+            do {
+                auto count = std::min(acks.ranges.size() - next, max_ranges_per_block);
+
+                out += write_block(out, acks, next, count);
+                next += count;
+            } while (next < acks.ranges.size());
+
+            acks.active = false;
+            acks.ranges.clear();
+        }
+    }
+
+    /**
+     * Packs every pending ack into as few DATA_ACK datagrams as possible and clears them.
+     * make_buffer() must return a fresh shared_datagram_buffer, and emit(buffer, size) is called for each finished datagram.
+     */
+    template <typename MakeBuffer, typename Emit>
+    void flush(MakeBuffer&& make_buffer, Emit&& emit) {
+        constexpr auto type = headers::type::DATA_ACK;
+
+        auto buffer = shared_datagram_buffer{};
+        auto size = std::size_t(0);
+
+        auto finish = [&] {
+            if (size > sizeof(type)) {
+                emit(buffer, size);
+            }
+
+            buffer = make_buffer();
+            std::memcpy(buffer.data(), &type, sizeof(type));
+            size = sizeof(type);
+        };
+
+        for (auto& acks : channels) {
+            if (!acks.active) continue;
+
+            auto next = std::size_t(0);
+
+            do {
+                if (!buffer || size + block_size + (next < acks.ranges.size() ? range_size : 0) > config::datagram_size) {
+                    finish();
+                }
+
+                auto count = std::min({
+                    acks.ranges.size() - next,
+                    (config::datagram_size - size - block_size) / range_size,
+                    max_ranges_per_block,
+                });
+
+                size += write_block(buffer.data() + size, acks, next, count);
+                next += count;
+            } while (next < acks.ranges.size());
+
+            acks.active = false;
+            acks.ranges.clear();
+        }
+
+        if (size > sizeof(type)) {
+            emit(buffer, size);
+        }
+    }
+
+private:
+    static constexpr auto block_size = sizeof(headers::data_ack);
+    static constexpr auto range_size = sizeof(headers::data_ack_range);
+    static constexpr auto max_ranges_per_block = std::size_t(std::numeric_limits<std::uint8_t>::max());
+
+    struct channel_acks {
+        std::uint8_t channel_id;
+        bool active;
+        config::sequence_id_t expected_sequence_id;
+        std::vector<headers::data_ack_range> ranges;
+    };
+
+    /** Writes one block holding count ranges, starting from ranges[first]. Returns the number of bytes written. */
+    static auto write_block(char* out, const channel_acks& acks, std::size_t first, std::size_t count) -> std::size_t {
+        assert(count <= max_ranges_per_block);
+
+        auto header = headers::data_ack{};
+        header.expected_sequence_id = acks.expected_sequence_id;
+        header.channel_id = acks.channel_id;
+        header.range_count = std::uint8_t(count);
+
+        std::memcpy(out, &header, block_size);
+        std::memcpy(out + block_size, acks.ranges.data() + first, count * range_size);
+
+        return block_size + count * range_size;
+    }
+
+    auto get_channel(std::uint8_t channel_id) -> channel_acks& {
+        for (auto& acks : channels) {
+            if (acks.channel_id == channel_id) {
+                return acks;
+            }
+        }
+
+        return channels.emplace_back(channel_acks{channel_id, false, 0, {}});
+    }
+
+    std::vector<channel_acks> channels;
+};
+
+} // namespace trellis::_detail
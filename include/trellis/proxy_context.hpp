@@ -6,6 +6,7 @@
 
 #include <asio.hpp>
 
+#include <chrono>
 #include <cstring>
 #include <cassert>
 #include <iostream>
@@ -36,6 +37,7 @@ public:
         rng(std::random_device{}()),
         client_drop_rate(0),
         server_drop_rate(0),
+        delay(0),
         stats{} {}
 
     void listen(const protocol::endpoint& proxy_endpoint, const protocol::endpoint& remote_endpoint) {
@@ -69,6 +71,11 @@ public:
         server_drop_rate = chance;
     }
 
+    /** Holds every forwarded datagram for the given time, in both directions, so the round trip takes at least twice as long. */
+    void set_delay(std::chrono::steady_clock::duration delay) {
+        this->delay = delay;
+    }
+
     auto get_stats() const -> const proxy_stats& {
         return stats;
     }
@@ -139,12 +146,19 @@ private:
 
                 std::memcpy(buffer.data(), proxy_buffer.data.data(), size);
 
-                iter->second.socket.async_send_to(buffer.buffer(size), remote_endpoint, [this, buffer, sz = size](asio::error_code ec, std::size_t size) {
-                    if (ec && ec.value() != asio::error::operation_aborted) {
-                        std::cerr << "[trellis] PROXY ERROR while sending packet to " << remote_endpoint << ": " << ec.category().name() << ": " << ec.message() << std::endl;
-                    } else if (!ec) {
-                        assert(size == sz);
-                    }
+                after_delay([this, buffer, size, client_endpoint = iter->second.client_endpoint] {
+                    // The client may have been disconnected while the datagram was held.
+                    auto iter = connections.find(client_endpoint);
+
+                    if (iter == connections.end()) return;
+
+                    iter->second.socket.async_send_to(buffer.buffer(size), remote_endpoint, [this, buffer, sz = size](asio::error_code ec, std::size_t size) {
+                        if (ec && ec.value() != asio::error::operation_aborted) {
+                            std::cerr << "[trellis] PROXY ERROR while sending packet to " << remote_endpoint << ": " << ec.category().name() << ": " << ec.message() << std::endl;
+                        } else if (!ec) {
+                            assert(size == sz);
+                        }
+                    });
                 });
             }
 
@@ -183,12 +197,14 @@ private:
 
                 std::memcpy(buffer.data(), conn.buffer.data(), size);
 
-                proxy_socket.async_send_to(buffer.buffer(size), conn.client_endpoint, [this, &conn, buffer, sz = size](asio::error_code ec, std::size_t size) {
-                    if (ec && ec.value() != asio::error::operation_aborted) {
-                        std::cerr << "[trellis] PROXY ERROR while sending packet to " << conn.client_endpoint << ": " << ec.category().name() << ": " << ec.message() << std::endl;
-                    } else if (!ec) {
-                        assert(size == sz);
-                    }
+                after_delay([this, buffer, size, client_endpoint = conn.client_endpoint] {
+                    proxy_socket.async_send_to(buffer.buffer(size), client_endpoint, [this, client_endpoint, buffer, sz = size](asio::error_code ec, std::size_t size) {
+                        if (ec && ec.value() != asio::error::operation_aborted) {
+                            std::cerr << "[trellis] PROXY ERROR while sending packet to " << client_endpoint << ": " << ec.category().name() << ": " << ec.message() << std::endl;
+                        } else if (!ec) {
+                            assert(size == sz);
+                        }
+                    });
                 });
             }
 
@@ -196,6 +212,23 @@ private:
         });
     }
 
+    /** Calls f once the delay has passed, or right away if there is none. Nothing is called once the proxy stops. */
+    template <typename F>
+    void after_delay(F f) {
+        if (delay == delay.zero()) {
+            f();
+            return;
+        }
+
+        auto timer = std::make_shared<asio::steady_timer>(*io, delay);
+
+        timer->async_wait([this, timer, f = std::move(f)](asio::error_code ec) {
+            if (ec || !running) return;
+
+            f();
+        });
+    }
+
     asio::io_context* io;
     protocol::socket proxy_socket;
     protocol::endpoint remote_endpoint;
@@ -207,6 +240,7 @@ private:
     std::mt19937 rng;
     double client_drop_rate;
     double server_drop_rate;
+    std::chrono::steady_clock::duration delay;
     proxy_stats stats;
 };
 
@@ -1,12 +1,51 @@
 #pragma once
 
+#include "datagram.hpp"
+#include "message_pool.hpp"
+
+#include <cassert>
 #include <cstdint>
 #include <memory>
+#include <utility>
 
 namespace trellis::_detail {
 
-struct raw_buffer {
-    std::unique_ptr<char[]> data;
+/**
+ * A received message payload.
+ * Either owns a reassembled buffer from the message pool, or shares a slice of a received datagram without copying it.
+ */
+class raw_buffer {
+public:
+    raw_buffer(pooled_buffer data, std::size_t size) :
+        owned(std::move(data)),
+        datagram(),
+        offset(0),
+        data_len(size) {
+            assert(owned);
+            assert(size <= owned.capacity());
+        }
+
+    raw_buffer(shared_datagram_buffer datagram, std::size_t offset, std::size_t size) :
+        owned(),
+        datagram(std::move(datagram)),
+        offset(offset),
+        data_len(size) {
+            assert(this->datagram);
+            assert(offset + size <= this->datagram.size());
+        }
+
+    auto data() const -> const char* {
+        return datagram ? datagram.data() + offset : owned.get();
+    }
+
+    auto size() const -> std::size_t {
+        return data_len;
+    }
+
+private:
+    pooled_buffer owned;
+    shared_datagram_buffer datagram;
+    std::size_t offset;
     std::size_t data_len;
 };
 
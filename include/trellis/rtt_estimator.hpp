@@ -0,0 +1,98 @@
+#pragma once
+
+#include "config.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace trellis::_detail {
+
+/**
+ * Estimates a connection's round trip time and retransmission timeout, in the style of Jacobson and Karels.
+ * Only samples from packets that were never resent should be fed in (Karn's algorithm), since an ack for a resent packet can't be matched to a send.
+ * Written from the networking thread, but the values can be read from any thread for stats.
+ */
+class rtt_estimator {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+
+    rtt_estimator() :
+        smoothed_rtt(0),
+        rtt_variance(0),
+        rto(clamp(config::initial_rto).count()),
+        samples(0) {}
+
+    rtt_estimator(const rtt_estimator&) = delete;
+    rtt_estimator& operator=(const rtt_estimator&) = delete;
+
+    /** Feeds in one round trip measurement. */
+    void sample(duration rtt) {
+        rtt = std::max(rtt, duration(0));
+
+        auto srtt = duration(smoothed_rtt.load(std::memory_order_relaxed));
+        auto rttvar = duration(rtt_variance.load(std::memory_order_relaxed));
+
+        if (samples.load(std::memory_order_relaxed) == 0) {
+            srtt = rtt;
+            rttvar = rtt / 2;
+        } else {
+            auto error = srtt > rtt ? srtt - rtt : rtt - srtt;
+            rttvar = (rttvar * 3 + error) / 4;
+            srtt = (srtt * 7 + rtt) / 8;
+        }
+
+        // The variance term never drops below the timer granularity, or a perfectly steady link would resend on the slightest jitter.
+        auto timeout = srtt + std::max(duration(config::timer_wheel_tick), rttvar * 4);
+
+        smoothed_rtt.store(srtt.count(), std::memory_order_relaxed);
+        rtt_variance.store(rttvar.count(), std::memory_order_relaxed);
+        rto.store(clamp(timeout).count(), std::memory_order_relaxed);
+        samples.store(samples.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Gets the retransmission timeout for a packet that has already been resent the given number of times.
+     * Doubles with each attempt until it reaches config::max_rto, so a peer that has gone quiet isn't flooded with resends.
+     */
+    auto get_timeout(int attempts) const -> duration {
+        auto timeout = get_rto();
+
+        for (auto i = 0; i < attempts && timeout < config::max_rto; ++i) {
+            timeout *= 2;
+        }
+
+        return clamp(timeout);
+    }
+
+    auto get_rto() const -> duration {
+        return duration(rto.load(std::memory_order_relaxed));
+    }
+
+    /** Gets the smoothed round trip time. Zero until the first sample. */
+    auto get_smoothed_rtt() const -> duration {
+        return duration(smoothed_rtt.load(std::memory_order_relaxed));
+    }
+
+    auto get_rtt_variance() const -> duration {
+        return duration(rtt_variance.load(std::memory_order_relaxed));
+    }
+
+    auto get_sample_count() const -> std::uint64_t {
+        return samples.load(std::memory_order_relaxed);
+    }
+
+private:
+    static auto clamp(duration d) -> duration {
+        return std::clamp<duration>(d, config::min_rto, config::max_rto);
+    }
+
+    std::atomic<duration::rep> smoothed_rtt;
+    std::atomic<duration::rep> rtt_variance;
+    std::atomic<duration::rep> rto;
+    std::atomic<std::uint64_t> samples;
+};
+
+} // namespace trellis::_detail
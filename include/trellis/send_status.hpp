@@ -0,0 +1,17 @@
+#pragma once
+
+namespace trellis {
+
+/** Result of connection::try_send. */
+enum class send_status {
+    /** The message was accepted and will be sent. */
+    queued,
+    /** The channel's send window is full, so the message was not sent. The handler's on_writable will be called once there is room. */
+    window_full,
+    /** The connection is closed, so the message was not sent. */
+    connection_closed,
+    /** The message is empty or needs more than connection::max_message_fragments fragments, so it was not sent. */
+    invalid_size,
+};
+
+} // namespace trellis
@@ -0,0 +1,354 @@
+#pragma once
+
+#include "config.hpp"
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace trellis::_detail {
+
+/**
+ * Holds the unacknowledged fragments of a reliable channel, indexed by (sequence_id, fragment_id).
+ * Messages live in a ring of slots starting at the oldest unacknowledged sequence ID, and each fragment is its own node in the context's timer_wheel.
+ * Acking a fragment or a run of messages costs only as much as what it acknowledges, no matter how much is in flight.
+ * Each fragment is retried after timeout(attempts), where attempts is how many times it has already been retried.
+ * Pending fragments are also kept in the order they were last sent, so resend_lost can find the ones that acks have skipped over.
+ * Must only be used from the context's executor.
+ */
+template <typename Value>
+class send_window {
+public:
+    using value_type = Value;
+    using clock = timer_wheel::clock_type;
+    using duration = timer_wheel::duration;
+    using callback_type = std::function<void(value_type&)>;
+    using timeout_type = std::function<duration(int attempts)>;
+
+    send_window(callback_type cb, timeout_type timeout, timer_wheel& wheel) :
+        wheel(&wheel),
+        slots(),
+        base_sequence_id(0),
+        end_sequence_id(0),
+        count(0),
+        sent(),
+        next_order(0),
+        highest_acked(0),
+        timeout(std::move(timeout)),
+        callback(std::move(cb)) {}
+
+    send_window(const send_window&) = delete;
+    send_window& operator=(const send_window&) = delete;
+
+    ~send_window() {
+        clear();
+    }
+
+    /**
+     * Extends the window to cover the given message, so its fragments can be pushed. Messages must be opened in order,
+     * which reliable channels guarantee by numbering messages on the networking thread as they are sent.
+     * Opening a message that is already in the window does nothing, and so does opening one older than the window, whose fragments push then drops.
+     */
+    void open(config::sequence_id_t sequence_id) {
+        if (base_sequence_id == end_sequence_id) {
+            // Nothing is in flight, so the window can start anywhere.
+            base_sequence_id = sequence_id;
+            end_sequence_id = sequence_id;
+        }
+
+        // Growing the ring to reach a message behind the base would wrap around and ask for billions of slots.
+        if (sequence_id_less(sequence_id, base_sequence_id)) {
+            return;
+        }
+
+        reserve(sequence_id);
+    }
+
+    /** Determines whether the message has been opened and not yet acknowledged as a whole. */
+    auto is_open(config::sequence_id_t sequence_id) const -> bool {
+        return !sequence_id_less(sequence_id, base_sequence_id) && sequence_id_less(sequence_id, end_sequence_id);
+    }
+
+    /** Gets the number of messages from the oldest one not acknowledged as a whole to the newest one opened. */
+    auto span() const -> std::size_t {
+        return std::size_t(config::sequence_id_t(end_sequence_id - base_sequence_id));
+    }
+
+    /**
+     * Adds a fragment of an open message and schedules its first retry. Fragments may be pushed in any order.
+     * Fragments of messages that aren't open, such as ones already acknowledged as a whole, are dropped. Returns true if the fragment was added.
+     */
+    auto push(config::sequence_id_t sequence_id, config::fragment_id_t fragment_id, config::fragment_id_t fragment_count, value_type value) -> bool {
+        assert(fragment_id < fragment_count);
+
+        if (!is_open(sequence_id)) {
+            return false;
+        }
+
+        auto& slot = get_slot(sequence_id);
+
+        if (slot.done) {
+            return false;
+        }
+
+        if (!slot.fragments) {
+            slot.fragments = std::make_unique<entry[]>(fragment_count);
+            slot.fragment_count = fragment_count;
+            slot.pushed = 0;
+            slot.remaining = 0;
+        }
+
+        assert(slot.fragment_count == fragment_count);
+        assert(!slot.fragments[fragment_id].pending);
+
+        auto& e = slot.fragments[fragment_id];
+        e.owner = this;
+        e.pending = true;
+        e.attempts = 0;
+        e.value = std::move(value);
+
+        mark_sent(e);
+
+        ++slot.pushed;
+        ++slot.remaining;
+        ++count;
+
+        wheel->schedule(e, clock::now() + timeout(0), &send_window::fire);
+
+        return true;
+    }
+
+    /** Removes a single fragment, calling visit on it first. Returns true if it was pending. */
+    template <typename F>
+    auto remove(config::sequence_id_t sequence_id, std::size_t fragment_id, const F& visit) -> bool {
+        if (sequence_id_less(sequence_id, base_sequence_id) || !sequence_id_less(sequence_id, end_sequence_id)) {
+            return false;
+        }
+
+        auto& slot = get_slot(sequence_id);
+
+        if (!slot.fragments || fragment_id >= slot.fragment_count || !slot.fragments[fragment_id].pending) {
+            return false;
+        }
+
+        auto& e = slot.fragments[fragment_id];
+
+        highest_acked = std::max(highest_acked, e.order);
+
+        visit(e.value);
+        release(e);
+
+        if (--slot.remaining == 0 && slot.pushed == slot.fragment_count) {
+            finish(slot);
+            advance_base();
+        }
+
+        return true;
+    }
+
+    /** Removes every fragment of every message before the given sequence ID. Returns the number of fragments removed. */
+    auto remove_before(config::sequence_id_t sequence_id) -> std::size_t {
+        auto removed = std::size_t(0);
+
+        while (base_sequence_id != end_sequence_id && sequence_id_less(base_sequence_id, sequence_id)) {
+            auto& slot = get_slot(base_sequence_id);
+
+            removed += slot.remaining;
+            finish(slot);
+            advance_base();
+        }
+
+        return removed;
+    }
+
+    /**
+     * Resends every pending fragment that was sent at least threshold fragments before the newest one acknowledged by remove,
+     * without waiting for its timeout. Returns the number of fragments resent.
+     */
+    auto resend_lost(std::size_t threshold) -> std::size_t {
+        auto resent = std::size_t(0);
+
+        while (sent.next != &sent) {
+            auto& e = static_cast<entry&>(*sent.next);
+
+            if (e.order + threshold > highest_acked) {
+                break;
+            }
+
+            wheel->cancel(e);
+
+            callback(e.value);
+
+            // Moving it to the back means it won't be resent again until something sent after this resend is acked.
+            mark_sent(e);
+
+            wheel->schedule(e, clock::now() + timeout(e.attempts), &send_window::fire);
+
+            ++resent;
+        }
+
+        return resent;
+    }
+
+    /** Removes everything. */
+    void clear() {
+        remove_before(end_sequence_id);
+    }
+
+    /** Gets the number of pending fragments. */
+    auto size() const -> std::size_t {
+        return count;
+    }
+
+private:
+    /** A link in the list of pending fragments, in the order they were last sent. */
+    struct order_node {
+        order_node* prev = this;
+        order_node* next = this;
+        std::uint64_t order = 0;
+
+        order_node() = default;
+        order_node(const order_node&) = delete;
+        order_node& operator=(const order_node&) = delete;
+
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = this;
+            next = this;
+        }
+
+        void link_before(order_node& other) {
+            prev = other.prev;
+            next = &other;
+            other.prev->next = this;
+            other.prev = this;
+        }
+    };
+
+    struct entry : timer_node, order_node {
+        send_window* owner = nullptr;
+        bool pending = false;
+        int attempts = 0;
+        value_type value = {};
+    };
+
+    struct message_slot {
+        std::unique_ptr<entry[]> fragments;
+        std::size_t fragment_count = 0;
+        std::size_t pushed = 0;
+        std::size_t remaining = 0;
+        bool done = false;
+    };
+
+    static void fire(timer_node& node) {
+        auto& e = static_cast<entry&>(node);
+        e.owner->retry(e);
+    }
+
+    void retry(entry& e) {
+        assert(e.pending);
+
+        callback(e.value);
+
+        ++e.attempts;
+
+        mark_sent(e);
+
+        wheel->schedule(e, clock::now() + timeout(e.attempts), &send_window::fire);
+    }
+
+    auto get_slot(config::sequence_id_t sequence_id) -> message_slot& {
+        return slots[sequence_id & (slots.size() - 1)];
+    }
+
+    /** Grows the ring until it covers sequence_id, and moves the end past it. sequence_id must not be behind the base. */
+    void reserve(config::sequence_id_t sequence_id) {
+        assert(!sequence_id_less(sequence_id, base_sequence_id));
+
+        auto needed = std::size_t(config::sequence_id_t(sequence_id - base_sequence_id)) + 1;
+
+        if (needed > slots.size()) {
+            auto capacity = std::max<std::size_t>(slots.size(), 16);
+
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+
+            auto grown = std::vector<message_slot>(capacity);
+
+            for (auto i = base_sequence_id; i != end_sequence_id; ++i) {
+                grown[i & (capacity - 1)] = std::move(get_slot(i));
+            }
+
+            slots = std::move(grown);
+        }
+
+        if (!sequence_id_less(sequence_id, end_sequence_id)) {
+            end_sequence_id = sequence_id + 1;
+        }
+    }
+
+    /** Moves the fragment to the back of the send order. */
+    void mark_sent(entry& e) {
+        e.order_node::unlink();
+        e.order = next_order++;
+        e.order_node::link_before(sent);
+    }
+
+    void release(entry& e) {
+        assert(e.pending);
+
+        wheel->cancel(e);
+        e.order_node::unlink();
+
+        e.pending = false;
+        e.value = {};
+
+        --count;
+    }
+
+    /** Drops whatever is left of a message and marks it done. */
+    void finish(message_slot& slot) {
+        if (slot.fragments) {
+            for (auto i = std::size_t(0); i < slot.fragment_count; ++i) {
+                if (slot.fragments[i].pending) {
+                    release(slot.fragments[i]);
+                }
+            }
+        }
+
+        slot.fragments.reset();
+        slot.fragment_count = 0;
+        slot.pushed = 0;
+        slot.remaining = 0;
+        slot.done = true;
+    }
+
+    /** Moves the base past messages that are done. Messages that haven't been pushed yet hold it back. */
+    void advance_base() {
+        while (base_sequence_id != end_sequence_id && get_slot(base_sequence_id).done) {
+            get_slot(base_sequence_id).done = false;
+            ++base_sequence_id;
+        }
+    }
+
+    timer_wheel* wheel;
+    std::vector<message_slot> slots;
+    config::sequence_id_t base_sequence_id;
+    config::sequence_id_t end_sequence_id;
+    std::size_t count;
+    order_node sent;
+    std::uint64_t next_order;
+    std::uint64_t highest_acked;
+    timeout_type timeout;
+    callback_type callback;
+};
+
+} // namespace trellis::_detail
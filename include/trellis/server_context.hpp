@@ -4,15 +4,21 @@
 #include "channel.hpp"
 #include "connection.hpp"
 #include "datagram.hpp"
+#include "endpoint_map.hpp"
 #include "message_header.hpp"
+#include "streams.hpp"
 
 #include <asio.hpp>
 
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 #include <iostream>
+#include <limits>
 #include <memory>
-#include <map>
+#include <span>
+#include <type_traits>
+#include <vector>
 
 namespace trellis {
 
@@ -30,7 +36,7 @@ public:
     using typename base_type::protocol;
     using typename base_type::traits;
 
-    using connection_map = std::map<typename protocol::endpoint, std::shared_ptr<connection_type>>;
+    using connection_map = _detail::endpoint_map<std::shared_ptr<connection_type>>;
 
     using base_type::get_context_id;
 
@@ -39,6 +45,12 @@ public:
         base_type(io),
         active_connections() {}
 
+    /** Constructs a context that calls the handler directly on the networking thread. See context_crtp for details. */
+    template <typename Handler>
+    server_context(asio::io_context& io, Handler& handler) :
+        base_type(io, handler),
+        active_connections() {}
+
     /** Opens the server socket to listen for incoming client connections. Both the server and the clients must have matching channel lists. */
     void listen(const typename protocol::endpoint& endpoint) {
         // must be executed from user thread
@@ -52,7 +64,89 @@ public:
         return this->get_socket().local_endpoint();
     }
 
+    /**
+     * Sends the same message to every connection in conns, a range of connection_ptrs.
+     * payload is anything connection::send accepts. A callback is only called once, with a std::ostream that collects the message,
+     * so it is serialized once no matter how many connections it goes to. The fragment bodies are also built once and shared,
+     * each connection only writing its own headers in front of them. Reliable channels resend those same bodies.
+     * Returns false if the message is empty or too large for any of the connections, in which case it is sent to none of them.
+     */
+    template <typename Channel, typename Range, typename F>
+    auto broadcast(const Range& conns, F&& payload) -> bool {
+        if constexpr (asio::is_const_buffer_sequence<std::decay_t<F>>::value) {
+            return broadcast_buffers<Channel>(conns, payload);
+        } else if constexpr (std::is_convertible_v<F, std::span<const std::byte>>) {
+            auto bytes = std::span<const std::byte>(payload);
+            return broadcast_buffers<Channel>(conns, asio::buffer(bytes.data(), bytes.size()));
+        } else {
+            auto limit = std::numeric_limits<std::size_t>::max();
+
+            for (const auto& conn : conns) {
+                limit = std::min(limit, conn->get_max_message_size());
+            }
+
+            auto bytes = std::vector<char>{};
+            auto stream = _detail::ovectorstream(bytes, limit);
+
+            std::forward<F>(payload)(stream);
+
+            if (!stream) {
+                TRELLIS_LOG_ACTION("server", get_context_id(), "Broadcast message is larger than ", limit, " bytes. Not sending it.");
+                return false;
+            }
+
+            return broadcast_buffers<Channel>(conns, asio::buffer(bytes));
+        }
+    }
+
 protected:
+    /** Sends the bytes to every connection, but only if every connection can take them. */
+    template <typename Channel, typename Range, typename ConstBufferSequence>
+    auto broadcast_buffers(const Range& conns, const ConstBufferSequence& buffers) -> bool {
+        auto size = asio::buffer_size(buffers);
+
+        for (const auto& conn : conns) {
+            if (size == 0 || size > conn->get_max_message_size()) {
+                TRELLIS_LOG_ACTION("server", get_context_id(), "Refusing to broadcast a message of ", size, " bytes.");
+                return false;
+            }
+        }
+
+        // Connections only split the message the same way if they send the same size of datagrams, so bodies are built once per payload size.
+        struct shared_fragments {
+            std::size_t payload_size;
+            std::size_t last_payload_size;
+            std::vector<_detail::shared_datagram_buffer> bodies;
+        };
+
+        auto groups = std::vector<shared_fragments>{};
+
+        for (const auto& conn : conns) {
+            auto payload_size = conn->get_datagram_size() - _detail::headers::data_offset;
+            auto iter = std::find_if(groups.begin(), groups.end(), [&](const shared_fragments& group) {
+                return group.payload_size == payload_size;
+            });
+
+            if (iter == groups.end()) {
+                auto num_fragments = (size + payload_size - 1) / payload_size;
+                auto bodies = std::vector<_detail::shared_datagram_buffer>(num_fragments);
+
+                for (auto& body : bodies) {
+                    body = this->make_pending_buffer();
+                }
+
+                connection_type::fill_fragments(buffers, bodies.data(), payload_size, 0);
+
+                groups.push_back({payload_size, size - (num_fragments - 1) * payload_size, std::move(bodies)});
+                iter = groups.end() - 1;
+            }
+
+            conn->template send_shared<Channel>(iter->bodies.begin(), iter->bodies.end(), iter->payload_size, iter->last_payload_size);
+        }
+
+        return true;
+    }
+
     virtual void kill(const connection_base& conn, const asio::error_code& ec) override {
         // should only be called from a connection's methods, so we should be in the networking thread
         assert(this->is_thread_current());
@@ -78,7 +172,15 @@ private:
         if (active_connections.empty()) {
             this->close();
         } else {
+            // Disconnecting may kill connections, which would invalidate iterators into the map.
+            auto conns = std::vector<std::shared_ptr<connection_type>>{};
+            conns.reserve(active_connections.size());
+
             for (auto& [endpoint, conn] : active_connections) {
+                conns.push_back(conn);
+            }
+
+            for (auto& conn : conns) {
                 conn->disconnect([this] {
                     if (active_connections.size() == 0) {
                         this->close();
@@ -102,7 +204,7 @@ private:
         active_connections.erase(iter);
     }
 
-    void receive(const _detail::datagram_buffer& buffer, const typename protocol::endpoint& sender_endpoint, std::size_t size) {
+    void receive(const _detail::shared_datagram_buffer& buffer, const typename protocol::endpoint& sender_endpoint, std::size_t size) {
         TRELLIS_BEGIN_SECTION("server");
 
         // should only be called from the base receive handler, so we should be in the networking thread
@@ -110,12 +212,19 @@ private:
 
         auto type = _detail::headers::type{};
 
-        std::memcpy(&type, buffer.data.data(), sizeof(_detail::headers::type));
+        std::memcpy(&type, buffer.data(), sizeof(_detail::headers::type));
 
         auto iter = active_connections.find(sender_endpoint);
 
         switch (type) {
             case _detail::headers::type::CONNECT: {
+                auto header = _detail::headers::connect{};
+
+                if (!this->read_header(buffer, size, header)) {
+                    TRELLIS_LOG_ACTION("server", get_context_id(), "Truncated CONNECT from ", sender_endpoint, ". Ignoring.");
+                    break;
+                }
+
                 if (iter == active_connections.end()) {
                     TRELLIS_LOG_ACTION("server", get_context_id(), "Received CONNECT for unknown connection. Creating connection.");
 
@@ -133,7 +242,7 @@ private:
                     if (iter->second->get_state() != connection_state::ESTABLISHED) {
                         TRELLIS_LOG_ACTION("server", get_context_id(), "Received CONNECT for INACTIVE connection. Sending CONNECT_OK.");
 
-                        iter->second->send_connect_ok();
+                        iter->second->receive_connect(header);
                     } else {
                         TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected CONNECT for ESTABLISHED connection ", sender_endpoint, ". Ignoring.");
                     }
@@ -181,7 +290,7 @@ private:
 
                     if (conn->get_state() == connection_state::PENDING || conn->get_state() == connection_state::ESTABLISHED) {
                         auto header = _detail::headers::data{};
-                        std::memcpy(&header, buffer.data.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data));
+                        std::memcpy(&header, buffer.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data));
 
                         if (header.channel_id >= sizeof...(Channels)) {
                             TRELLIS_LOG_ACTION("server", get_context_id(), "DATA received with invalid channel_id. Disconnecting.");
@@ -192,12 +301,18 @@ private:
 
                         TRELLIS_LOG_FRAGMENT("server", +header.fragment_id, +header.fragment_count);
 
-                        conn->receive(header, buffer, size, [&](_detail::raw_buffer&& data) {
+                        auto valid = conn->receive(header, buffer, size, [&](_detail::raw_buffer&& data) {
                             this->push_event(_detail::event_receive{conn, header.channel_id, std::move(data)});
                         }, [&] {
                             TRELLIS_LOG_ACTION("server", get_context_id(), "DATA caused connection to become ESTABLISHED. Pushing event_connect.");
                             this->push_event(_detail::event_connect{iter->second});
                         });
+
+                        if (!valid) {
+                            TRELLIS_LOG_ACTION("server", get_context_id(), "DATA received with malformed acks. Disconnecting.");
+
+                            conn->disconnect();
+                        }
                     } else {
                         TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected DATA from client ", sender_endpoint, ", which has not completed the handshake. Disconnecting.");
 
@@ -214,19 +329,12 @@ private:
                     auto& conn = iter->second;
 
                     if (conn->get_state() == connection_state::ESTABLISHED) {
-                        auto header = _detail::headers::data_ack{};
-                        std::memcpy(&header, buffer.data.data() + sizeof(_detail::headers::type), sizeof(_detail::headers::data_ack));
-
-                        TRELLIS_LOG_FRAGMENT("server", +header.fragment_id, "?");
-
-                        if (header.channel_id >= sizeof...(Channels)) {
-                            TRELLIS_LOG_ACTION("server", get_context_id(), "DATA_ACK received with invalid channel_id. Disconnecting.");
+                        if (!conn->receive_acks(buffer, size)) {
+                            TRELLIS_LOG_ACTION("server", get_context_id(), "Malformed DATA_ACK received. Disconnecting.");
 
                             conn->disconnect();
                             break;
                         }
-
-                        conn->receive_ack(header);
                     } else {
                         TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected DATA_ACK from client ", sender_endpoint, ", which has not completed the handshake. Disconnecting.");
 
@@ -236,6 +344,64 @@ private:
                     TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected DATA_ACK from unknown client ", sender_endpoint, ". Ignoring.");
                 }
 
+                break;
+            }
+            case _detail::headers::type::PROBE: {
+                if (iter != active_connections.end()) {
+                    auto& conn = iter->second;
+
+                    if (conn->get_state() == connection_state::PENDING || conn->get_state() == connection_state::ESTABLISHED) {
+                        auto header = _detail::headers::probe{};
+
+                        if (!this->read_header(buffer, size, header)) {
+                            TRELLIS_LOG_ACTION("server", get_context_id(), "Truncated PROBE from client ", sender_endpoint, ". Ignoring.");
+                            break;
+                        }
+
+                        conn->receive_probe(header, size);
+                    } else {
+                        TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected PROBE from client ", sender_endpoint, ", which has not completed the handshake. Ignoring.");
+                    }
+                } else {
+                    TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected PROBE from unknown client ", sender_endpoint, ". Ignoring.");
+                }
+
+                break;
+            }
+            case _detail::headers::type::PROBE_ACK: {
+                if (iter != active_connections.end()) {
+                    auto header = _detail::headers::probe_ack{};
+
+                    if (!this->read_header(buffer, size, header)) {
+                        TRELLIS_LOG_ACTION("server", get_context_id(), "Truncated PROBE_ACK from client ", sender_endpoint, ". Ignoring.");
+                        break;
+                    }
+
+                    iter->second->receive_probe_ack(header);
+                } else {
+                    TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected PROBE_ACK from unknown client ", sender_endpoint, ". Ignoring.");
+                }
+
+                break;
+            }
+            case _detail::headers::type::AGGREGATE: {
+                if (iter != active_connections.end()) {
+                    auto conn = iter->second;
+
+                    // Each packed datagram is received as if it had arrived on its own.
+                    auto valid = this->receive_aggregate(buffer, size, [&](const _detail::shared_datagram_buffer& packed, std::size_t packed_size) {
+                        receive(packed, sender_endpoint, packed_size);
+                    });
+
+                    if (!valid) {
+                        TRELLIS_LOG_ACTION("server", get_context_id(), "Malformed AGGREGATE received. Disconnecting.");
+
+                        conn->disconnect();
+                    }
+                } else {
+                    TRELLIS_LOG_ACTION("server", get_context_id(), "Unexpected AGGREGATE from unknown client ", sender_endpoint, ". Ignoring.");
+                }
+
                 break;
             }
         }
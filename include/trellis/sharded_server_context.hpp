@@ -0,0 +1,320 @@
+#pragma once
+
+#include "server_context.hpp"
+#include "context_stats.hpp"
+#include "context_traits.hpp"
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace trellis {
+
+/**
+ * A server made of several server_context shards listening on the same endpoint with SO_REUSEPORT.
+ * The kernel spreads clients across the shards by their address, and each shard has its own socket, executor, connection map, and buffer cache.
+ * Running the io_context on multiple threads lets the shards make progress in parallel.
+ * On platforms without SO_REUSEPORT, only a single shard is opened.
+ */
+template <typename... Channels>
+class sharded_server_context {
+public:
+    using shard_type = server_context<Channels...>;
+    using connection_type = typename shard_type::connection_type;
+    using connection_ptr = typename shard_type::connection_ptr;
+    using protocol = typename shard_type::protocol;
+    using traits = typename shard_type::traits;
+
+    /** Constructs shard_count shards running on the given io_context. */
+    sharded_server_context(asio::io_context& io, std::size_t shard_count) :
+        io(&io),
+        shards() {
+            make_shards(shard_count, [&]{ return std::make_unique<shard_type>(io); });
+        }
+
+    /**
+     * Constructs shard_count shards that call the handler directly on their networking threads. See context_crtp for details.
+     * If the io_context runs on multiple threads, the handler will be called concurrently from different shards.
+     */
+    template <typename Handler>
+    sharded_server_context(asio::io_context& io, std::size_t shard_count, Handler& handler) :
+        io(&io),
+        shards() {
+            make_shards(shard_count, [&]{ return std::make_unique<shard_type>(io, handler); });
+        }
+
+    sharded_server_context(const sharded_server_context&) = delete;
+    sharded_server_context(sharded_server_context&&) = delete;
+    sharded_server_context& operator=(const sharded_server_context&) = delete;
+    sharded_server_context& operator=(sharded_server_context&&) = delete;
+
+    /** Gets a reference to the io_context. */
+    auto get_io() -> asio::io_context& {
+        return *io;
+    }
+
+    /** Opens every shard on the same endpoint. If the port is 0, the port assigned to the first shard is shared by the rest. */
+    void listen(const typename protocol::endpoint& endpoint) {
+        shards.front()->listen(endpoint);
+
+        auto bound_endpoint = shards.front()->get_endpoint();
+
+        for (auto iter = shards.begin() + 1; iter != shards.end(); ++iter) {
+            (*iter)->listen(bound_endpoint);
+        }
+    }
+
+    /** Gets the server's local endpoint. */
+    auto get_endpoint() const -> typename protocol::endpoint {
+        return shards.front()->get_endpoint();
+    }
+
+    /** Sets the message memory cap of every shard. See context_base::set_message_memory_cap. */
+    void set_message_memory_cap(std::size_t bytes_per_shard) {
+        for (auto& shard : shards) {
+            shard->set_message_memory_cap(bytes_per_shard);
+        }
+    }
+
+    /** Closes all connections on every shard and stops the server. */
+    void stop() {
+        for (auto& shard : shards) {
+            shard->stop();
+        }
+    }
+
+    /** Determines whether any shard is still running. */
+    bool is_running() const {
+        return std::any_of(shards.begin(), shards.end(), [](const auto& shard) { return shard->is_running(); });
+    }
+
+    /** Processes queued events from every shard and submits them to the given Handler. See context_crtp::poll_events. */
+    template <typename Handler>
+    void poll_events(Handler&& handler) {
+        for (auto& shard : shards) {
+            shard->poll_events(handler);
+        }
+    }
+
+    /**
+     * Blocks the calling thread until any shard has events to poll, the server stops, or the timeout expires. See context_crtp::wait_for_events.
+     * The shards are waited on through async_wait_events, so the io_context must be running on other threads.
+     * Returns true if there are events to poll.
+     */
+    template <typename Rep, typename Period>
+    bool wait_for_events(const std::chrono::duration<Rep, Period>& timeout) {
+        if (has_events()) {
+            return true;
+        }
+
+        struct wait_state {
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool done = false;
+        };
+
+        auto state = std::make_shared<wait_state>();
+
+        async_wait_events([state](asio::error_code) {
+            {
+                auto lock = std::lock_guard(state->mutex);
+                state->done = true;
+            }
+            state->cv.notify_all();
+        });
+
+        auto done = [&]{
+            auto lock = std::unique_lock(state->mutex);
+            return state->cv.wait_for(lock, timeout, [&]{ return state->done; });
+        }();
+
+        // Release the waits left on the shards so they don't pile up.
+        if (!done) {
+            for (auto& shard : shards) {
+                shard->cancel_wait_events();
+            }
+        }
+
+        return has_events();
+    }
+
+    /**
+     * Asynchronously waits until any shard has events to poll. See context_crtp::async_wait_events.
+     *
+     * Completion signature: void(asio::error_code)
+     */
+    template <typename CompletionToken>
+    auto async_wait_events(CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code)>([this](auto handler) {
+            using handler_type = decltype(handler);
+
+            struct wait_state {
+                std::atomic<bool> done{false};
+                std::optional<handler_type> handler;
+            };
+
+            auto state = std::make_shared<wait_state>();
+            state->handler.emplace(std::move(handler));
+
+            for (auto& shard : shards) {
+                shard->async_wait_events([this, state](asio::error_code ec) {
+                    if (state->done.exchange(true)) return;
+
+                    // Release the waits left on the other shards so they don't pile up.
+                    for (auto& shard : shards) {
+                        shard->cancel_wait_events();
+                    }
+
+                    auto handler = std::move(*state->handler);
+                    state->handler.reset();
+
+                    auto executor = asio::get_associated_executor(handler, io->get_executor());
+
+                    asio::dispatch(executor, [handler = std::move(handler), ec]() mutable {
+                        handler(ec);
+                    });
+                });
+            }
+        }, token);
+    }
+
+    /** Sets the event queue policy of every shard. See context_crtp::set_event_queue_policy. */
+    void set_event_queue_policy(event_queue_policy policy) {
+        for (auto& shard : shards) {
+            shard->set_event_queue_policy(policy);
+        }
+    }
+
+    /** Sets the event queue capacity of every shard. See context_crtp::set_event_queue_capacity. */
+    void set_event_queue_capacity(std::size_t capacity) {
+        for (auto& shard : shards) {
+            shard->set_event_queue_capacity(capacity);
+        }
+    }
+
+    /** Sets the congestion control of every shard. See context_base::set_congestion_control. */
+    void set_congestion_control(const congestion_controller_factory& factory) {
+        for (auto& shard : shards) {
+            shard->set_congestion_control(factory);
+        }
+    }
+
+    /** Enables or disables message aggregation on every shard. See context_base::set_message_aggregation. */
+    void set_message_aggregation(bool enabled) {
+        for (auto& shard : shards) {
+            shard->set_message_aggregation(enabled);
+        }
+    }
+
+    /** Sets the largest datagram every shard will send or accept. See context_base::set_datagram_size. */
+    void set_datagram_size(std::size_t size) {
+        for (auto& shard : shards) {
+            shard->set_datagram_size(size);
+        }
+    }
+
+    /** Enables or disables path MTU probing on every shard. See context_base::set_mtu_probing. */
+    void set_mtu_probing(bool enabled) {
+        for (auto& shard : shards) {
+            shard->set_mtu_probing(enabled);
+        }
+    }
+
+    /** Sets the receive batch size of every shard. See context_crtp::set_receive_batch_size. */
+    void set_receive_batch_size(std::size_t size) {
+        for (auto& shard : shards) {
+            shard->set_receive_batch_size(size);
+        }
+    }
+
+    /** Sets the windows of a reliable channel on every shard. See context_crtp::set_channel_window. */
+    template <typename Channel>
+    void set_channel_window(std::size_t send, std::size_t receive) {
+        for (auto& shard : shards) {
+            shard->template set_channel_window<Channel>(send, receive);
+        }
+    }
+
+    /** Reserves datagram buffers on every shard. See context_base::reserve_datagram_buffers. */
+    void reserve_datagram_buffers(std::size_t count_per_shard) {
+        for (auto& shard : shards) {
+            shard->reserve_datagram_buffers(count_per_shard);
+        }
+    }
+
+    /** Gets the number of shards. */
+    auto get_shard_count() const -> std::size_t {
+        return shards.size();
+    }
+
+    /** Gets the shard at index i. Useful for per-shard configuration and stats. */
+    auto get_shard(std::size_t i) -> shard_type& {
+        assert(i < shards.size());
+        return *shards[i];
+    }
+
+    /**
+     * Gets the sum of all shards' stats. The max_datagrams_per_wakeup field is the largest of any shard.
+     * The high water fields are the sum of each shard's high water mark, so they are upper bounds.
+     */
+    auto get_stats() const -> context_stats {
+        auto result = context_stats{};
+
+        for (auto& shard : shards) {
+            auto stats = shard->get_stats();
+            result.receive_wakeups += stats.receive_wakeups;
+            result.datagrams_received += stats.datagrams_received;
+            result.max_datagrams_per_wakeup = std::max(result.max_datagrams_per_wakeup, stats.max_datagrams_per_wakeup);
+            result.send_calls += stats.send_calls;
+            result.datagrams_sent += stats.datagrams_sent;
+            result.datagrams_aggregated += stats.datagrams_aggregated;
+            result.message_bytes_in_use += stats.message_bytes_in_use;
+            result.message_bytes_high_water += stats.message_bytes_high_water;
+            result.message_bytes_cached += stats.message_bytes_cached;
+            result.message_allocations_rejected += stats.message_allocations_rejected;
+            result.event_queue_depth += stats.event_queue_depth;
+            result.event_queue_high_water += stats.event_queue_high_water;
+            result.events_dropped += stats.events_dropped;
+            result.datagram_buffers_allocated += stats.datagram_buffers_allocated;
+            result.datagram_buffers_free += stats.datagram_buffers_free;
+            result.datagram_buffers_in_flight += stats.datagram_buffers_in_flight;
+        }
+
+        return result;
+    }
+
+private:
+    /** Determines whether any shard has events to poll, without blocking. */
+    bool has_events() {
+        return std::any_of(shards.begin(), shards.end(), [](const auto& shard) { return shard->wait_for_events(std::chrono::seconds{0}); });
+    }
+
+    template <typename F>
+    void make_shards(std::size_t shard_count, F&& make_shard) {
+        assert(shard_count > 0);
+
+#ifndef SO_REUSEPORT
+        shard_count = 1;
+#endif
+
+        shards.reserve(shard_count);
+
+        for (auto i = std::size_t(0); i < shard_count; ++i) {
+            shards.push_back(make_shard());
+            shards.back()->set_reuse_port(true);
+        }
+    }
+
+    asio::io_context* io;
+    std::vector<std::unique_ptr<shard_type>> shards;
+};
+
+} // namespace trellis
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <asio.hpp>
+
+#include <cstddef>
+
+namespace trellis::_detail {
+
+/**
+ * An integer socket option, for the options asio doesn't provide. Also works for boolean options, which the OS takes as an int.
+ * Meets asio's SettableSocketOption requirements, so it can be passed to set_option.
+ */
+template <int Level, int Name>
+class int_socket_option {
+public:
+    explicit int_socket_option(int value) :
+        value(value) {}
+
+    template <typename Protocol>
+    auto level([[maybe_unused]] const Protocol& protocol) const -> int {
+        return Level;
+    }
+
+    template <typename Protocol>
+    auto name([[maybe_unused]] const Protocol& protocol) const -> int {
+        return Name;
+    }
+
+    template <typename Protocol>
+    auto data([[maybe_unused]] const Protocol& protocol) const -> const void* {
+        return &value;
+    }
+
+    template <typename Protocol>
+    auto size([[maybe_unused]] const Protocol& protocol) const -> std::size_t {
+        return sizeof(value);
+    }
+
+private:
+    int value;
+};
+
+} // namespace trellis::_detail
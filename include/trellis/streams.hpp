@@ -1,9 +1,12 @@
 #pragma once
 
+#include "channel_reliable_fwd.hpp"
 #include "datagram.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <streambuf>
+#include <vector>
 
 namespace trellis::_detail {
 
@@ -32,6 +35,42 @@ private:
     bytebuf buf;
 };
 
+/**
+ * Appends everything written to it to a std::vector<char>, up to limit bytes. Writing past the limit fails, like a packetbuf running out of fragments.
+ * Used to serialize a message once before copying it to many connections.
+ */
+class vectorbuf final : public std::streambuf {
+public:
+    vectorbuf(std::vector<char>& vec, std::size_t limit) : vec(&vec), limit(limit) {}
+
+    virtual int_type overflow(int_type ch) {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()) && vec->size() < limit) {
+            vec->push_back(traits_type::to_char_type(ch));
+            return ch;
+        } else {
+            return traits_type::eof();
+        }
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize count) {
+        auto n = std::min(count, std::streamsize(limit - std::min(limit, vec->size())));
+        vec->insert(vec->end(), s, s + n);
+        return n;
+    }
+
+private:
+    std::vector<char>* vec;
+    std::size_t limit;
+};
+
+class ovectorstream final : public std::ostream {
+public:
+    ovectorstream(std::vector<char>& vec, std::size_t limit) : std::ostream(&buf), buf(vec, limit) {}
+
+private:
+    vectorbuf buf;
+};
+
 class packetbuf_base : public std::streambuf {
 public:
     using std::streambuf::traits_type;
@@ -42,10 +81,10 @@ public:
     using fragment_array = std::array<shared_datagram_buffer, config::max_fragments>;
     using fragment_iterator = fragment_array::iterator;
 
-    static constexpr std::size_t payload_size = config::datagram_size - headers::data_offset;
-
+    /** Fragments are sized for the connection's datagram size when the stream is created, even if it grows before the message is sent. */
     packetbuf_base(connection_base& conn) :
         conn(&conn),
+        payload_size(conn.get_datagram_size() - headers::data_offset),
         fragments(),
         fragments_back(fragments.begin()),
         current_fragment(fragments.begin()),
@@ -56,6 +95,11 @@ public:
     packetbuf_base& operator=(const packetbuf_base&) = delete;
     packetbuf_base& operator=(packetbuf_base&&) = delete;
 
+    /** Determines whether no fragments have been written. */
+    auto empty() const -> bool {
+        return fragments_back == fragments.begin();
+    }
+
     virtual int_type overflow(int_type ch) {
         if (!traits_type::eq_int_type(ch, traits_type::eof())) {
             if (current_fragment == fragments_back || ++current_fragment == fragments_back) {
@@ -71,7 +115,7 @@ public:
 
             auto& fragment = *current_fragment;
             auto b = fragment.data() + headers::data_offset;
-            auto e = fragment.data() + fragment.size();
+            auto e = b + payload_size;
 
             *b = ch;
 
@@ -150,7 +194,7 @@ public:
 
         auto& fragment = *current_fragment;
         auto b = fragment.data() + headers::data_offset;
-        auto e = fragment.data() + fragment.size();
+        auto e = b + payload_size;
 
         setp(b, e);
         pbump(new_offset);
@@ -160,6 +204,7 @@ public:
 
 protected:
     connection_base* conn;
+    std::size_t payload_size;
     fragment_array fragments;
     fragment_iterator fragments_back;
     fragment_iterator current_fragment;
@@ -178,15 +223,18 @@ public:
     packetbuf& operator=(const packetbuf&) = delete;
     packetbuf& operator=(packetbuf&&) = delete;
 
+    /** Sends the fragments written so far as one message. reservation is passed on to reliable channels, see channel_reliable::send_message_impl. */
     template <typename Channel>
-    void send() {
+    void send(send_reservation* reservation) {
         auto total_size = std::max(off_type(max_pos), off_type(seekoff(0, std::ios_base::cur, std::ios_base::out)));
         assert(total_size <= off_type((fragments_back - fragments.begin()) * payload_size));
 
-        auto last_payload_size = total_size % payload_size;
+        // A message filling its last fragment exactly still sends that fragment in full.
+        auto num_fragments = fragments_back - fragments.begin();
+        auto last_payload_size = num_fragments > 0 ? std::size_t(total_size) - (num_fragments - 1) * payload_size : 0;
         assert(last_payload_size <= payload_size);
 
-        static_cast<connection_type*>(conn)->template send_data<Channel>(fragments.begin(), fragments_back, last_payload_size);
+        static_cast<connection_type*>(conn)->template send_data<Channel>(fragments.begin(), fragments_back, payload_size, last_payload_size, reservation);
     }
 };
 
@@ -197,14 +245,21 @@ public:
     using connection_type = C;
     using buf_type = packetbuf<connection_type>;
 
-    opacketstream(connection_type& conn) : std::ostream(&buf), buf(conn) {}
+    /** The message is sent when the stream is destroyed. If reservation is given, it uses the send window slot held by it. */
+    opacketstream(connection_type& conn, send_reservation* reservation = nullptr) : std::ostream(&buf), buf(conn), reservation(reservation) {}
 
     ~opacketstream() {
-        buf.template send<channel_type>();
+        buf.template send<channel_type>(reservation);
+    }
+
+    /** Determines whether nothing has been written, in which case nothing will be sent. */
+    auto empty() const -> bool {
+        return buf.empty();
     }
 
 private:
     buf_type buf;
+    send_reservation* reservation;
 };
 
 } // namespace trellis::_detail
@@ -8,6 +8,10 @@ class ibytestream;
 
 class obytestream;
 
+class vectorbuf;
+
+class ovectorstream;
+
 class packetbuf_base;
 
 template <typename C>
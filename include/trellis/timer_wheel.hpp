@@ -0,0 +1,430 @@
+#pragma once
+
+#include "config.hpp"
+#include "guarded_timer.hpp"
+#include "utility.hpp"
+
+#include <asio.hpp>
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+
+namespace trellis::_detail {
+
+class timer_wheel;
+
+/** An intrusive list node scheduled in a timer_wheel. */
+class timer_node {
+public:
+    timer_node() :
+        prev(this),
+        next(this),
+        expiry(0),
+        level(detached) {}
+
+    timer_node(const timer_node&) = delete;
+    timer_node& operator=(const timer_node&) = delete;
+
+    auto is_linked() const -> bool {
+        return next != this;
+    }
+
+private:
+    friend timer_wheel;
+
+    static constexpr std::uint8_t detached = 0xff;
+
+    void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = this;
+        next = this;
+    }
+
+    void link_before(timer_node& other) {
+        assert(!is_linked());
+        prev = other.prev;
+        next = &other;
+        other.prev->next = this;
+        other.prev = this;
+    }
+
+    timer_node* prev;
+    timer_node* next;
+    std::uint64_t expiry;
+    std::uint8_t level;
+    std::uint8_t slot;
+    void (*fire)(timer_node&);
+};
+
+/**
+ * A hashed hierarchical timing wheel, shared by every timer in a context.
+ * Each level has 64 slots and a bitmap of which slots are occupied. Inserting and cancelling are O(1).
+ * Entries sit at the level of the most significant digit in which their expiry differs from the current tick, and cascade down as time reaches them.
+ * A single steady_timer is armed for the next occupied tick, so an idle wheel costs nothing.
+ * Must only be used from the context's executor.
+ */
+class timer_wheel {
+public:
+    using clock_type = asio::steady_timer::clock_type;
+    using duration = clock_type::duration;
+    using time_point = clock_type::time_point;
+    using executor_type = asio::steady_timer::executor_type;
+
+    static constexpr std::size_t level_bits = 6;
+    static constexpr std::size_t slots_per_level = std::size_t(1) << level_bits;
+    static constexpr std::size_t level_count = 4;
+
+    explicit timer_wheel(const executor_type& executor) :
+        timer(executor),
+        origin(clock_type::now()),
+        current_tick(0),
+        armed_tick(0),
+        armed(false),
+        count(0),
+        occupied{},
+        slots{} {
+            for (auto& level : slots) {
+                for (auto& head : level) {
+                    head.prev = &head;
+                    head.next = &head;
+                }
+            }
+        }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    ~timer_wheel() {
+        // Leave any remaining nodes detached so their owners can still be destroyed.
+        for (auto& level : slots) {
+            for (auto& head : level) {
+                while (head.is_linked()) {
+                    auto node = head.next;
+                    node->unlink();
+                    node->level = timer_node::detached;
+                }
+            }
+        }
+    }
+
+    /** Schedules the node to fire at the given time. The node must not already be scheduled. */
+    void schedule(timer_node& node, time_point when, void (*fire)(timer_node&)) {
+        assert(!node.is_linked());
+
+        if (count == 0) {
+            // Nothing is pending, so there's nothing to catch up on.
+            current_tick = std::max(current_tick, elapsed_ticks(clock_type::now()));
+        }
+
+        node.expiry = std::max(to_tick(when), current_tick + 1);
+        node.fire = fire;
+
+        insert(node, current_tick);
+        ++count;
+
+        arm();
+    }
+
+    /** Removes the node from the wheel. Returns true if it was scheduled. */
+    auto cancel(timer_node& node) -> bool {
+        if (!node.is_linked()) {
+            return false;
+        }
+
+        remove(node);
+
+        return true;
+    }
+
+    /** Gets the number of scheduled nodes. */
+    auto size() const -> std::size_t {
+        return count;
+    }
+
+    /** The wheel's resolution. Timers never fire early, but may fire up to one tick late. */
+    static constexpr auto tick() -> duration {
+        return std::chrono::duration_cast<duration>(config::timer_wheel_tick);
+    }
+
+    /** Fires every node that has expired by the given time. Normally driven by the wheel's own timer. */
+    void advance(time_point now) {
+        auto target = elapsed_ticks(now);
+
+        while (current_tick < target && count > 0) {
+            auto t = current_tick + 1;
+
+            // Skip straight to the next tick where something could happen, either an occupied level 0 slot or a cascade.
+            auto next = next_event_tick();
+
+            if (next > target) {
+                current_tick = target;
+                break;
+            }
+
+            t = std::max(t, next);
+
+            cascade(t);
+
+            current_tick = t;
+
+            fire_slot(0, t & (slots_per_level - 1));
+        }
+
+        if (count == 0) {
+            current_tick = std::max(current_tick, target);
+        }
+    }
+
+private:
+    using tick_type = std::uint64_t;
+
+    static constexpr auto digit(tick_type t, std::size_t level) -> std::size_t {
+        return std::size_t(t >> (level * level_bits)) & (slots_per_level - 1);
+    }
+
+    auto to_tick(time_point t) const -> tick_type {
+        if (t <= origin) return 0;
+        // Round up so that timers never fire early.
+        return tick_type((t - origin + tick() - duration(1)) / tick());
+    }
+
+    /** Rounds down, so a tick is only processed once all of it has passed. */
+    auto elapsed_ticks(time_point t) const -> tick_type {
+        if (t <= origin) return 0;
+        return tick_type((t - origin) / tick());
+    }
+
+    auto to_time(tick_type t) const -> time_point {
+        return origin + tick() * t;
+    }
+
+    /** Links the node into the slot for its expiry, relative to the base tick. */
+    void insert(timer_node& node, tick_type base) {
+        assert(node.expiry >= base);
+
+        // Find the most significant digit where the expiry differs from the base tick.
+        auto diff = node.expiry ^ base;
+        auto level = std::size_t(0);
+
+        while (level + 1 < level_count && (diff >> ((level + 1) * level_bits)) != 0) {
+            ++level;
+        }
+
+        // Expiries past the top level's wrap go in the top level as well, in a slot that won't come around again until the wrap.
+        // Anything too far out for one rotation is parked in the slot just behind the current one, and reinserted when it cascades.
+        auto slot = node.expiry - base >= (tick_type(1) << (level_count * level_bits))
+            ? (digit(base, level) + slots_per_level - 1) & (slots_per_level - 1)
+            : digit(node.expiry, level);
+
+        node.level = std::uint8_t(level);
+        node.slot = std::uint8_t(slot);
+        node.link_before(slots[level][slot]);
+        occupied[level] |= std::uint64_t(1) << slot;
+    }
+
+    void remove(timer_node& node) {
+        assert(node.is_linked());
+
+        auto level = node.level;
+        auto slot = node.slot;
+
+        node.unlink();
+        --count;
+
+        if (level != timer_node::detached) {
+            node.level = timer_node::detached;
+
+            if (!slots[level][slot].is_linked()) {
+                occupied[level] &= ~(std::uint64_t(1) << slot);
+            }
+        }
+    }
+
+    /** Moves every node out of a slot into a local list, so callbacks can freely schedule and cancel. */
+    void detach_slot(std::size_t level, std::size_t slot, timer_node& list) {
+        auto& head = slots[level][slot];
+
+        while (head.is_linked()) {
+            auto node = head.next;
+            node->unlink();
+            node->level = timer_node::detached;
+            node->link_before(list);
+        }
+
+        occupied[level] &= ~(std::uint64_t(1) << slot);
+    }
+
+    /** Reinserts the nodes of every higher-level slot that tick t has reached, from the top down. */
+    void cascade(tick_type t) {
+        for (auto level = level_count - 1; level > 0; --level) {
+            auto mask = (tick_type(1) << (level * level_bits)) - 1;
+
+            if ((t & mask) != 0) continue;
+
+            auto list = timer_node{};
+            detach_slot(level, digit(t, level), list);
+
+            while (list.is_linked()) {
+                auto node = list.next;
+                node->unlink();
+                insert(*node, t);
+            }
+        }
+    }
+
+    void fire_slot(std::size_t level, std::size_t slot) {
+        auto list = timer_node{};
+        detach_slot(level, slot, list);
+
+        while (list.is_linked()) {
+            auto node = list.next;
+            node->unlink();
+            --count;
+
+            // Nodes parked beyond the top level are always reinserted by a cascade before they reach level 0.
+            assert(node->expiry <= current_tick);
+
+            node->fire(*node);
+        }
+    }
+
+    /** Finds the next tick after current_tick at which a node fires or a cascade is due. */
+    auto next_event_tick() const -> tick_type {
+        auto next = current_tick + 1;
+        auto pos = digit(next, 0);
+
+        // The level 0 digit is wrapping, so higher levels may need to cascade.
+        if (pos == 0) {
+            return next;
+        }
+
+        // Occupied level 0 slots at or after next, before the digit wraps.
+        auto bits = occupied[0] & (~std::uint64_t(0) << pos);
+
+        if (bits) {
+            return (next & ~tick_type(slots_per_level - 1)) + tick_type(count_trailing_zeros(bits));
+        }
+
+        // Otherwise, the next thing that can happen is the level 0 digit wrapping into a cascade.
+        return (next | tick_type(slots_per_level - 1)) + 1;
+    }
+
+    /** Makes sure the steady_timer will wake up by the next event tick. */
+    void arm() {
+        if (count == 0) return;
+
+        auto next = next_event_tick();
+
+        if (armed && armed_tick <= next) return;
+
+        armed = true;
+        armed_tick = next;
+
+        timer.expires_at(to_time(next));
+        timer.async_wait([this](asio::error_code ec) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+
+            armed = false;
+            advance(clock_type::now());
+            arm();
+        });
+    }
+
+    asio::steady_timer timer;
+    time_point origin;
+    tick_type current_tick;
+    tick_type armed_tick;
+    bool armed;
+    std::size_t count;
+    std::array<std::uint64_t, level_count> occupied;
+    std::array<std::array<timer_node, slots_per_level>, level_count> slots;
+};
+
+/**
+ * A timer backed by the context's timer_wheel, with the same interface as guarded_timer.
+ * Unlike an asio timer, a cancelled or re-armed wait is dropped without calling its handler.
+ */
+template <typename GuardValue = void>
+class wheel_timer : private timer_node {
+public:
+    using guard_value = GuardValue;
+    using clock_type = timer_wheel::clock_type;
+    using duration = timer_wheel::duration;
+    using time_point = timer_wheel::time_point;
+
+    explicit wheel_timer(timer_wheel& wheel) :
+        wheel(&wheel),
+        expiry(),
+        guard(),
+        handler() {}
+
+    wheel_timer(const wheel_timer&) = delete;
+    wheel_timer& operator=(const wheel_timer&) = delete;
+
+    ~wheel_timer() {
+        cancel();
+    }
+
+    /** Sets the expiry time. Returns the number of pending waits that were cancelled. */
+    auto expires_at(const time_point& expiry_time) -> std::size_t {
+        auto cancelled = cancel();
+        expiry = expiry_time;
+        return cancelled;
+    }
+
+    /** Sets the expiry time relative to now. Returns the number of pending waits that were cancelled. */
+    auto expires_from_now(const duration& expiry_time) -> std::size_t {
+        return expires_at(clock_type::now() + expiry_time);
+    }
+
+    auto cancel() -> std::size_t {
+        if (!is_linked()) return 0;
+
+        wheel->cancel(*this);
+        handler = nullptr;
+
+        return 1;
+    }
+
+    template <typename WaitHandler>
+    void async_wait(const std::weak_ptr<guard_value>& guard, WaitHandler&& handler) {
+        assert(guard.lock());
+
+        cancel();
+
+        this->guard = guard;
+        this->handler = [handler = std::forward<WaitHandler>(handler)](asio::error_code ec, const std::weak_ptr<guard_value>& guard) {
+            guarded_timer_invoke(handler, ec, guard);
+        };
+
+        wheel->schedule(*this, expiry, &wheel_timer::fire);
+    }
+
+private:
+    static void fire(timer_node& node) {
+        auto& self = static_cast<wheel_timer&>(node);
+
+        if (!self.guard.lock()) return;
+
+        // The handler may re-arm the timer, so move it out first.
+        auto handler = std::move(self.handler);
+        self.handler = nullptr;
+
+        handler(asio::error_code{}, self.guard);
+    }
+
+    timer_wheel* wheel;
+    time_point expiry;
+    std::weak_ptr<guard_value> guard;
+    std::function<void(asio::error_code, const std::weak_ptr<guard_value>&)> handler;
+};
+
+} // namespace trellis::_detail
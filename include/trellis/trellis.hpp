@@ -2,3 +2,4 @@
 
 #include "client_context.hpp"
 #include "server_context.hpp"
+#include "sharded_server_context.hpp"
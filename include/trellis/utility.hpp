@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cassert>
 #include <cstdint>
 #include <tuple>
 #include <type_traits>
+#include <utility>
 
 namespace trellis::_detail {
 
@@ -66,4 +68,31 @@ struct overload : Ts... {
 template <typename... Ts>
 overload(Ts...) -> overload<Ts...>;
 
+// has_on_writable
+
+template <typename Handler, typename Channel, typename ConnectionPtr, typename = void>
+struct has_on_writable : std::false_type {};
+
+template <typename Handler, typename Channel, typename ConnectionPtr>
+struct has_on_writable<Handler, Channel, ConnectionPtr, std::void_t<decltype(std::declval<Handler&>().on_writable(Channel{}, std::declval<const ConnectionPtr&>()))>> : std::true_type {};
+
+template <typename Handler, typename Channel, typename ConnectionPtr>
+inline constexpr bool has_on_writable_v = has_on_writable<Handler, Channel, ConnectionPtr>::value;
+
+// count_trailing_zeros
+
+inline auto count_trailing_zeros(std::uint64_t x) -> int {
+    assert(x != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    auto n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
 } // namespace trellis::_detail
@@ -0,0 +1,302 @@
+#include "catch.hpp"
+
+#include "context_handler.hpp"
+
+#include <asio.hpp>
+#include <trellis/trellis.hpp>
+#include <trellis/proxy_context.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <optional>
+
+using namespace std::chrono_literals;
+
+using channel_A = trellis::channel_type_reliable_ordered<struct A>;
+
+namespace {
+
+/** Forwards to another controller, and remembers the largest window it has handed out. */
+class recording_controller : public trellis::congestion_controller {
+public:
+    recording_controller(std::unique_ptr<trellis::congestion_controller> inner, std::size_t& largest_window) :
+        inner(std::move(inner)),
+        largest_window(&largest_window) {}
+
+    void on_ack(std::size_t fragments, std::optional<duration> rtt) override {
+        inner->on_ack(fragments, rtt);
+    }
+
+    void on_loss(time_point sent, time_point now) override {
+        inner->on_loss(sent, now);
+    }
+
+    auto get_window() const -> std::size_t override {
+        auto window = inner->get_window();
+        *largest_window = std::max(*largest_window, window);
+        return window;
+    }
+
+private:
+    std::unique_ptr<trellis::congestion_controller> inner;
+    std::size_t* largest_window;
+};
+
+/** Never limits how much is in flight. */
+class fixed_window_controller : public trellis::congestion_controller {
+public:
+    explicit fixed_window_controller(std::size_t window) : window(window) {}
+
+    void on_ack(std::size_t fragments, std::optional<duration> rtt) override {}
+    void on_loss(time_point sent, time_point now) override {}
+
+    auto get_window() const -> std::size_t override {
+        return window;
+    }
+
+private:
+    std::size_t window;
+};
+
+} // namespace
+
+TEST_CASE("NewReno grows in slow start and halves on loss", "[congestion_control]") {
+    auto cc = trellis::new_reno_controller();
+    auto start = trellis::congestion_controller::clock_type::now();
+
+    REQUIRE(cc.get_window() == trellis::config::initial_congestion_window);
+
+    // Slow start doubles the window every round trip.
+    cc.on_ack(trellis::config::initial_congestion_window, 10ms);
+
+    REQUIRE(cc.get_window() == 2 * trellis::config::initial_congestion_window);
+
+    cc.on_loss(start + 1ms, start + 2ms);
+
+    REQUIRE(cc.get_window() == trellis::config::initial_congestion_window);
+
+    // Losses of fragments sent before the reduction are part of the same event.
+    cc.on_loss(start, start + 3ms);
+    cc.on_loss(start + 2ms, start + 3ms);
+
+    REQUIRE(cc.get_window() == trellis::config::initial_congestion_window);
+
+    // Congestion avoidance grows by about one fragment per window of acks. The window grows along the way, so it takes one more.
+    for (auto i = std::size_t(0); i <= trellis::config::initial_congestion_window; ++i) {
+        cc.on_ack(1, std::nullopt);
+    }
+
+    REQUIRE(cc.get_window() == trellis::config::initial_congestion_window + 1);
+
+    // Never shrinks below the minimum.
+    for (auto i = 0; i < 20; ++i) {
+        cc.on_loss(start + 10ms + 1ms * i, start + 10ms + 1ms * i);
+    }
+
+    REQUIRE(cc.get_window() == trellis::config::min_congestion_window);
+}
+
+TEST_CASE("Delay controller backs off as the round trip time rises", "[congestion_control]") {
+    auto cc = trellis::delay_controller();
+
+    // A steady RTT means nothing is queued, so it grows like slow start.
+    for (auto i = 0; i < 10; ++i) {
+        cc.on_ack(1, 20ms);
+    }
+
+    auto grown = cc.get_window();
+
+    REQUIRE(grown == trellis::config::initial_congestion_window + 10);
+
+    // Acks without a measurement leave the window alone.
+    cc.on_ack(5, std::nullopt);
+
+    REQUIRE(cc.get_window() == grown);
+
+    // Doubling the RTT puts half the window in queues, well above beta.
+    for (auto i = 0; i < 100; ++i) {
+        cc.on_ack(1, 40ms);
+    }
+
+    REQUIRE(cc.get_window() < grown);
+
+    // Shrinking the window drains the queues, so it settles above the minimum.
+    REQUIRE(cc.get_window() >= trellis::config::min_congestion_window);
+}
+
+TEST_CASE("Reliable channel delivers everything under congestion control", "[congestion_control]") {
+    constexpr auto COUNT = 500;
+
+    auto factory = trellis::congestion_controller_factory{};
+
+    SECTION("NewReno") {
+        factory = [] { return std::make_unique<trellis::new_reno_controller>(); };
+    }
+
+    SECTION("Delay") {
+        factory = [] { return std::make_unique<trellis::delay_controller>(); };
+    }
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+    auto proxy = trellis::proxy_context(io);
+
+    auto largest_window = std::size_t(0);
+
+    server.set_congestion_control([&] {
+        return std::make_unique<recording_controller>(factory(), largest_window);
+    });
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    proxy.listen({asio::ip::make_address_v4("127.0.0.1"), 0}, server.get_endpoint());
+    client.connect({asio::ip::udp::v4(), 0}, proxy.get_endpoint());
+
+    proxy.set_client_drop_rate(0.1);
+    proxy.set_server_drop_rate(0.1);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        proxy.stop();
+        io.stop();
+    });
+
+    auto server_conn = std::shared_ptr<trellis::server_context<channel_A>::connection_type>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            server_conn = conn_ptr;
+
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    int next = 0;
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+
+            // New fragments only go out while fewer than the window are in flight. A window shrunk by loss just lets them drain.
+            REQUIRE(server_conn->get_stats()[0].packets_in_flight <= largest_window);
+
+            if (next == COUNT) {
+                auto stats = server_conn->get_stats()[0];
+
+                REQUIRE(stats.congestion_window >= trellis::config::min_congestion_window);
+                REQUIRE(stats.packets_in_flight <= COUNT);
+
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+}
+
+TEST_CASE("Reliable channel paces a window over the round trip", "[congestion_control]") {
+    constexpr auto COUNT = 200;
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+    auto proxy = trellis::proxy_context(io);
+
+    // The window never fills up, so only pacing keeps the messages from going out in a single burst.
+    server.set_congestion_control([] {
+        return std::make_unique<fixed_window_controller>(std::size_t(COUNT));
+    });
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    proxy.listen({asio::ip::make_address_v4("127.0.0.1"), 0}, server.get_endpoint());
+    client.connect({asio::ip::udp::v4(), 0}, proxy.get_endpoint());
+
+    proxy.set_delay(20ms);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        proxy.stop();
+        io.stop();
+    });
+
+    auto server_conn = std::shared_ptr<trellis::server_context<channel_A>::connection_type>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            server_conn = conn_ptr;
+
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    int next = 0;
+    auto first = std::chrono::steady_clock::time_point{};
+    auto last = std::chrono::steady_clock::time_point{};
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+
+            last = std::chrono::steady_clock::now();
+
+            if (next == 1) {
+                first = last;
+            }
+
+            if (next == COUNT) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+
+    // A full window is spread over most of a round trip, less the short burst an idle connection may bank.
+    auto rtt = server_conn->get_stats()[0].smoothed_rtt;
+
+    REQUIRE(rtt >= 40ms);
+    REQUIRE(last - first >= rtt / 2);
+}
@@ -0,0 +1,1919 @@
+#include "catch.hpp"
+
+#include "context_handler.hpp"
+
+#include <asio.hpp>
+#include <trellis/trellis.hpp>
+#include <trellis/proxy_context.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+using channel_A = trellis::channel_type_reliable_ordered<struct A>;
+
+TEST_CASE("Context stats count batched datagrams", "[context]") {
+    constexpr auto COUNT = 1000;
+    constexpr auto BATCH_SIZE = std::size_t(8);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    client.set_receive_batch_size(BATCH_SIZE);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    int next = 0;
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+            if (next == COUNT) {
+                // The handshake and the acks have measured the round trip by now.
+                auto conn_stats = conn->get_stats()[0];
+                REQUIRE(conn_stats.smoothed_rtt > std::chrono::microseconds{0});
+                REQUIRE(conn_stats.retransmit_timeout >= trellis::config::min_rto);
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+
+    auto stats = client.get_stats();
+
+    REQUIRE(stats.datagrams_received >= COUNT);
+    REQUIRE(stats.receive_wakeups > 0);
+    REQUIRE(stats.receive_wakeups <= stats.datagrams_received);
+    REQUIRE(stats.max_datagrams_per_wakeup >= 1);
+    REQUIRE(stats.max_datagrams_per_wakeup <= BATCH_SIZE * trellis::config::receive_batches_per_wakeup);
+
+    auto server_stats = server.get_stats();
+
+    REQUIRE(server_stats.datagrams_sent >= COUNT);
+    REQUIRE(server_stats.send_calls > 0);
+    REQUIRE(server_stats.send_calls < server_stats.datagrams_sent);
+}
+
+#ifdef TRELLIS_HAS_MMSG
+TEST_CASE("Context drains several batches per wakeup, up to a limit", "[context]") {
+    constexpr auto BATCH_SIZE = std::size_t(8);
+    constexpr auto PER_WAKEUP = BATCH_SIZE * trellis::config::receive_batches_per_wakeup;
+    constexpr auto COUNT = PER_WAKEUP * 2 + BATCH_SIZE / 2;
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+
+    server.set_receive_batch_size(BATCH_SIZE);
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    // Everything is already waiting when the server first wakes up. It ignores DISCONNECTs from clients it doesn't know.
+    auto socket = asio::ip::udp::socket(io, {asio::ip::udp::v4(), 0});
+    auto type = trellis::_detail::headers::type::DISCONNECT;
+
+    for (auto i = std::size_t(0); i < COUNT; ++i) {
+        socket.send_to(asio::buffer(&type, sizeof(type)), server.get_endpoint());
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+
+    while (server.get_stats().datagrams_received < COUNT && std::chrono::steady_clock::now() < deadline) {
+        io.run_one_for(std::chrono::milliseconds{10});
+    }
+
+    auto stats = server.get_stats();
+
+    REQUIRE(stats.datagrams_received == COUNT);
+
+    // The first wakeup takes its full share of batches, and the rest waits for the next ones.
+    REQUIRE(stats.max_datagrams_per_wakeup == PER_WAKEUP);
+    REQUIRE(stats.receive_wakeups == 3);
+
+    server.stop();
+}
+#endif
+
+TEST_CASE("Server ignores a CONNECT too short to hold its header", "[context]") {
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    auto socket = asio::ip::udp::socket(io, {asio::ip::udp::v4(), 0});
+
+    auto receive_until = [&](std::uint64_t count) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+
+        while (server.get_stats().datagrams_received < count && std::chrono::steady_clock::now() < deadline) {
+            io.run_one_for(std::chrono::milliseconds{10});
+        }
+
+        // Give a reply time to be flushed.
+        io.run_for(std::chrono::milliseconds{20});
+    };
+
+    auto datagram = std::array<std::byte, sizeof(trellis::_detail::headers::type) + sizeof(trellis::_detail::headers::connect)>{};
+    auto type = trellis::_detail::headers::type::CONNECT;
+    auto header = trellis::_detail::headers::connect{std::uint16_t(trellis::config::datagram_size)};
+
+    std::memcpy(datagram.data(), &type, sizeof(type));
+    std::memcpy(datagram.data() + sizeof(type), &header, sizeof(header));
+
+    // Only the type arrives, so the header would have to come from whatever the buffer held before.
+    socket.send_to(asio::buffer(datagram.data(), sizeof(type)), server.get_endpoint());
+    receive_until(1);
+
+    REQUIRE(server.get_stats().datagrams_sent == 0);
+
+    socket.send_to(asio::buffer(datagram), server.get_endpoint());
+    receive_until(2);
+
+    REQUIRE(server.get_stats().datagrams_sent == 1);
+
+    server.stop();
+}
+
+TEST_CASE("Context only allocates datagram buffers up front when asked", "[context]") {
+    asio::io_context io;
+
+    auto lazy = trellis::server_context<channel_A>(io);
+    auto eager = trellis::server_context<channel_A>(io);
+
+    eager.reserve_datagram_buffers(1000);
+
+    REQUIRE(lazy.get_stats().datagram_buffers_allocated == 0);
+    REQUIRE(eager.get_stats().datagram_buffers_allocated >= 1000);
+    REQUIRE(eager.get_stats().datagram_buffers_free == eager.get_stats().datagram_buffers_allocated);
+}
+
+TEST_CASE("Context reassembles fragmented messages of any size", "[context]") {
+    static constexpr auto SIZES = std::array<std::size_t, 6>{1, 100, 1191, 1192, 5000, 100000};
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto pattern = [](std::size_t size, std::size_t i) {
+        return char((i * 31 + size) % 251);
+    };
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            for (auto size : SIZES) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&size), sizeof(size));
+                    for (auto i = std::size_t(0); i < size; ++i) {
+                        ostream.put(pattern(size, i));
+                    }
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    auto next = std::size_t(0);
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto size = std::size_t(0);
+            packet.read(reinterpret_cast<char*>(&size), sizeof(size));
+            REQUIRE(size == SIZES[next]);
+
+            auto data = std::vector<char>(size);
+            packet.read(data.data(), size);
+            REQUIRE(std::size_t(packet.gcount()) == size);
+
+            for (auto i = std::size_t(0); i < size; ++i) {
+                if (data[i] != pattern(size, i)) {
+                    FAIL("Mismatch at byte " << i << " of message " << next);
+                }
+            }
+
+            ++next;
+            if (next == SIZES.size()) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == SIZES.size());
+}
+
+TEST_CASE("Context message memory cap defers reliable messages", "[context]") {
+    constexpr auto SIZE = std::size_t(5000);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    client.set_message_memory_cap(0);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    // Lift the cap once some fragments have been refused, the resends should then get through.
+    auto lift = asio::steady_timer(io, std::chrono::milliseconds{200});
+    lift.async_wait([&](auto ec) {
+        REQUIRE(!ec);
+        REQUIRE(client.get_stats().message_allocations_rejected > 0);
+        client.set_message_memory_cap(std::numeric_limits<std::size_t>::max());
+    });
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                for (auto i = std::size_t(0); i < SIZE; ++i) {
+                    ostream.put(char(i));
+                }
+            });
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    auto received = false;
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto data = std::vector<char>(SIZE);
+            packet.read(data.data(), SIZE);
+            REQUIRE(std::size_t(packet.gcount()) == SIZE);
+
+            for (auto i = std::size_t(0); i < SIZE; ++i) {
+                if (data[i] != char(i)) {
+                    FAIL("Mismatch at byte " << i);
+                }
+            }
+
+            received = true;
+            REQUIRE(timeout.cancel() == 1);
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(received);
+
+    auto stats = client.get_stats();
+
+    REQUIRE(stats.message_bytes_in_use == 0);
+    REQUIRE(stats.message_bytes_high_water >= SIZE);
+    REQUIRE(stats.message_bytes_cached >= SIZE);
+}
+
+TEST_CASE("Context calls a direct handler on the networking thread", "[context]") {
+    constexpr auto COUNT = 1000;
+
+    using server_type = trellis::server_context<channel_A>;
+    using client_type = trellis::client_context<channel_A>;
+
+    asio::io_context io;
+
+    struct server_handler {
+        server_type* server = nullptr;
+
+        void on_connect(const server_type::connection_ptr& conn) {
+            REQUIRE(server->is_thread_current());
+        }
+
+        void on_disconnect(const server_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_type::connection_ptr& conn, std::istream& packet) {
+            REQUIRE(server->is_thread_current());
+
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+
+            // Echo the message straight back from inside the handler.
+            conn->template send<channel_A>([&](std::ostream& ostream) {
+                ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+            });
+        }
+    };
+
+    struct client_handler {
+        client_type* client = nullptr;
+        asio::steady_timer* timeout = nullptr;
+        int next = 0;
+
+        void on_connect(const client_type::connection_ptr& conn) {
+            REQUIRE(client->is_thread_current());
+
+            for (int i = 0; i < COUNT; ++i) {
+                conn->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        }
+
+        void on_disconnect(const client_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const client_type::connection_ptr& conn, std::istream& packet) {
+            REQUIRE(client->is_thread_current());
+
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout->cancel() == 1);
+            }
+        }
+    };
+
+    auto shandler = server_handler{};
+    auto chandler = client_handler{};
+
+    auto server = server_type(io, shandler);
+    auto client = client_type(io, chandler);
+
+    REQUIRE(server.is_direct());
+    REQUIRE(client.is_direct());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    shandler.server = &server;
+    chandler.client = &client;
+    chandler.timeout = &timeout;
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    io.run();
+
+    REQUIRE(chandler.next == COUNT);
+    REQUIRE(client.get_stats().event_queue_high_water == 0);
+}
+
+TEST_CASE("Context wakes a thread waiting for events", "[context]") {
+    constexpr auto COUNT = 100;
+
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+
+    auto io_thread = std::thread([&]{ io.run(); });
+
+    auto connected = false;
+    auto next = 0;
+
+    struct handler {
+        bool* connected;
+        int* next;
+
+        void on_connect(const trellis::client_context<channel_A>::connection_ptr& conn) {
+            *connected = true;
+        }
+
+        void on_disconnect(const trellis::client_context<channel_A>::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const trellis::client_context<channel_A>::connection_ptr& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == *next);
+            ++*next;
+        }
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+
+    while (next < COUNT && std::chrono::steady_clock::now() < deadline) {
+        if (client.wait_for_events(std::chrono::seconds{1})) {
+            client.poll_events(handler{&connected, &next});
+        }
+    }
+
+    REQUIRE(connected);
+    REQUIRE(next == COUNT);
+
+    // Nothing else is coming, so the wait should time out.
+    REQUIRE(!client.wait_for_events(std::chrono::milliseconds{20}));
+
+    server.stop();
+    client.stop();
+    work.reset();
+    io_thread.join();
+}
+
+TEST_CASE("Context stops receiving while a blocking event queue is full", "[context]") {
+    constexpr auto COUNT = 200;
+    constexpr auto CAPACITY = std::size_t(16);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.set_event_queue_policy(trellis::event_queue_policy::block);
+    server.set_event_queue_capacity(CAPACITY);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    int next = 0;
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    // The server's queue fills up before anyone polls it. Its networking thread is the one polling, so it must not wait for room.
+    auto delay = asio::steady_timer(io, std::chrono::milliseconds{200});
+    delay.async_wait([&](auto ec) {
+        REQUIRE(server.get_stats().event_queue_depth >= CAPACITY);
+        server_handler.poll();
+    });
+
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+
+    // Receiving only resumes once there is room, so at most one batch of datagrams can overshoot the capacity.
+    REQUIRE(server.get_stats().event_queue_high_water <= CAPACITY + trellis::config::receive_batch_size);
+    REQUIRE(server.get_stats().events_dropped == 0);
+}
+
+TEST_CASE("Context keeps every reliable message sent from several threads at once", "[context]") {
+    constexpr auto THREADS = 4;
+    constexpr auto COUNT = 500;
+
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto io_thread = std::thread([&]{ io.run(); });
+
+    using client_connection_ptr = trellis::client_context<channel_A>::connection_ptr;
+    using server_connection_ptr = trellis::server_context<channel_A>::connection_ptr;
+
+    struct client_handler {
+        client_connection_ptr* conn;
+
+        void on_connect(const client_connection_ptr& c) {
+            *conn = c;
+        }
+
+        void on_disconnect(const client_connection_ptr& c, asio::error_code ec) {}
+        void on_receive(channel_A, const client_connection_ptr& c, std::istream& packet) {}
+    };
+
+    struct server_handler {
+        std::array<int, THREADS>* next;
+        int* received;
+
+        void on_connect(const server_connection_ptr& c) {}
+        void on_disconnect(const server_connection_ptr& c, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_connection_ptr& c, std::istream& packet) {
+            int t, i;
+            packet.read(reinterpret_cast<char*>(&t), sizeof(t));
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+
+            // Each thread's messages are numbered in the order it sent them, so the channel delivers them in that order.
+            REQUIRE(i == (*next)[t]);
+            ++(*next)[t];
+            ++*received;
+        }
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+    auto conn = client_connection_ptr{};
+
+    while (!conn && std::chrono::steady_clock::now() < deadline) {
+        if (client.wait_for_events(std::chrono::milliseconds{100})) {
+            client.poll_events(client_handler{&conn});
+        }
+    }
+
+    REQUIRE(conn);
+
+    auto senders = std::vector<std::thread>{};
+
+    for (int t = 0; t < THREADS; ++t) {
+        senders.emplace_back([&, t] {
+            for (int i = 0; i < COUNT; ++i) {
+                conn->send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&t), sizeof(t));
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+
+                    // Some messages span several fragments.
+                    if (i % 16 == 0) {
+                        for (auto j = 0; j < 3000; ++j) {
+                            ostream.put(char(j));
+                        }
+                    }
+                });
+            }
+        });
+    }
+
+    auto next = std::array<int, THREADS>{};
+    auto received = 0;
+
+    while (received < THREADS * COUNT && std::chrono::steady_clock::now() < deadline) {
+        if (server.wait_for_events(std::chrono::milliseconds{100})) {
+            server.poll_events(server_handler{&next, &received});
+        }
+    }
+
+    for (auto& sender : senders) {
+        sender.join();
+    }
+
+    REQUIRE(received == THREADS * COUNT);
+
+    // Some acks may still be in flight, so stop the io_context rather than wait for the channels to drain.
+    conn.reset();
+    server.stop();
+    client.stop();
+    io.stop();
+    io_thread.join();
+}
+
+TEST_CASE("Context piggybacks acks on outgoing data", "[context]") {
+    constexpr auto COUNT = 50;
+
+    using server_type = trellis::server_context<channel_A>;
+    using client_type = trellis::client_context<channel_A>;
+
+    asio::io_context io;
+
+    struct server_handler {
+        void on_connect(const server_type::connection_ptr& conn) {}
+
+        void on_disconnect(const server_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_type::connection_ptr& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+
+            conn->template send<channel_A>([&](std::ostream& ostream) {
+                ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+            });
+        }
+    };
+
+    struct client_handler {
+        asio::steady_timer* timeout = nullptr;
+        asio::steady_timer* pace = nullptr;
+        int next = 0;
+
+        void on_connect(const client_type::connection_ptr& conn) {
+            send(conn);
+        }
+
+        void on_disconnect(const client_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const client_type::connection_ptr& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout->cancel() == 1);
+            } else {
+                // Wait out the delayed ack, so the server only saves a datagram by piggybacking its ack on the echo.
+                pace->expires_after(trellis::config::ack_delay * 2);
+                pace->async_wait([this, conn](asio::error_code ec) {
+                    if (!ec) send(conn);
+                });
+            }
+        }
+
+        void send(const client_type::connection_ptr& conn) {
+            conn->template send<channel_A>([&](std::ostream& ostream) {
+                ostream.write(reinterpret_cast<const char*>(&next), sizeof(next));
+            });
+        }
+    };
+
+    auto shandler = server_handler{};
+    auto chandler = client_handler{};
+
+    auto server = server_type(io, shandler);
+    auto client = client_type(io, chandler);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto pace = asio::steady_timer(io);
+
+    chandler.timeout = &timeout;
+    chandler.pace = &pace;
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    io.run();
+
+    REQUIRE(chandler.next == COUNT);
+
+    // Without piggybacking, the server would send a DATA_ACK for every message as well as the echo.
+    REQUIRE(server.get_stats().datagrams_sent < COUNT * 3 / 2);
+}
+
+TEST_CASE("Context bounds reliable channels with send and receive windows", "[context]") {
+    constexpr auto COUNT = 100;
+    constexpr auto SIZE = 2000;
+    constexpr auto SEND_WINDOW = 8;
+    constexpr auto RECEIVE_WINDOW = 4;
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    // The receive window is smaller than the send window, so the client has to turn some messages away.
+    server.set_channel_window<channel_A>(SEND_WINDOW, RECEIVE_WINDOW);
+    client.set_channel_window<channel_A>(SEND_WINDOW, RECEIVE_WINDOW);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto server_conn = trellis::server_context<channel_A>::connection_ptr{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            server_conn = conn_ptr;
+
+            for (int i = 0; i < COUNT; ++i) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    auto payload = std::vector<int>(SIZE / sizeof(int), i);
+                    ostream.write(reinterpret_cast<const char*>(payload.data()), SIZE);
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    int next = 0;
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+
+            auto client_stats = conn->get_stats()[0];
+
+            REQUIRE(client_stats.num_awaiting <= RECEIVE_WINDOW);
+            REQUIRE(client_stats.receive_buffer_bytes <= RECEIVE_WINDOW * 2 * trellis::config::datagram_size);
+
+            if (next == 0) {
+                // Everything was queued before the first message arrived, so most of it is still waiting for the window.
+                auto server_stats = server_conn->get_stats()[0];
+
+                REQUIRE(server_stats.num_blocked > 0);
+                REQUIRE(server_stats.outgoing_queue_size <= SEND_WINDOW * 2);
+                REQUIRE(server_stats.send_buffer_bytes >= std::uint64_t(server_stats.num_blocked) * trellis::config::datagram_size);
+            }
+
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+}
+
+TEST_CASE("Context notifies a handler when a full send window has room", "[context]") {
+    constexpr auto COUNT = 40;
+    constexpr auto SEND_WINDOW = 4;
+
+    using server_type = trellis::server_context<channel_A>;
+    using client_type = trellis::client_context<channel_A>;
+
+    asio::io_context io;
+
+    struct server_handler {
+        server_type::connection_ptr conn;
+        int sent = 0;
+        int refused = 0;
+        int writable = 0;
+
+        void on_connect(const server_type::connection_ptr& conn) {
+            this->conn = conn;
+            send_some();
+        }
+
+        void on_disconnect(const server_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_type::connection_ptr& conn, std::istream& packet) {}
+
+        void on_writable(channel_A, const server_type::connection_ptr& conn) {
+            ++writable;
+            send_some();
+        }
+
+        void send_some() {
+            while (sent < COUNT) {
+                auto status = conn->template try_send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&sent), sizeof(sent));
+                });
+
+                if (status == trellis::send_status::window_full) {
+                    ++refused;
+                    break;
+                }
+
+                REQUIRE(status == trellis::send_status::queued);
+                ++sent;
+
+                REQUIRE(conn->get_stats()[0].num_blocked == 0);
+            }
+        }
+    };
+
+    struct client_handler {
+        asio::steady_timer* timeout = nullptr;
+        int next = 0;
+
+        void on_connect(const client_type::connection_ptr& conn) {}
+
+        void on_disconnect(const client_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const client_type::connection_ptr& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next);
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout->cancel() == 1);
+            }
+        }
+    };
+
+    auto shandler = server_handler{};
+    auto chandler = client_handler{};
+
+    auto server = server_type(io, shandler);
+    auto client = client_type(io, chandler);
+
+    server.set_channel_window<channel_A>(SEND_WINDOW, trellis::config::reliable_receive_window);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    chandler.timeout = &timeout;
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    io.run();
+
+    REQUIRE(chandler.next == COUNT);
+    REQUIRE(shandler.refused > 0);
+    REQUIRE(shandler.writable == shandler.refused);
+
+    // Stopping the server closed the connection.
+    REQUIRE(shandler.conn->try_send<channel_A>([](std::ostream&) { FAIL(); }) == trellis::send_status::connection_closed);
+}
+
+TEST_CASE("Context never lets concurrent try_sends past the send window", "[context]") {
+    constexpr auto THREADS = 8;
+    constexpr auto ATTEMPTS = 50;
+    constexpr auto SEND_WINDOW = 4;
+
+    using channel_B = trellis::channel_type_reliable_unordered<struct B>;
+
+    using server_type = trellis::server_context<channel_A, channel_B>;
+    using client_type = trellis::client_context<channel_A, channel_B>;
+
+    asio::io_context io;
+
+    struct server_handler {
+        std::atomic<int> queued = 0;
+
+        void on_connect(const server_type::connection_ptr& conn) {
+            // A refused message gives its slot back.
+            auto too_large = std::vector<std::byte>(server_type::connection_type::max_message_fragments * conn->get_datagram_size());
+            REQUIRE(conn->template try_send<channel_A>(asio::buffer(too_large)) == trellis::send_status::invalid_size);
+
+            // So do an empty stream and a callback that throws before writing anything.
+            REQUIRE(conn->template try_send<channel_A>([](std::ostream&) {}) == trellis::send_status::invalid_size);
+            REQUIRE_THROWS(conn->template try_send<channel_A>([](std::ostream&) { throw std::runtime_error("refused"); }));
+
+            // A try_send nested in another one's callback only takes its own slot.
+            auto status = conn->template try_send<channel_A>([&](std::ostream& ostream) {
+                REQUIRE(conn->template try_send<channel_B>([](std::ostream& ostream) { ostream.put('b'); }) == trellis::send_status::queued);
+
+                auto i = -1;
+                ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+            });
+
+            REQUIRE(status == trellis::send_status::queued);
+            ++queued;
+
+            // The networking thread is busy here, so no acks can open the window while the threads race.
+            auto threads = std::vector<std::thread>{};
+
+            for (auto t = 0; t < THREADS; ++t) {
+                threads.emplace_back([&] {
+                    for (auto i = 0; i < ATTEMPTS; ++i) {
+                        auto status = conn->template try_send<channel_A>([&](std::ostream& ostream) {
+                            ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                        });
+
+                        if (status == trellis::send_status::queued) {
+                            ++queued;
+                        } else {
+                            REQUIRE(status == trellis::send_status::window_full);
+                        }
+                    }
+                });
+            }
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }
+
+        void on_disconnect(const server_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_type::connection_ptr& conn, std::istream& packet) {}
+
+        void on_receive(channel_B, const server_type::connection_ptr& conn, std::istream& packet) {}
+
+        void on_writable(channel_A, const server_type::connection_ptr& conn) {}
+
+        void on_writable(channel_B, const server_type::connection_ptr& conn) {}
+    };
+
+    struct client_handler {
+        asio::steady_timer* timeout = nullptr;
+        int received = 0;
+
+        void on_connect(const client_type::connection_ptr& conn) {}
+
+        void on_disconnect(const client_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const client_type::connection_ptr& conn, std::istream& packet) {
+            ++received;
+            if (received == SEND_WINDOW) {
+                REQUIRE(timeout->cancel() == 1);
+            }
+        }
+
+        void on_receive(channel_B, const client_type::connection_ptr& conn, std::istream& packet) {}
+    };
+
+    auto shandler = server_handler{};
+    auto chandler = client_handler{};
+
+    auto server = server_type(io, shandler);
+    auto client = client_type(io, chandler);
+
+    server.set_channel_window<channel_A>(SEND_WINDOW, trellis::config::reliable_receive_window);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    chandler.timeout = &timeout;
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    io.run();
+
+    REQUIRE(shandler.queued == SEND_WINDOW);
+    REQUIRE(chandler.received == SEND_WINDOW);
+}
+
+TEST_CASE("Context aggregates small messages to the same peer", "[context]") {
+    constexpr auto FRAMES = 50;
+    constexpr auto MESSAGES_PER_FRAME = 6;
+
+    using channel_B = trellis::channel_type_reliable_unordered<struct B>;
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A, channel_B>(io);
+    auto client = trellis::client_context<channel_A, channel_B>(io);
+
+    // Only the sender has to opt in.
+    client.set_message_aggregation(true);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    int next_a = 0;
+    int received_b = 0;
+
+    auto check_done = [&] {
+        if (next_a + received_b == FRAMES * MESSAGES_PER_FRAME) {
+            REQUIRE(timeout.cancel() == 1);
+        }
+    };
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next_a);
+            ++next_a;
+            check_done();
+        },
+        [&](channel_B, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i >= 0);
+            ++received_b;
+            check_done();
+        },
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            // Several small messages per frame on different channels, like a game client would send.
+            for (int frame = 0; frame < FRAMES; ++frame) {
+                for (int m = 0; m < MESSAGES_PER_FRAME / 2; ++m) {
+                    auto i = frame * MESSAGES_PER_FRAME / 2 + m;
+
+                    conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                        ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                    });
+
+                    conn_ptr->template send<channel_B>([&](std::ostream& ostream) {
+                        ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                    });
+                }
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+        [&](channel_B, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next_a == FRAMES * MESSAGES_PER_FRAME / 2);
+    REQUIRE(received_b == FRAMES * MESSAGES_PER_FRAME / 2);
+
+    auto stats = client.get_stats();
+
+    REQUIRE(stats.datagrams_aggregated > 0);
+    REQUIRE(stats.datagrams_sent < FRAMES * MESSAGES_PER_FRAME);
+
+    // The server didn't opt in, so it never aggregates its acks.
+    REQUIRE(server.get_stats().datagrams_aggregated == 0);
+}
+
+TEST_CASE("Context aggregates up to the datagram size the connection agreed on", "[context]") {
+    // Two of these only fit in one aggregate when datagrams are larger than config::datagram_size.
+    constexpr auto SIZE = std::size_t(700);
+    constexpr auto COUNT = 20;
+
+    static_assert(2 * SIZE > trellis::config::datagram_size);
+    static_assert(2 * (SIZE + 32) < trellis::config::max_datagram_size);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.set_datagram_size(trellis::config::max_datagram_size);
+    client.set_datagram_size(trellis::config::max_datagram_size);
+    client.set_message_aggregation(true);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    int next = 0;
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto data = std::vector<char>(SIZE + 1);
+
+            packet.read(data.data(), data.size());
+            REQUIRE(std::size_t(packet.gcount()) == SIZE);
+            REQUIRE(data[0] == char(next));
+
+            ++next;
+            if (next == COUNT) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            REQUIRE(conn_ptr->get_datagram_size() == trellis::config::max_datagram_size);
+
+            for (int i = 0; i < COUNT; ++i) {
+                auto data = std::vector<char>(SIZE, char(i));
+                conn_ptr->template send<channel_A>(std::as_bytes(std::span(data)));
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == COUNT);
+    REQUIRE(client.get_stats().datagrams_aggregated > 0);
+}
+
+TEST_CASE("Context keeps a connection's datagrams in order around ones too large to aggregate", "[context]") {
+    constexpr auto FRAMES = 20;
+
+    using channel_S = trellis::channel_type_unreliable_sequenced<struct S>;
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_S>(io);
+    auto client = trellis::client_context<channel_S>(io);
+
+    client.set_message_aggregation(true);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto received = std::vector<int>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_S, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            received.push_back(i);
+            if (i == FRAMES * 3 - 1) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            // Small, full-size, small. The second small message must not be packed in front of the full-size one.
+            for (int i = 0; i < FRAMES * 3; ++i) {
+                conn_ptr->template send<channel_S>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+
+                    if (i % 3 == 1) {
+                        for (auto j = sizeof(i); j < trellis::config::datagram_size - trellis::_detail::headers::data_offset; ++j) {
+                            ostream.put(char(j));
+                        }
+                    }
+                });
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_S, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    // A sequenced channel drops anything older than what it has already delivered, so any reordering loses messages.
+    REQUIRE(received.size() == FRAMES * 3);
+    REQUIRE(std::is_sorted(received.begin(), received.end()));
+    REQUIRE(client.get_stats().datagrams_aggregated > 0);
+}
+
+TEST_CASE("Context sends messages straight from spans and buffer sequences", "[context]") {
+    static constexpr auto SIZES = std::array<std::size_t, 5>{16, 1191, 1192, 5000, 65536};
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto pattern = [](std::size_t size, std::size_t i) {
+        return char((i * 31 + size) % 251);
+    };
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            // Messages that are empty or don't fit in the fragment limit are refused without sending anything.
+            using connection_type = trellis::server_context<channel_A>::connection_type;
+            auto too_large = std::vector<std::byte>(connection_type::max_message_fragments * conn_ptr->get_datagram_size());
+
+            REQUIRE(!conn_ptr->template send<channel_A>(std::span<const std::byte>{}));
+            REQUIRE(!conn_ptr->template send<channel_A>(std::span<const std::byte>(too_large)));
+            REQUIRE(conn_ptr->template try_send<channel_A>(asio::buffer(too_large)) == trellis::send_status::invalid_size);
+
+            for (auto size : SIZES) {
+                auto data = std::vector<char>(size);
+
+                for (auto i = std::size_t(0); i < size; ++i) {
+                    data[i] = pattern(size, i);
+                }
+
+                // Once as a span, and once gathered from three pieces.
+                conn_ptr->template send<channel_A>(std::as_bytes(std::span(data)));
+
+                auto third = size / 3;
+                auto pieces = std::array<asio::const_buffer, 3>{
+                    asio::buffer(data.data(), third),
+                    asio::buffer(data.data() + third, third),
+                    asio::buffer(data.data() + 2 * third, size - 2 * third),
+                };
+
+                conn_ptr->template send<channel_A>(pieces);
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    auto next = std::size_t(0);
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto size = SIZES[next / 2];
+            auto data = std::vector<char>(size);
+
+            // Messages arrive at exactly the size they were sent with, even when the last fragment is full.
+            packet.read(data.data(), data.size());
+            REQUIRE(std::size_t(packet.gcount()) == size);
+            REQUIRE(packet.peek() == std::char_traits<char>::eof());
+
+            for (auto i = std::size_t(0); i < size; ++i) {
+                if (data[i] != pattern(size, i)) {
+                    FAIL("Mismatch at byte " << i << " of message " << next);
+                }
+            }
+
+            ++next;
+            if (next == SIZES.size() * 2) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(next == SIZES.size() * 2);
+}
+
+TEST_CASE("Context agrees on the smaller datagram size during the handshake", "[context]") {
+    static constexpr auto SIZE = std::size_t(5000);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.set_datagram_size(1400);
+    client.set_datagram_size(trellis::config::max_datagram_size);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto received = false;
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            REQUIRE(conn_ptr->get_datagram_size() == 1400);
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto data = std::vector<char>(SIZE + 1);
+
+            packet.read(data.data(), data.size());
+            REQUIRE(std::size_t(packet.gcount()) == SIZE);
+
+            for (auto i = std::size_t(0); i < SIZE; ++i) {
+                if (data[i] != char(i % 251)) {
+                    FAIL("Mismatch at byte " << i);
+                }
+            }
+
+            received = true;
+            REQUIRE(timeout.cancel() == 1);
+        },
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            REQUIRE(conn_ptr->get_datagram_size() == 1400);
+
+            conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                for (auto i = std::size_t(0); i < SIZE; ++i) {
+                    ostream.put(char(i % 251));
+                }
+            });
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    REQUIRE(received);
+}
+
+TEST_CASE("Path MTU probing raises the datagram size once a probe gets through", "[context]") {
+    static constexpr auto SIZE = std::size_t(5000);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto client = trellis::client_context<channel_A>(io);
+
+    server.set_datagram_size(trellis::config::max_datagram_size);
+    client.set_datagram_size(trellis::config::max_datagram_size);
+    client.set_mtu_probing(true);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    client.connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        client.stop();
+        io.stop();
+    });
+
+    auto received = false;
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            // The server didn't opt in, so it uses the agreed size right away.
+            REQUIRE(conn_ptr->get_datagram_size() == trellis::config::max_datagram_size);
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            auto data = std::vector<char>(SIZE + 1);
+
+            packet.read(data.data(), data.size());
+            REQUIRE(std::size_t(packet.gcount()) == SIZE);
+
+            for (auto i = std::size_t(0); i < SIZE; ++i) {
+                if (data[i] != char(i % 251)) {
+                    FAIL("Mismatch at byte " << i);
+                }
+            }
+
+            received = true;
+            REQUIRE(timeout.cancel() == 1);
+        },
+    };
+
+    auto client_conn = trellis::client_context<channel_A>::connection_ptr{};
+    auto poll = asio::steady_timer(io);
+
+    std::function<void()> wait_for_probe = [&] {
+        poll.expires_after(std::chrono::milliseconds{1});
+        poll.async_wait([&](auto ec) {
+            if (ec) return;
+
+            // Loopback carries anything, so the very first probe at the agreed size gets through.
+            if (client_conn->get_datagram_size() != trellis::config::max_datagram_size) {
+                wait_for_probe();
+                return;
+            }
+
+            client_conn->template send<channel_A>([&](std::ostream& ostream) {
+                for (auto i = std::size_t(0); i < SIZE; ++i) {
+                    ostream.put(char(i % 251));
+                }
+            });
+        });
+    };
+
+    auto client_handler = context_handler{
+        client,
+        [&](const auto& conn_ptr) {
+            // Probing starts at config::datagram_size, but on loopback the probe may well be acked before this runs.
+            REQUIRE(conn_ptr->get_datagram_size() >= trellis::config::datagram_size);
+
+            client_conn = conn_ptr;
+            wait_for_probe();
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    server_handler.poll();
+    client_handler.poll();
+    io.run();
+
+    poll.cancel();
+    client_conn.reset();
+
+    REQUIRE(received);
+}
+
+#ifdef __linux__
+TEST_CASE("Path MTU probing sets the DF bit on the socket", "[context]") {
+    // The socket is internal to the context, so find it by the port it was bound to.
+    auto find_socket = [](unsigned short port) {
+        for (auto fd = 0; fd < 1024; ++fd) {
+            auto addr = sockaddr_in{};
+            auto len = socklen_t(sizeof(addr));
+
+            if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0 && addr.sin_family == AF_INET && ntohs(addr.sin_port) == port) {
+                return fd;
+            }
+        }
+
+        return -1;
+    };
+
+    auto mtu_discover = [](int fd) {
+        auto value = -1;
+        auto len = socklen_t(sizeof(value));
+
+        REQUIRE(getsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, &len) == 0);
+
+        return value;
+    };
+
+    asio::io_context io;
+
+    auto probing = trellis::server_context<channel_A>(io);
+    auto plain = trellis::server_context<channel_A>(io);
+
+    probing.set_mtu_probing(true);
+
+    probing.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    plain.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    auto probing_fd = find_socket(probing.get_endpoint().port());
+    auto plain_fd = find_socket(plain.get_endpoint().port());
+
+    REQUIRE(probing_fd != -1);
+    REQUIRE(plain_fd != -1);
+
+    // Without DF, an oversized probe would be fragmented and acknowledged anyway.
+    REQUIRE(mtu_discover(probing_fd) == IP_PMTUDISC_PROBE);
+    REQUIRE(mtu_discover(plain_fd) != IP_PMTUDISC_PROBE);
+
+    probing.stop();
+    plain.stop();
+}
+#endif
+
+TEST_CASE("Server broadcasts one serialized message to many connections", "[context]") {
+    static constexpr auto CLIENTS = std::size_t(4);
+    static constexpr auto SIZE = std::size_t(3000);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto clients = std::vector<std::unique_ptr<trellis::client_context<channel_A>>>{};
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    for (auto i = std::size_t(0); i < CLIENTS; ++i) {
+        clients.push_back(std::make_unique<trellis::client_context<channel_A>>(io));
+        clients.back()->connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+    }
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        for (auto& client : clients) {
+            client->stop();
+        }
+        io.stop();
+    });
+
+    auto serializations = 0;
+    auto conns = std::vector<trellis::server_context<channel_A>::connection_ptr>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            conns.push_back(conn_ptr);
+
+            if (conns.size() == CLIENTS) {
+                // A message too large for the connections goes to none of them.
+                auto too_large = conns.front()->get_max_message_size() + 1;
+
+                REQUIRE(!server.broadcast<channel_A>(conns, [&](std::ostream& ostream) {
+                    for (auto i = std::size_t(0); i < too_large; ++i) {
+                        ostream.put(0);
+                    }
+                }));
+                REQUIRE(!server.broadcast<channel_A>(conns, std::span<const std::byte>{}));
+
+                REQUIRE(server.broadcast<channel_A>(conns, [&](std::ostream& ostream) {
+                    ++serializations;
+                    for (auto i = std::size_t(0); i < SIZE; ++i) {
+                        ostream.put(char(i % 127));
+                    }
+                }));
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    auto received = std::size_t(0);
+
+    auto on_receive = [&](channel_A, const auto& conn, std::istream& packet) {
+        auto data = std::vector<char>(SIZE);
+
+        packet.read(data.data(), data.size());
+        REQUIRE(std::size_t(packet.gcount()) == SIZE);
+
+        for (auto i = std::size_t(0); i < SIZE; ++i) {
+            REQUIRE(data[i] == char(i % 127));
+        }
+
+        ++received;
+        if (received == CLIENTS) {
+            REQUIRE(timeout.cancel() == 1);
+        }
+    };
+
+    using client_type = trellis::client_context<channel_A>;
+    using client_handler_type = context_handler<
+        client_type,
+        std::function<void(const client_type::connection_ptr&)>,
+        std::function<void(const client_type::connection_ptr&, asio::error_code)>,
+        std::function<void(channel_A, const client_type::connection_ptr&, std::istream&)>>;
+
+    auto client_handlers = std::vector<std::unique_ptr<client_handler_type>>{};
+
+    for (auto& client : clients) {
+        client_handlers.push_back(std::make_unique<client_handler_type>(
+            *client,
+            [&](const auto& conn_ptr) {},
+            [&](const auto& conn, asio::error_code ec) {},
+            on_receive));
+    }
+
+    server_handler.poll();
+    for (auto& handler : client_handlers) {
+        handler->poll();
+    }
+    io.run();
+
+    REQUIRE(received == CLIENTS);
+    REQUIRE(serializations == 1);
+}
+
+TEST_CASE("Server broadcasts shared fragments on unreliable channels", "[context]") {
+    static constexpr auto CLIENTS = std::size_t(4);
+    static constexpr auto SIZE = std::size_t(3000);
+    static constexpr auto SMALL_SIZE = std::size_t(16);
+
+    using channel_U = trellis::channel_type_unreliable_unordered<struct U>;
+    using server_type = trellis::server_context<channel_A, channel_U>;
+    using client_type = trellis::client_context<channel_A, channel_U>;
+
+    asio::io_context io;
+
+    auto server = server_type(io);
+    auto clients = std::vector<std::unique_ptr<client_type>>{};
+
+    // Aggregation and piggybacked acks both have to pull the shared bodies into datagrams of their own.
+    server.set_message_aggregation(true);
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    for (auto i = std::size_t(0); i < CLIENTS; ++i) {
+        clients.push_back(std::make_unique<client_type>(io));
+        clients.back()->connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+    }
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        for (auto& client : clients) {
+            client->stop();
+        }
+        io.stop();
+    });
+
+    auto conns = std::vector<server_type::connection_ptr>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {},
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            // The acks for this message are still pending, so they get piggybacked on the broadcast.
+            conns.push_back(conn);
+
+            if (conns.size() == CLIENTS) {
+                REQUIRE(server.broadcast<channel_U>(conns, [&](std::ostream& ostream) {
+                    for (auto i = std::size_t(0); i < SIZE; ++i) {
+                        ostream.put(char(i % 127));
+                    }
+                }));
+
+                auto small = std::array<std::byte, SMALL_SIZE>{};
+                std::fill(small.begin(), small.end(), std::byte{42});
+
+                REQUIRE(server.broadcast<channel_U>(conns, std::span<const std::byte>(small)));
+            }
+        },
+        [&](channel_U, const auto& conn, std::istream& packet) {},
+    };
+
+    auto received = std::size_t(0);
+    auto received_small = std::size_t(0);
+
+    using client_handler_type = context_handler<
+        client_type,
+        std::function<void(const client_type::connection_ptr&)>,
+        std::function<void(const client_type::connection_ptr&, asio::error_code)>,
+        std::function<void(channel_A, const client_type::connection_ptr&, std::istream&)>,
+        std::function<void(channel_U, const client_type::connection_ptr&, std::istream&)>>;
+
+    auto client_handlers = std::vector<std::unique_ptr<client_handler_type>>{};
+
+    for (auto& client : clients) {
+        client_handlers.push_back(std::make_unique<client_handler_type>(
+            *client,
+            [&](const auto& conn_ptr) {
+                conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.put('x');
+                });
+            },
+            [&](const auto& conn, asio::error_code ec) {},
+            [&](channel_A, const auto& conn, std::istream& packet) {},
+            [&](channel_U, const auto& conn, std::istream& packet) {
+                auto data = std::vector<char>(SIZE + 1);
+
+                packet.read(data.data(), data.size());
+                auto size = std::size_t(packet.gcount());
+
+                if (size == SMALL_SIZE) {
+                    REQUIRE(std::all_of(data.begin(), data.begin() + SMALL_SIZE, [](char c) { return c == 42; }));
+                    ++received_small;
+                } else {
+                    REQUIRE(size == SIZE);
+
+                    for (auto i = std::size_t(0); i < SIZE; ++i) {
+                        REQUIRE(data[i] == char(i % 127));
+                    }
+
+                    ++received;
+                }
+
+                if (received == CLIENTS && received_small == CLIENTS) {
+                    REQUIRE(timeout.cancel() == 1);
+                }
+            }));
+    }
+
+    server_handler.poll();
+    for (auto& handler : client_handlers) {
+        handler->poll();
+    }
+    io.run();
+
+    REQUIRE(received == CLIENTS);
+    REQUIRE(received_small == CLIENTS);
+}
+
+TEST_CASE("Server resends shared broadcast fragments on reliable channels", "[context]") {
+    static constexpr auto CLIENTS = std::size_t(4);
+    static constexpr auto COUNT = 20;
+    static constexpr auto SIZE = std::size_t(3000);
+
+    asio::io_context io;
+
+    auto server = trellis::server_context<channel_A>(io);
+    auto proxy = trellis::proxy_context(io);
+    auto clients = std::vector<std::unique_ptr<trellis::client_context<channel_A>>>{};
+
+    server.set_message_aggregation(true);
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+    proxy.listen({asio::ip::make_address_v4("127.0.0.1"), 0}, server.get_endpoint());
+
+    for (auto i = std::size_t(0); i < CLIENTS; ++i) {
+        clients.push_back(std::make_unique<trellis::client_context<channel_A>>(io));
+        clients.back()->connect({asio::ip::udp::v4(), 0}, proxy.get_endpoint());
+    }
+
+    // Lost fragments are resent from the same bodies the other connections share.
+    proxy.set_client_drop_rate(0.25);
+    proxy.set_server_drop_rate(0.25);
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        for (auto& client : clients) {
+            client->stop();
+        }
+        proxy.stop();
+        io.stop();
+    });
+
+    auto conns = std::vector<trellis::server_context<channel_A>::connection_ptr>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            conns.push_back(conn_ptr);
+
+            if (conns.size() == CLIENTS) {
+                for (auto n = 0; n < COUNT; ++n) {
+                    REQUIRE(server.broadcast<channel_A>(conns, [&](std::ostream& ostream) {
+                        for (auto i = std::size_t(0); i < SIZE; ++i) {
+                            ostream.put(char((i + n) % 127));
+                        }
+                    }));
+                }
+            }
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {},
+    };
+
+    auto finished = std::size_t(0);
+
+    using client_type = trellis::client_context<channel_A>;
+    using client_handler_type = context_handler<
+        client_type,
+        std::function<void(const client_type::connection_ptr&)>,
+        std::function<void(const client_type::connection_ptr&, asio::error_code)>,
+        std::function<void(channel_A, const client_type::connection_ptr&, std::istream&)>>;
+
+    auto client_handlers = std::vector<std::unique_ptr<client_handler_type>>{};
+    auto next = std::vector<int>(CLIENTS);
+
+    for (auto c = std::size_t(0); c < CLIENTS; ++c) {
+        client_handlers.push_back(std::make_unique<client_handler_type>(
+            *clients[c],
+            [&](const auto& conn_ptr) {},
+            [&](const auto& conn, asio::error_code ec) {},
+            [&, c](channel_A, const auto& conn, std::istream& packet) {
+                auto data = std::vector<char>(SIZE + 1);
+
+                packet.read(data.data(), data.size());
+                REQUIRE(std::size_t(packet.gcount()) == SIZE);
+
+                for (auto i = std::size_t(0); i < SIZE; ++i) {
+                    REQUIRE(data[i] == char((i + next[c]) % 127));
+                }
+
+                ++next[c];
+                if (next[c] == COUNT) {
+                    ++finished;
+                    if (finished == CLIENTS) {
+                        REQUIRE(timeout.cancel() == 1);
+                    }
+                }
+            }));
+    }
+
+    server_handler.poll();
+    for (auto& handler : client_handlers) {
+        handler->poll();
+    }
+    io.run();
+
+    REQUIRE(finished == CLIENTS);
+}
@@ -39,7 +39,6 @@ public:
     context_handler(context_type& context, on_connect_type on_connect, on_disconnect_type on_disconnect, OnReceives... on_receives) :
         channel_handler<context_type, Channels, OnReceives>(std::move(on_receives))...,
         context(&context),
-        timer(context.get_io()),
         on_connect_func(std::move(on_connect)),
         on_disconnect_func(std::move(on_disconnect)) {}
     
@@ -52,8 +51,7 @@ public:
     }
 
     void poll() {
-        timer.expires_from_now(std::chrono::milliseconds{10});
-        timer.async_wait([&](asio::error_code ec) {
+        context->async_wait_events([&](asio::error_code ec) {
             if (ec || !context->is_running()) return;
             context->poll_events(*this);
             poll();
@@ -62,7 +60,6 @@ public:
 
 private:
     context_type* context;
-    asio::steady_timer timer;
     on_connect_type on_connect_func;
     on_disconnect_type on_disconnect_func;
 };
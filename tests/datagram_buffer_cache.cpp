@@ -0,0 +1,133 @@
+#include "catch.hpp"
+
+#include <trellis/datagram.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using trellis::_detail::datagram_buffer_cache;
+using trellis::_detail::datagram_buffer_depot;
+using trellis::_detail::shared_datagram_buffer;
+
+TEST_CASE("Datagram buffer cache reuses freed buffers", "[datagram_buffer_cache]") {
+    auto cache = datagram_buffer_cache{};
+
+    auto a = cache.make_pending_buffer();
+    auto ptr = a.data();
+
+    auto stats = cache.get_stats();
+    REQUIRE(stats.allocated == datagram_buffer_depot::buffers_per_slab);
+    REQUIRE(stats.in_flight == 1);
+    REQUIRE(stats.free == stats.allocated - 1);
+
+    a = {};
+
+    auto b = cache.make_pending_buffer();
+    REQUIRE(b.data() == ptr);
+
+    stats = cache.get_stats();
+    REQUIRE(stats.allocated == datagram_buffer_depot::buffers_per_slab);
+    REQUIRE(stats.in_flight == 1);
+}
+
+TEST_CASE("Datagram buffer cache trades chains with the depot", "[datagram_buffer_cache]") {
+    constexpr auto COUNT = datagram_buffer_depot::buffers_per_slab * 2 + 1;
+
+    auto cache = datagram_buffer_cache{};
+    auto buffers = std::vector<shared_datagram_buffer>{};
+
+    for (auto i = std::size_t(0); i < COUNT; ++i) {
+        buffers.push_back(cache.make_pending_buffer());
+    }
+
+    auto allocated = datagram_buffer_depot::buffers_per_slab * 3;
+
+    REQUIRE(cache.get_stats().allocated == allocated);
+    REQUIRE(cache.get_stats().in_flight == COUNT);
+
+    buffers.clear();
+
+    auto stats = cache.get_stats();
+    REQUIRE(stats.allocated == allocated);
+    REQUIRE(stats.in_flight == 0);
+    REQUIRE(stats.free == allocated);
+
+    // Everything freed went back to the depot or the magazine, so nothing new is allocated.
+    for (auto i = std::size_t(0); i < COUNT; ++i) {
+        buffers.push_back(cache.make_pending_buffer());
+    }
+
+    REQUIRE(cache.get_stats().allocated == allocated);
+}
+
+TEST_CASE("Datagram buffer cache hands buffers between threads", "[datagram_buffer_cache]") {
+    constexpr auto THREADS = 4;
+    constexpr auto ROUNDS = 20000;
+
+    auto cache = datagram_buffer_cache{};
+    auto corrupted = std::atomic<bool>(false);
+
+    {
+        auto threads = std::vector<std::thread>{};
+
+        // Each thread frees most of its buffers on another thread, like a user thread sending and the networking thread releasing acked fragments.
+        for (auto t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&, t] {
+                auto held = std::vector<shared_datagram_buffer>{};
+
+                for (auto i = 0; i < ROUNDS; ++i) {
+                    auto buffer = cache.make_pending_buffer();
+                    buffer[0] = char(t);
+                    buffer[1] = char(i);
+
+                    held.push_back(buffer);
+
+                    if (held.size() == 64) {
+                        auto batch = std::move(held);
+                        held = {};
+
+                        std::thread([&, batch = std::move(batch), t]() mutable {
+                            for (auto& b : batch) {
+                                if (b[0] != char(t)) {
+                                    corrupted = true;
+                                }
+                            }
+                            batch.clear();
+                        }).join();
+                    }
+                }
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    REQUIRE(!corrupted);
+
+    auto stats = cache.get_stats();
+    REQUIRE(stats.in_flight == 0);
+    REQUIRE(stats.free == stats.allocated);
+}
+
+TEST_CASE("Datagram buffer cache carves aligned buffers out of prewarmed slabs", "[datagram_buffer_cache]") {
+    auto cache = datagram_buffer_cache{datagram_buffer_depot::buffers_per_slab + 1};
+
+    REQUIRE(cache.get_stats().allocated == datagram_buffer_depot::buffers_per_slab * 2);
+    REQUIRE(cache.get_stats().in_flight == 0);
+
+    auto a = cache.make_pending_buffer();
+    auto b = cache.make_pending_buffer();
+
+    REQUIRE(reinterpret_cast<std::uintptr_t>(a.data()) % 64 == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(b.data()) % 64 == 0);
+
+    // Buffers of one chain are neighbors in their slab.
+    auto distance = a.data() < b.data() ? b.data() - a.data() : a.data() - b.data();
+    REQUIRE(std::size_t(distance) == sizeof(trellis::_detail::datagram_buffer));
+
+    REQUIRE(cache.get_stats().allocated == datagram_buffer_depot::buffers_per_slab * 2);
+}
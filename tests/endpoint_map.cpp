@@ -0,0 +1,85 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/endpoint_map.hpp>
+
+#include <map>
+#include <random>
+
+TEST_CASE("Endpoint map matches std::map under random inserts and erases", "[endpoint_map]") {
+    constexpr auto COUNT = 10000;
+
+    using endpoint = asio::ip::udp::endpoint;
+
+    auto rng = std::mt19937{};
+    auto random_endpoint = [&] {
+        switch (rng() % 3) {
+            case 0:
+                return endpoint(asio::ip::address_v4(rng() % 64), std::uint16_t(rng() % 64));
+            case 1:
+                // The same addresses again, in IPv4-mapped form.
+                return endpoint(asio::ip::make_address_v6(asio::ip::v4_mapped, asio::ip::address_v4(rng() % 64)), std::uint16_t(rng() % 64));
+            default: {
+                auto bytes = asio::ip::address_v6::bytes_type{};
+                bytes[15] = std::uint8_t(rng() % 64);
+                return endpoint(asio::ip::address_v6(bytes), std::uint16_t(rng() % 64));
+            }
+        }
+    };
+
+    auto map = trellis::_detail::endpoint_map<int>{};
+    auto reference = std::map<endpoint, int>{};
+
+    for (int i = 0; i < COUNT; ++i) {
+        auto ep = random_endpoint();
+
+        if (rng() % 3 == 0) {
+            REQUIRE(map.erase(ep) == reference.erase(ep));
+        } else {
+            auto [iter, success] = map.emplace(ep, i);
+            auto [ref_iter, ref_success] = reference.emplace(ep, i);
+
+            REQUIRE(success == ref_success);
+            REQUIRE(iter->first == ep);
+            REQUIRE(iter->second == ref_iter->second);
+        }
+
+        REQUIRE(map.size() == reference.size());
+    }
+
+    for (auto& [ep, value] : reference) {
+        auto iter = map.find(ep);
+        REQUIRE(iter != map.end());
+        REQUIRE(iter->second == value);
+    }
+
+    auto visited = std::size_t(0);
+
+    for (auto& [ep, value] : map) {
+        REQUIRE(reference.at(ep) == value);
+        ++visited;
+    }
+
+    REQUIRE(visited == reference.size());
+}
+
+TEST_CASE("Endpoint map keeps IPv4 and IPv4-mapped IPv6 endpoints apart", "[endpoint_map]") {
+    auto map = trellis::_detail::endpoint_map<int>{};
+
+    auto v4 = asio::ip::udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 1234);
+    auto mapped = asio::ip::udp::endpoint(asio::ip::make_address_v6("::ffff:127.0.0.1"), 1234);
+    auto other_port = asio::ip::udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 1235);
+
+    REQUIRE(map.emplace(v4, 1).second);
+    REQUIRE(map.find(mapped) == map.end());
+    REQUIRE(map.emplace(mapped, 2).second);
+    REQUIRE(map.emplace(other_port, 3).second);
+
+    REQUIRE(map.find(v4)->second == 1);
+    REQUIRE(map.find(mapped)->second == 2);
+    REQUIRE(map.find(other_port)->second == 3);
+
+    REQUIRE(map.erase(v4) == 1);
+    REQUIRE(map.find(v4) == map.end());
+    REQUIRE(map.find(mapped)->second == 2);
+}
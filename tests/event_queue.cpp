@@ -0,0 +1,144 @@
+#include "catch.hpp"
+
+#include <trellis/event_queue.hpp>
+
+#include <memory>
+#include <vector>
+
+using trellis::event_queue_policy;
+using trellis::_detail::event_queue;
+
+TEST_CASE("Event queue drains in order across wraparound", "[event_queue]") {
+    auto queue = event_queue<int>(4);
+
+    REQUIRE(queue.capacity() == 4);
+
+    auto next_push = 0;
+    auto next_pop = 0;
+
+    for (int round = 0; round < 10; ++round) {
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(queue.push(next_push++, false));
+        }
+
+        REQUIRE(queue.size() == 3);
+
+        auto count = queue.pop_batch([&](int& value) {
+            REQUIRE(value == next_pop);
+            ++next_pop;
+        });
+
+        REQUIRE(count == 3);
+        REQUIRE(queue.size() == 0);
+    }
+
+    REQUIRE(queue.capacity() == 4);
+    REQUIRE(queue.high_water() == 3);
+}
+
+TEST_CASE("Event queue grows when full", "[event_queue]") {
+    auto queue = event_queue<int>(4);
+
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(queue.push(int(i), true));
+    }
+
+    // 4 + 8 + 16 slots across three rings.
+    REQUIRE(queue.ring_capacity() == 16);
+    REQUIRE(queue.capacity() == 4);
+    REQUIRE(queue.size() == 20);
+    REQUIRE(!queue.empty());
+    REQUIRE(queue.high_water() == 20);
+
+    auto values = std::vector<int>{};
+    queue.pop_batch([&](int& value) { values.push_back(value); });
+
+    REQUIRE(values.size() == 20);
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(values[i] == i);
+    }
+
+    REQUIRE(queue.empty());
+
+    // The old rings are freed, so the queue keeps working from the largest one.
+    REQUIRE(queue.push(20, false));
+    REQUIRE(queue.pop_batch([](int& value) { REQUIRE(value == 20); }) == 1);
+}
+
+TEST_CASE("Event queue drops unreliable values when full", "[event_queue]") {
+    auto queue = event_queue<int>(4);
+    queue.set_policy(event_queue_policy::drop_unreliable);
+
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.push(int(i), true));
+    }
+
+    REQUIRE(!queue.push(4, true));
+    REQUIRE(queue.dropped() == 1);
+    REQUIRE(queue.capacity() == 4);
+
+    // Values that can't be dropped grow the queue instead.
+    REQUIRE(queue.push(5, false));
+    REQUIRE(queue.ring_capacity() == 8);
+    REQUIRE(queue.capacity() == 4);
+
+    // The grown ring has room, but droppable values are still held to the configured capacity.
+    for (int i = 6; i < 14; ++i) {
+        REQUIRE(!queue.push(int(i), true));
+    }
+
+    REQUIRE(queue.dropped() == 9);
+    REQUIRE(queue.size() == 5);
+
+    auto values = std::vector<int>{};
+    queue.pop_batch([&](int& value) { values.push_back(value); });
+
+    REQUIRE(values == std::vector<int>{0, 1, 2, 3, 5});
+
+    // Once drained, droppable values are accepted again.
+    REQUIRE(queue.push(14, true));
+}
+
+TEST_CASE("Event queue destroys values left in it", "[event_queue]") {
+    auto tracker = std::make_shared<int>(0);
+
+    {
+        auto queue = event_queue<std::shared_ptr<int>>(2);
+
+        for (int i = 0; i < 5; ++i) {
+            queue.push(std::shared_ptr<int>(tracker), false);
+        }
+
+        queue.pop_batch([&](std::shared_ptr<int>& value) {});
+        queue.push(std::shared_ptr<int>(tracker), false);
+
+        REQUIRE(tracker.use_count() == 2);
+    }
+
+    REQUIRE(tracker.use_count() == 1);
+}
+
+TEST_CASE("Event queue keeps every value and reports when it is full under the block policy", "[event_queue]") {
+    auto queue = event_queue<int>(4);
+    queue.set_policy(event_queue_policy::block);
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(queue.push(int(i), true));
+    }
+
+    REQUIRE(!queue.full());
+
+    // Pushing never waits, it is up to the producer to stop once the queue is full.
+    for (int i = 3; i < 6; ++i) {
+        REQUIRE(queue.push(int(i), true));
+        REQUIRE(queue.full());
+    }
+
+    REQUIRE(queue.dropped() == 0);
+
+    auto values = std::vector<int>{};
+    queue.pop_batch([&](int& value) { values.push_back(value); });
+
+    REQUIRE(values == std::vector<int>{0, 1, 2, 3, 4, 5});
+    REQUIRE(!queue.full());
+}
@@ -0,0 +1,77 @@
+#include "catch.hpp"
+
+#include <trellis/message_pool.hpp>
+
+TEST_CASE("Message pool reuses freed blocks", "[message_pool]") {
+    auto pool = trellis::_detail::message_pool();
+
+    auto a = pool.allocate(3000);
+    REQUIRE(a);
+    REQUIRE(a.capacity() == 4096);
+
+    auto ptr = a.get();
+    a.reset();
+
+    auto stats = pool.get_stats();
+    REQUIRE(stats.bytes_in_use == 0);
+    REQUIRE(stats.bytes_cached == 4096);
+    REQUIRE(stats.allocations == 1);
+
+    auto b = pool.allocate(4000);
+    REQUIRE(b.get() == ptr);
+
+    stats = pool.get_stats();
+    REQUIRE(stats.bytes_in_use == 4096);
+    REQUIRE(stats.bytes_cached == 0);
+    REQUIRE(stats.reuses == 1);
+}
+
+TEST_CASE("Message pool tracks high water mark", "[message_pool]") {
+    auto pool = trellis::_detail::message_pool();
+
+    {
+        auto a = pool.allocate(1);
+        auto b = pool.allocate(5000);
+        REQUIRE(a.capacity() == trellis::_detail::message_pool::min_block_size);
+        REQUIRE(b.capacity() == 8192);
+    }
+
+    auto c = pool.allocate(100);
+
+    auto stats = pool.get_stats();
+    REQUIRE(stats.bytes_in_use == 2048);
+    REQUIRE(stats.bytes_high_water == 2048 + 8192);
+}
+
+TEST_CASE("Message pool enforces memory cap", "[message_pool]") {
+    auto pool = trellis::_detail::message_pool();
+
+    pool.set_memory_cap(10000);
+
+    auto a = pool.allocate(8000);
+    REQUIRE(a);
+
+    auto b = pool.allocate(2048);
+    REQUIRE(!b);
+    REQUIRE(pool.get_stats().rejections == 1);
+
+    a.reset();
+
+    b = pool.allocate(2048);
+    REQUIRE(b);
+
+    // The cached 8K block no longer fits alongside the 2K block in use.
+    pool.set_memory_cap(4096);
+
+    auto stats = pool.get_stats();
+    REQUIRE(stats.bytes_in_use == 2048);
+    REQUIRE(stats.bytes_cached == 0);
+}
+
+TEST_CASE("Message pool handles the largest message", "[message_pool]") {
+    auto pool = trellis::_detail::message_pool();
+
+    auto a = pool.allocate(trellis::_detail::message_pool::max_message_size);
+    REQUIRE(a);
+    REQUIRE(a.capacity() >= trellis::_detail::message_pool::max_message_size);
+}
@@ -0,0 +1,148 @@
+#include "catch.hpp"
+
+#include <trellis/pending_acks.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using trellis::_detail::pending_acks;
+using trellis::_detail::shared_datagram_buffer;
+using trellis::_detail::datagram_buffer_cache;
+namespace headers = trellis::_detail::headers;
+
+namespace {
+
+struct parsed_block {
+    headers::data_ack header;
+    std::vector<headers::data_ack_range> ranges;
+};
+
+auto flush_and_parse(pending_acks& acks, datagram_buffer_cache& cache, std::size_t& datagrams) -> std::vector<parsed_block> {
+    auto blocks = std::vector<parsed_block>{};
+
+    acks.flush([&] {
+        return cache.make_pending_buffer();
+    }, [&](const shared_datagram_buffer& buffer, std::size_t size) {
+        REQUIRE(size <= trellis::config::datagram_size);
+
+        auto type = headers::type{};
+        std::memcpy(&type, buffer.data(), sizeof(type));
+
+        REQUIRE(type == headers::type::DATA_ACK);
+
+        ++datagrams;
+
+        auto offset = sizeof(headers::type);
+
+        while (offset < size) {
+            auto block = parsed_block{};
+            std::memcpy(&block.header, buffer.data() + offset, sizeof(block.header));
+            offset += sizeof(block.header);
+
+            block.ranges.resize(block.header.range_count);
+            std::memcpy(block.ranges.data(), buffer.data() + offset, block.header.range_count * sizeof(headers::data_ack_range));
+            offset += block.header.range_count * sizeof(headers::data_ack_range);
+
+            // Ranges are in no particular order, since the sender looks each one up directly.
+            std::sort(block.ranges.begin(), block.ranges.end(), [](const headers::data_ack_range& a, const headers::data_ack_range& b) {
+                return a.sequence_id < b.sequence_id || (a.sequence_id == b.sequence_id && a.first_fragment < b.first_fragment);
+            });
+
+            blocks.push_back(std::move(block));
+        }
+
+        REQUIRE(offset == size);
+    });
+
+    return blocks;
+}
+
+} // namespace
+
+TEST_CASE("Pending acks coalesce fragments into ranges", "[pending_acks]") {
+    auto cache = datagram_buffer_cache{};
+    auto acks = pending_acks{};
+    auto datagrams = std::size_t(0);
+
+    REQUIRE(acks.empty());
+
+    // 200 fragments of one message, out of order, with a duplicate.
+    for (auto fid = 199; fid >= 0; --fid) {
+        acks.add(0, 5, 7, fid);
+    }
+
+    acks.add(0, 5, 7, 3);
+
+    // Fragments of an already delivered message are covered by the expected sequence ID.
+    acks.add(0, 6, 4, 0);
+
+    // A second channel.
+    acks.add(2, 0, 1, 0);
+
+    REQUIRE(!acks.empty());
+
+    auto blocks = flush_and_parse(acks, cache, datagrams);
+
+    REQUIRE(acks.empty());
+    REQUIRE(datagrams == 1);
+    REQUIRE(blocks.size() == 2);
+
+    REQUIRE(blocks[0].header.channel_id == 0);
+    REQUIRE(blocks[0].header.expected_sequence_id == 6);
+    REQUIRE(blocks[0].ranges.size() == 4);
+
+    for (auto i = 0; i < 4; ++i) {
+        REQUIRE(blocks[0].ranges[i].sequence_id == 7);
+        REQUIRE(blocks[0].ranges[i].first_fragment == i * 64);
+        REQUIRE(blocks[0].ranges[i].fragments == (i < 3 ? ~std::uint64_t(0) : (std::uint64_t(1) << 8) - 1));
+    }
+
+    REQUIRE(blocks[1].header.channel_id == 2);
+    REQUIRE(blocks[1].header.expected_sequence_id == 0);
+    REQUIRE(blocks[1].ranges.size() == 1);
+    REQUIRE(blocks[1].ranges[0].fragments == 1);
+
+    // Nothing left to send.
+    blocks = flush_and_parse(acks, cache, datagrams);
+
+    REQUIRE(blocks.empty());
+    REQUIRE(datagrams == 1);
+}
+
+TEST_CASE("Pending acks split across datagrams when full", "[pending_acks]") {
+    auto cache = datagram_buffer_cache{};
+    auto acks = pending_acks{};
+    auto datagrams = std::size_t(0);
+
+    constexpr auto count = 1000;
+
+    // One fragment from each of many messages.
+    for (auto sid = count - 1; sid >= 0; --sid) {
+        acks.add(1, 0, sid, 0);
+    }
+
+    auto blocks = flush_and_parse(acks, cache, datagrams);
+
+    REQUIRE(datagrams > 1);
+    REQUIRE(datagrams < count / 50);
+
+    auto sids = std::vector<trellis::config::sequence_id_t>{};
+
+    for (auto& block : blocks) {
+        REQUIRE(block.header.channel_id == 1);
+
+        for (auto& range : block.ranges) {
+            REQUIRE(range.fragments == 1);
+            sids.push_back(range.sequence_id);
+        }
+    }
+
+    std::sort(sids.begin(), sids.end());
+
+    REQUIRE(sids.size() == count);
+
+    for (auto i = 0; i < count; ++i) {
+        REQUIRE(sids[i] == trellis::config::sequence_id_t(i));
+    }
+}
@@ -0,0 +1,84 @@
+#include "catch.hpp"
+
+#include <trellis/rtt_estimator.hpp>
+
+#include <chrono>
+
+using trellis::_detail::rtt_estimator;
+
+using namespace std::chrono_literals;
+
+TEST_CASE("RTT estimator starts at the initial timeout", "[rtt_estimator]") {
+    auto rtt = rtt_estimator();
+
+    REQUIRE(rtt.get_sample_count() == 0);
+    REQUIRE(rtt.get_smoothed_rtt() == 0ms);
+    REQUIRE(rtt.get_rto() == trellis::config::initial_rto);
+}
+
+TEST_CASE("RTT estimator converges on a steady link", "[rtt_estimator]") {
+    auto rtt = rtt_estimator();
+
+    rtt.sample(150ms);
+
+    // The first sample sets the variance to half the RTT.
+    REQUIRE(rtt.get_smoothed_rtt() == 150ms);
+    REQUIRE(rtt.get_rtt_variance() == 75ms);
+    REQUIRE(rtt.get_rto() == 450ms);
+
+    for (auto i = 0; i < 100; ++i) {
+        rtt.sample(150ms);
+    }
+
+    REQUIRE(rtt.get_smoothed_rtt() == 150ms);
+    REQUIRE(rtt.get_rtt_variance() < 1ms);
+    REQUIRE(rtt.get_rto() >= 150ms + trellis::config::timer_wheel_tick);
+    REQUIRE(rtt.get_rto() < 155ms);
+}
+
+TEST_CASE("RTT estimator tracks jitter", "[rtt_estimator]") {
+    auto steady = rtt_estimator();
+    auto jittery = rtt_estimator();
+
+    for (auto i = 0; i < 100; ++i) {
+        steady.sample(100ms);
+        jittery.sample(i % 2 ? 80ms : 120ms);
+    }
+
+    REQUIRE(jittery.get_smoothed_rtt() > 90ms);
+    REQUIRE(jittery.get_smoothed_rtt() < 110ms);
+    REQUIRE(jittery.get_rtt_variance() > 10ms);
+    REQUIRE(jittery.get_rto() > steady.get_rto() + 40ms);
+}
+
+TEST_CASE("RTT estimator clamps and backs off", "[rtt_estimator]") {
+    auto rtt = rtt_estimator();
+
+    for (auto i = 0; i < 10; ++i) {
+        rtt.sample(100us);
+    }
+
+    REQUIRE(rtt.get_rto() == trellis::config::min_rto);
+
+    REQUIRE(rtt.get_timeout(0) == trellis::config::min_rto);
+    REQUIRE(rtt.get_timeout(1) == trellis::config::min_rto * 2);
+    REQUIRE(rtt.get_timeout(2) == trellis::config::min_rto * 4);
+
+    // Every resend doubles the timeout until it hits the cap, and it stays there.
+    auto attempts = 0;
+
+    while (rtt.get_timeout(attempts) < trellis::config::max_rto) {
+        REQUIRE(rtt.get_timeout(attempts) == trellis::config::min_rto * (1 << attempts));
+        ++attempts;
+    }
+
+    REQUIRE(trellis::config::min_rto * (1 << attempts) >= trellis::config::max_rto);
+    REQUIRE(rtt.get_timeout(attempts) == trellis::config::max_rto);
+    REQUIRE(rtt.get_timeout(100) == trellis::config::max_rto);
+
+    rtt.sample(1h);
+
+    REQUIRE(rtt.get_timeout(100) == trellis::config::max_rto);
+
+    REQUIRE(rtt.get_rto() == trellis::config::max_rto);
+}
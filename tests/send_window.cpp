@@ -0,0 +1,240 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/send_window.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+using trellis::_detail::send_window;
+using trellis::_detail::timer_wheel;
+
+namespace {
+
+using namespace std::chrono_literals;
+
+struct fragment {
+    trellis::config::sequence_id_t sequence_id;
+    std::size_t fragment_id;
+};
+
+} // namespace
+
+TEST_CASE("Send window matches a set under random pushes and acks", "[send_window]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto window = send_window<fragment>([](fragment&) {}, [](int) { return timer_wheel::duration(1h); }, wheel);
+
+    auto rng = std::mt19937{};
+    auto model = std::set<std::pair<trellis::config::sequence_id_t, std::size_t>>{};
+
+    // Start close to the wrap, so sequence IDs roll over.
+    auto next = trellis::config::sequence_id_t(-100);
+    auto acked_before = next;
+
+    for (auto i = 0; i < 20000; ++i) {
+        switch (rng() % 4) {
+            case 0:
+            case 1: {
+                // Push a message, with its fragments in random order.
+                auto count = trellis::config::fragment_id_t(1 + rng() % (rng() % 8 == 0 ? 255 : 4));
+                auto order = std::vector<trellis::config::fragment_id_t>{};
+
+                for (auto f = 0; f < count; ++f) {
+                    order.push_back(trellis::config::fragment_id_t(f));
+                }
+
+                std::shuffle(order.begin(), order.end(), rng);
+
+                window.open(next);
+
+                for (auto f : order) {
+                    window.push(next, f, count, {next, f});
+                    model.emplace(next, f);
+                }
+
+                ++next;
+                break;
+            }
+            case 2: {
+                // Selectively ack a fragment, which may not be pending.
+                if (next == acked_before) break;
+
+                auto sid = trellis::config::sequence_id_t(acked_before + rng() % trellis::config::sequence_id_t(next - acked_before + 2));
+                auto fid = std::size_t(rng() % 8);
+                auto removed = window.remove(sid, fid, [&](fragment& f) {
+                    REQUIRE(f.sequence_id == sid);
+                    REQUIRE(f.fragment_id == fid);
+                });
+
+                REQUIRE(removed == (model.erase({sid, fid}) == 1));
+                break;
+            }
+            case 3: {
+                // Cumulatively ack a few messages.
+                if (rng() % 4 != 0 || next == acked_before) break;
+
+                acked_before += trellis::config::sequence_id_t(rng() % (next - acked_before + 1));
+
+                auto expected = std::size_t(0);
+
+                for (auto iter = model.begin(); iter != model.end();) {
+                    if (trellis::_detail::sequence_id_less(iter->first, acked_before)) {
+                        iter = model.erase(iter);
+                        ++expected;
+                    } else {
+                        ++iter;
+                    }
+                }
+
+                REQUIRE(window.remove_before(acked_before) == expected);
+                break;
+            }
+        }
+
+        REQUIRE(window.size() == model.size());
+        REQUIRE(wheel.size() == model.size());
+    }
+
+    window.clear();
+
+    REQUIRE(window.size() == 0);
+    REQUIRE(wheel.size() == 0);
+}
+
+TEST_CASE("Send window retries unacked fragments with backoff", "[send_window]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto retries = std::vector<std::pair<trellis::config::sequence_id_t, std::size_t>>{};
+
+    auto window = send_window<fragment>([&](fragment& f) {
+        retries.emplace_back(f.sequence_id, f.fragment_id);
+    }, [](int attempts) {
+        return timer_wheel::duration(10ms * (1 << attempts));
+    }, wheel);
+
+    window.open(0);
+    window.open(1);
+    window.push(0, 0, 2, {0, 0});
+    window.push(0, 1, 2, {0, 1});
+    window.push(1, 0, 1, {1, 0});
+
+    REQUIRE(window.remove(0, 1, [](fragment&) {}));
+    REQUIRE(!window.remove(0, 1, [](fragment&) {}));
+
+    // Attempts are due at 10ms, 30ms, and 70ms.
+    io.run_for(50ms);
+
+    REQUIRE(retries.size() == 4);
+
+    for (auto& [sid, fid] : retries) {
+        REQUIRE(fid == 0);
+    }
+
+    REQUIRE(window.remove_before(1) == 1);
+    REQUIRE(window.size() == 1);
+
+    retries.clear();
+    window.clear();
+
+    io.run_for(100ms);
+
+    REQUIRE(retries.empty());
+    REQUIRE(wheel.size() == 0);
+}
+
+TEST_CASE("Send window spans from the oldest unacked message to the newest opened", "[send_window]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto window = send_window<fragment>([](fragment&) {}, [](int) { return timer_wheel::duration(1h); }, wheel);
+
+    REQUIRE(window.span() == 0);
+
+    // Fragments of messages that haven't been opened are dropped.
+    REQUIRE(!window.push(5, 0, 1, {5, 0}));
+
+    window.open(5);
+    window.open(6);
+    window.open(7);
+
+    REQUIRE(window.span() == 3);
+    REQUIRE(window.is_open(6));
+    REQUIRE(!window.is_open(8));
+
+    REQUIRE(window.push(5, 0, 1, {5, 0}));
+    REQUIRE(window.push(6, 0, 1, {6, 0}));
+    REQUIRE(window.push(7, 0, 2, {7, 0}));
+
+    // Acking a newer message doesn't move the window past an older one.
+    REQUIRE(window.remove(6, 0, [](fragment&) {}));
+    REQUIRE(window.span() == 3);
+
+    REQUIRE(window.remove(5, 0, [](fragment&) {}));
+    REQUIRE(window.span() == 1);
+    REQUIRE(!window.is_open(6));
+
+    // A message whose fragments haven't all been pushed holds the window even once its pushed fragments are acked.
+    REQUIRE(window.remove(7, 0, [](fragment&) {}));
+    REQUIRE(window.span() == 1);
+
+    REQUIRE(window.push(7, 1, 2, {7, 1}));
+    REQUIRE(window.remove(7, 1, [](fragment&) {}));
+    REQUIRE(window.span() == 0);
+
+    // An empty window starts wherever the next message is.
+    window.open(100);
+
+    REQUIRE(window.span() == 1);
+    REQUIRE(window.is_open(100));
+
+    // A message older than the window isn't opened, and its fragments are dropped.
+    window.open(99);
+
+    REQUIRE(window.span() == 1);
+    REQUIRE(!window.is_open(99));
+    REQUIRE(!window.push(99, 0, 1, {99, 0}));
+    REQUIRE(window.size() == 0);
+}
+
+TEST_CASE("Send window resends fragments that newer acks have overtaken", "[send_window]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto resent = std::vector<trellis::config::sequence_id_t>{};
+
+    auto window = send_window<fragment>([&](fragment& f) {
+        resent.push_back(f.sequence_id);
+    }, [](int) { return timer_wheel::duration(1h); }, wheel);
+
+    for (auto sid = trellis::config::sequence_id_t(0); sid < 8; ++sid) {
+        window.open(sid);
+        window.push(sid, 0, 1, {sid, 0});
+    }
+
+    // Nothing has been acked yet.
+    REQUIRE(window.resend_lost(3) == 0);
+
+    // 0 is three behind 3.
+    REQUIRE(window.remove(3, 0, [](fragment&) {}));
+    REQUIRE(window.resend_lost(3) == 1);
+    REQUIRE(resent == std::vector<trellis::config::sequence_id_t>{0});
+
+    // 1 and 2 are overtaken by 5, but 0 was resent after 5 was sent, so it waits for newer acks.
+    REQUIRE(window.remove(5, 0, [](fragment&) {}));
+    REQUIRE(window.resend_lost(3) == 2);
+    REQUIRE(resent == std::vector<trellis::config::sequence_id_t>{0, 1, 2});
+
+    // 4 is too close to 6 to be declared lost.
+    REQUIRE(window.remove(6, 0, [](fragment&) {}));
+    REQUIRE(window.resend_lost(3) == 0);
+
+    // 7 was sent before the resends, so acking it doesn't overtake them, but it does overtake 4.
+    REQUIRE(window.remove(7, 0, [](fragment&) {}));
+    REQUIRE(window.resend_lost(3) == 1);
+    REQUIRE(resent == std::vector<trellis::config::sequence_id_t>{0, 1, 2, 4});
+
+    REQUIRE(window.size() == 4);
+}
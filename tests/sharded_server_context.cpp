@@ -0,0 +1,209 @@
+#include "catch.hpp"
+
+#include "context_handler.hpp"
+
+#include <asio.hpp>
+#include <trellis/trellis.hpp>
+
+#include <array>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using channel_A = trellis::channel_type_reliable_ordered<struct A>;
+
+using client_type = trellis::client_context<channel_A>;
+using client_handler_type = context_handler<
+    client_type,
+    std::function<void(const client_type::connection_ptr&)>,
+    std::function<void(const client_type::connection_ptr&, asio::error_code)>,
+    std::function<void(channel_A, const client_type::connection_ptr&, std::istream&)>>;
+
+TEST_CASE("Sharded server receives from many clients", "[sharded_server_context]") {
+    constexpr auto CLIENTS = 8;
+    constexpr auto COUNT = 100;
+
+    asio::io_context io;
+
+    auto server = trellis::sharded_server_context<channel_A>(io, 4);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    auto clients = std::array<std::unique_ptr<client_type>, CLIENTS>{};
+
+    for (auto& client : clients) {
+        client = std::make_unique<client_type>(io);
+        client->connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+    }
+
+    auto timeout = asio::steady_timer(io, std::chrono::seconds{5});
+    timeout.async_wait([&](auto ec) {
+        REQUIRE(ec == asio::error::operation_aborted);
+        server.stop();
+        for (auto& client : clients) {
+            client->stop();
+        }
+        io.stop();
+    });
+
+    int connected = 0;
+    int received = 0;
+
+    // Each connection's messages, in the order they arrived.
+    auto next = std::map<const void*, int>{};
+
+    auto server_handler = context_handler{
+        server,
+        [&](const auto& conn_ptr) {
+            ++connected;
+        },
+        [&](const auto& conn, asio::error_code ec) {},
+        [&](channel_A, const auto& conn, std::istream& packet) {
+            int i;
+            packet.read(reinterpret_cast<char*>(&i), sizeof(i));
+            REQUIRE(i == next[conn.get()]);
+            ++next[conn.get()];
+            ++received;
+            if (received == CLIENTS * COUNT) {
+                REQUIRE(timeout.cancel() == 1);
+            }
+        },
+    };
+
+    auto client_handlers = std::vector<std::unique_ptr<client_handler_type>>{};
+
+    for (auto& client : clients) {
+        client_handlers.push_back(std::make_unique<client_handler_type>(
+            *client,
+            [&](const auto& conn_ptr) {
+                for (int i = 0; i < COUNT; ++i) {
+                    conn_ptr->template send<channel_A>([&](std::ostream& ostream) {
+                        ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                    });
+                }
+            },
+            [&](const auto& conn, asio::error_code ec) {},
+            [&](channel_A, const auto& conn, std::istream& packet) {}));
+    }
+
+    server_handler.poll();
+    for (auto& handler : client_handlers) {
+        handler->poll();
+    }
+    io.run();
+
+    REQUIRE(connected == CLIENTS);
+    REQUIRE(received == CLIENTS * COUNT);
+
+    // Which shard a client lands on is up to the kernel, but every client must have been served in full by one connection.
+    REQUIRE(next.size() == CLIENTS);
+
+    for (auto& [conn, count] : next) {
+        REQUIRE(count == COUNT);
+    }
+
+    auto shard_datagrams = std::uint64_t(0);
+
+    for (auto i = std::size_t(0); i < server.get_shard_count(); ++i) {
+        shard_datagrams += server.get_shard(i).get_stats().datagrams_received;
+    }
+
+    REQUIRE(server.get_stats().datagrams_received >= CLIENTS * COUNT);
+    REQUIRE(server.get_stats().datagrams_received == shard_datagrams);
+}
+
+TEST_CASE("Sharded server wakes a waiting thread when any shard has events", "[sharded_server_context]") {
+    constexpr auto CLIENTS = 4;
+    constexpr auto COUNT = 100;
+
+    using server_type = trellis::sharded_server_context<channel_A>;
+
+    asio::io_context io;
+
+    auto server = server_type(io, 4);
+
+    server.listen({asio::ip::make_address_v4("127.0.0.1"), 0});
+
+    struct client_handler {
+        void on_connect(const client_type::connection_ptr& conn) {
+            for (int i = 0; i < COUNT; ++i) {
+                conn->template send<channel_A>([&](std::ostream& ostream) {
+                    ostream.write(reinterpret_cast<const char*>(&i), sizeof(i));
+                });
+            }
+        }
+
+        void on_disconnect(const client_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const client_type::connection_ptr& conn, std::istream& packet) {}
+    };
+
+    auto chandler = client_handler{};
+    auto clients = std::array<std::unique_ptr<client_type>, CLIENTS>{};
+
+    for (auto& client : clients) {
+        client = std::make_unique<client_type>(io, chandler);
+        client->connect({asio::ip::udp::v4(), 0}, server.get_endpoint());
+    }
+
+    auto io_thread = std::thread([&]{ io.run(); });
+
+    struct server_handler {
+        int connected = 0;
+        int received = 0;
+
+        void on_connect(const server_type::connection_ptr& conn) {
+            ++connected;
+        }
+
+        void on_disconnect(const server_type::connection_ptr& conn, asio::error_code ec) {}
+
+        void on_receive(channel_A, const server_type::connection_ptr& conn, std::istream& packet) {
+            ++received;
+        }
+    };
+
+    auto shandler = server_handler{};
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+
+    while (shandler.received < CLIENTS * COUNT && std::chrono::steady_clock::now() < deadline) {
+        if (server.wait_for_events(std::chrono::seconds{1})) {
+            server.poll_events(shandler);
+        }
+    }
+
+    REQUIRE(shandler.connected == CLIENTS);
+    REQUIRE(shandler.received == CLIENTS * COUNT);
+
+    // Nothing else is coming, so the wait should time out.
+    REQUIRE(!server.wait_for_events(std::chrono::milliseconds{20}));
+
+    server.stop();
+    for (auto& client : clients) {
+        client->stop();
+    }
+    io.stop();
+    io_thread.join();
+}
+
+TEST_CASE("Sharded server forwards configuration to every shard", "[sharded_server_context]") {
+    asio::io_context io;
+
+    auto server = trellis::sharded_server_context<channel_A>(io, 3);
+
+    server.set_datagram_size(trellis::config::max_datagram_size);
+    server.set_mtu_probing(true);
+    server.set_receive_batch_size(4);
+    server.set_event_queue_policy(trellis::event_queue_policy::block);
+    server.set_event_queue_capacity(64);
+
+    for (auto i = std::size_t(0); i < server.get_shard_count(); ++i) {
+        REQUIRE(server.get_shard(i).get_datagram_size() == trellis::config::max_datagram_size);
+        REQUIRE(server.get_shard(i).get_mtu_probing());
+        REQUIRE(server.get_shard(i).get_receive_batch_size() == 4);
+        REQUIRE(server.get_shard(i).get_event_queue_policy() == trellis::event_queue_policy::block);
+        REQUIRE(server.get_shard(i).get_event_queue_capacity() == 64);
+    }
+}
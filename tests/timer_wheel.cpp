@@ -0,0 +1,181 @@
+#include "catch.hpp"
+
+#include <asio.hpp>
+#include <trellis/timer_wheel.hpp>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+using trellis::_detail::timer_node;
+using trellis::_detail::timer_wheel;
+using trellis::_detail::wheel_timer;
+
+namespace {
+
+using namespace std::chrono_literals;
+
+struct test_node : timer_node {
+    timer_wheel::time_point when;
+    timer_wheel::time_point fired_at;
+    bool fired = false;
+
+    static inline timer_wheel::time_point now;
+
+    static void fire(timer_node& node) {
+        auto& self = static_cast<test_node&>(node);
+        self.fired = true;
+        self.fired_at = now;
+    }
+};
+
+} // namespace
+
+TEST_CASE("Timer wheel fires nodes on time when advanced by hand", "[timer_wheel]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto start = timer_wheel::clock_type::now();
+
+    // Cover every level, the top level's wrap, and nodes parked beyond it.
+    auto delays = std::vector<std::chrono::milliseconds>{1ms, 5ms, 63ms, 64ms, 65ms, 4095ms, 4096ms, 300000ms, 5h, 10h};
+    auto nodes = std::vector<std::unique_ptr<test_node>>{};
+
+    for (auto delay : delays) {
+        auto node = std::make_unique<test_node>();
+        node->when = start + delay;
+        wheel.schedule(*node, node->when, &test_node::fire);
+        nodes.push_back(std::move(node));
+    }
+
+    REQUIRE(wheel.size() == delays.size());
+
+    // Advance a millisecond at a time around each expiry, and in big steps in between.
+    auto now = start;
+
+    for (auto delay : delays) {
+        auto coarse = start + delay - 2ms;
+
+        while (now < coarse) {
+            now = std::min(coarse, now + 997ms);
+            test_node::now = now;
+            wheel.advance(now);
+        }
+
+        for (auto i = 0; i < 4; ++i) {
+            now += 1ms;
+            test_node::now = now;
+            wheel.advance(now);
+        }
+    }
+
+    REQUIRE(wheel.size() == 0);
+
+    for (auto& node : nodes) {
+        REQUIRE(node->fired);
+        REQUIRE(node->fired_at >= node->when);
+        REQUIRE(node->fired_at - node->when <= 2 * timer_wheel::tick());
+    }
+}
+
+TEST_CASE("Timer wheel survives random scheduling and cancelling", "[timer_wheel]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto start = timer_wheel::clock_type::now();
+
+    auto rng = std::mt19937{};
+    auto nodes = std::vector<std::unique_ptr<test_node>>{};
+    auto cancelled = std::vector<bool>{};
+    auto now = start;
+
+    for (auto i = 0; i < 50000; ++i) {
+        now += std::chrono::milliseconds(rng() % 4 == 0 ? rng() % 2000 : rng() % 3);
+        test_node::now = now;
+        wheel.advance(now);
+
+        if (rng() % 4 != 0) {
+            auto node = std::make_unique<test_node>();
+            node->when = now + std::chrono::milliseconds(rng() % 2 ? rng() % 300 : rng() % 100000);
+            wheel.schedule(*node, node->when, &test_node::fire);
+            nodes.push_back(std::move(node));
+            cancelled.push_back(false);
+        } else if (!nodes.empty()) {
+            auto index = rng() % nodes.size();
+            cancelled[index] = cancelled[index] || wheel.cancel(*nodes[index]);
+        }
+    }
+
+    while (wheel.size() > 0) {
+        now += 1s;
+        test_node::now = now;
+        wheel.advance(now);
+    }
+
+    for (auto i = std::size_t(0); i < nodes.size(); ++i) {
+        REQUIRE(nodes[i]->fired != cancelled[i]);
+
+        if (nodes[i]->fired) {
+            REQUIRE(nodes[i]->fired_at >= nodes[i]->when);
+        }
+    }
+}
+
+TEST_CASE("Wheel timers fire through the io_context", "[timer_wheel]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto guard = std::make_shared<int>(0);
+
+    auto fired = std::vector<int>{};
+    auto timers = std::vector<std::unique_ptr<wheel_timer<int>>>{};
+
+    for (auto i = 0; i < 5; ++i) {
+        auto timer = std::make_unique<wheel_timer<int>>(wheel);
+        auto expiry = timer_wheel::clock_type::now() + std::chrono::milliseconds(10 * (5 - i));
+
+        timer->expires_at(expiry);
+        timer->async_wait(guard, [&fired, i, expiry](asio::error_code ec) {
+            REQUIRE(!ec);
+            REQUIRE(timer_wheel::clock_type::now() >= expiry);
+            fired.push_back(i);
+        });
+
+        timers.push_back(std::move(timer));
+    }
+
+    // Cancelled and re-armed waits are dropped without calling their handler.
+    REQUIRE(timers[0]->cancel() == 1);
+    REQUIRE(timers[0]->cancel() == 0);
+    REQUIRE(timers[1]->expires_from_now(1ms) == 1);
+
+    auto rearmed = false;
+    timers[1]->async_wait(guard, [&](asio::error_code ec) {
+        rearmed = true;
+    });
+
+    io.run();
+
+    REQUIRE(rearmed);
+    REQUIRE(fired == std::vector<int>{4, 3, 2});
+    REQUIRE(wheel.size() == 0);
+}
+
+TEST_CASE("Wheel timers skip handlers whose guard has expired", "[timer_wheel]") {
+    auto io = asio::io_context{};
+    auto wheel = timer_wheel(io.get_executor());
+    auto guard = std::make_shared<int>(0);
+
+    auto timer = wheel_timer<int>(wheel);
+    auto called = false;
+
+    timer.expires_from_now(1ms);
+    timer.async_wait(guard, [&](asio::error_code ec) {
+        called = true;
+    });
+
+    guard.reset();
+
+    io.run();
+
+    REQUIRE(!called);
+    REQUIRE(wheel.size() == 0);
+}